@@ -3,7 +3,6 @@
 // Project: FmTuner, WebKit-based FM tuner UI
 // (c) 2012, David Switzer
 
-#include <math.h>
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -11,137 +10,731 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
-#include <sys/ioctl.h>
 #include <limits.h>
+#include <glib.h>
 
-#include "videodev.h"
+#include "fmdriverif.h"
+#include "stationcache.h"
+#include "tunerprops.h"
 #include "FMTuner.h"
 
-// device fspec for Si470x FM tuner driver
-#define SI470X_DEVICE		"/dev/radio0"
 // tuner IDs
 #define PRIMARY_TUNER_ID	0
+// Station cache, kept in the user's home directory
+#define STATION_CACHE_FILE	".fmtuner-stations"
 
-// FM radio region enum
-enum fm_region
+// Frequencies are kHz everywhere but the page, which sees MHz (e.g. 101.5)
+#define KHZ_PER_MHZ		1000
+
+// Events drained from the driver interface per pass
+#define TUNER_EVENT_BATCH	16
+
+// Callbacks a page can set on the tuner, each called at most once per main loop pass however
+// many events came in for it
+enum tuner_callback
 {
-	FM_REGION_AMERICAS,
-	FM_REGION_EUAFRICA,
-	FM_REGION_JPN,
-	FM_REGION_OTHER		// 50kHz spacing
-}; 
+	TUNER_CALLBACK_TUNE,		// ontune(frequency)
+	TUNER_CALLBACK_SEEK,		// onseek(frequency)
+	TUNER_CALLBACK_SCAN,		// onscan(stations found, status) -- 0, or an errno such as
+					// ECANCELED, in which case the last table stands
+	TUNER_CALLBACK_RDS,		// onrdschange(state), state as from getState()
+	TUNER_CALLBACKS
+};
 
 // FMTuner object state management
 struct fm_tuner_state
 {	
-	int tuner_fd, ret;
-	struct video_audio aud_info;
-	struct video_tuner tuner_info;
+	int ret;
+
+	// Driver interface -- tune and volume requests run on its I/O thread so the
+	// WebKit thread never waits on the USB device
+	unsigned long if_handle;
+	int event_fd;
 
-	// Current region
+	// Current region, and its channels as this tuner can receive them -- no channels until
+	// the driver interface has the tuner range
 	enum fm_region region;
+	struct fmdriver_channel_map map;
 
 	// Current station properties	
-	float freq; // Fequency in MHz (e.g. 101.5)
+	int freq_khz; // Frequency in kHz (e.g. 101500)
 	char PICode[6]; // PI code represented in decimal string form
 	char PS[9]; // Program Service (max. 8 chars + NULL terminator)		
 	char PTY[3]; // Program Type code (0-31) in decimal string form
 	char PTYN[9]; // Program Type Name (max. 8 chars + NULL terminator)
 	char RT[65]; // Radio text (max. 64 chars + NULL terminator) 	
+	int volume; // Volume on a scale from 0-100
+
+	// Stations found by the last scan, in frequency order
+	struct fmdriver_station stations[FMDRIVER_MAX_STATIONS];
+	int num_stations;
+	int scan_status;		// How the last scan ended
+
+	// What we knew about the stations last time round, so the UI is ready straight away
+	struct station_cache *cache;
+
+	// Bumped whenever something getState() reports changes outside the driver snapshot.
+	// Added to the snapshot's generation, it gives the page a version to poll against
+	unsigned int changes;
+
+	// The string properties as last handed to the page. RDS fields change far less often
+	// than the page reads them, so the JS string is only made again when the text changes
+	JSStringRef prop_strings[TUNER_PROP_STRINGS];
+	char prop_text[TUNER_PROP_STRINGS][RDS_DATA_MAX + 1];
+
+	// Push delivery. The source wakes the main loop when the driver interface has events,
+	// and pending has a bit per enum tuner_callback still owed to the page. The context
+	// isn't retained -- the object is finalized before its context goes
+	JSGlobalContextRef js_ctx;
+	JSObjectRef js_object;
+	GSource *source;
+	unsigned int pending;
 };
 
+// Main loop source for a tuner's event fd
+struct tuner_source
+{
+	GSource source;
+	GPollFD poll_fd;
+	struct fm_tuner_state *tuner_state;
+};
+
+// The FMTuner class and its property names, created once by FMTuner_addClass
+JSClassRef FMTuner_class;
+JSStringRef FMTuner_propNames[TUNER_PROPS];
+JSStringRef FMTuner_versionName;
+JSStringRef FMTuner_callbackNames[TUNER_CALLBACKS];
+const char *tuner_callback_names[TUNER_CALLBACKS] = { "ontune", "onseek", "onscan", "onrdschange" };
+
 // private functions
-bool is_valid_freq(struct fm_tuner_state *tuner_state, float freq);
+bool is_valid_freq(struct fm_tuner_state *tuner_state, int freq_khz);
 int tuner_set_region(struct fm_tuner_state *tuner_state, enum fm_region region);
-int tuner_set_freq(struct fm_tuner_state *tuner_state, float freq);
+int tuner_set_freq(struct fm_tuner_state *tuner_state, int freq_khz);
 int tuner_set_volume(struct fm_tuner_state *tuner_state, int volume);
+void tuner_process_events(struct fm_tuner_state *tuner_state);
+void tuner_load_station(struct fm_tuner_state *tuner_state, int freq_khz);
+void tuner_apply_rds(struct fm_tuner_state *tuner_state, const struct rds_data *rds);
+void tuner_open_cache(struct fm_tuner_state *tuner_state);
+void tuner_load_map(struct fm_tuner_state *tuner_state);
+void tuner_set_number(JSContextRef ctx, JSObjectRef object, const char *name, double value);
+JSValueRef tuner_freq_value(JSContextRef ctx, int freq_khz);
+int tuner_freq_khz(double freq_mhz);
+int tuner_region(double value);
+const char *tuner_prop_text(struct fm_tuner_state *tuner_state, const struct fmdriver_snapshot *snapshot,
+			    enum tuner_prop prop, char *number, size_t number_len);
+JSStringRef tuner_prop_string(struct fm_tuner_state *tuner_state, const struct fmdriver_snapshot *snapshot,
+			      enum tuner_prop prop);
+enum tuner_prop tuner_prop_lookup(JSStringRef propName);
+JSObjectRef tuner_state_object(JSContextRef ctx, struct fm_tuner_state *tuner_state,
+			       const struct fmdriver_snapshot *snapshot, unsigned int version);
+gboolean tuner_source_prepare(GSource *source, gint *timeout);
+gboolean tuner_source_check(GSource *source);
+gboolean tuner_source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data);
+void tuner_source_attach(struct fm_tuner_state *tuner_state);
+void tuner_fire_callbacks(struct fm_tuner_state *tuner_state);
+void tuner_read_snapshot(struct fm_tuner_state *tuner_state, struct fmdriver_snapshot *snapshot);
+JSObjectRef tuner_latency_object(JSContextRef ctx, const struct fmdriver_latency *latency);
+JSValueRef tuner_stats_value(JSContextRef ctx, struct fm_tuner_state *tuner_state);
+
+// Names of the driver calls in the Stats property, indexed by enum fmdriver_op
+const char *tuner_op_names[FMDRIVER_OPS] =
+{
+	"setFreq", "getFreq", "getTuner", "getAudio", "setAudio", "readRDS", "seek", "other"
+};
 
-bool is_valid_freq(struct fm_tuner_state *tuner_state, float freq)
+bool is_valid_freq(struct fm_tuner_state *tuner_state, int freq_khz)
 {
-	bool valid_freq = false;	
+	const struct fmdriver_channel_map *map = &(tuner_state->map);
+
+	// The map is the region's band already cut down to the tuner range, so this is the
+	// range check and the channel grid at once -- odd tenths of a MHz in the Americas
+	if (map->num_channels == 0 || freq_khz < map->low_khz || freq_khz > map->high_khz)
+		return false;
 
-	// We assume the low and high range values for the tuner have been set
-	// for the current region and we check that the frequency falls in
-	// the range
-	if (freq >= tuner_state->tuner_info.rangelow && freq <= tuner_state->tuner_info.rangehigh)
+	return (freq_khz - map->low_khz) % map->spacing_khz == 0;
+}
+
+int tuner_set_region(struct fm_tuner_state *tuner_state, enum fm_region region)
+{
+	int freq_khz, ret;
+
+	if (region < FM_REGION_AMERICAS || region > FM_REGION_OTHER)
+		return EINVAL;
+	if (region == tuner_state->region)
+		return 0;
+
+	// The Si470x band and spacing registers can't be reached through V4L, so the tuner stays
+	// on its widest band and the driver interface switches to the region's channel map. No
+	// request to queue -- the switch is done when this returns
+	ret = fmdriverif_set_region(tuner_state->if_handle, region);
+	if (ret != 0)
+		return ret;
+	tuner_state->region = region;
+	tuner_load_map(tuner_state);
+
+	// Each region keeps its own stations -- the last scan there, or what the cache had
+	fmdriverif_get_stations(tuner_state->if_handle, tuner_state->stations, FMDRIVER_MAX_STATIONS,
+				&(tuner_state->num_stations));
+	if (tuner_state->cache != NULL)
 	{
-		// If the current region is Americas, we ensure the frequency is centered on an
-		// odd kHz mark
-		float wholeMHz = floor(freq);
-		int step = ((int)(freq - wholeMHz)) * 10;
-		if (tuner_state->tuner_info.region == FM_REGION_AMERICAS)
+		stationcache_set_region(tuner_state->cache, region);
+		if (tuner_state->num_stations == 0)
 		{
-			if (step % 2 > 0)
+			stationcache_get_stations(tuner_state->cache, region, tuner_state->stations,
+						  FMDRIVER_MAX_STATIONS, &(tuner_state->num_stations));
+		}
+	}
+	tuner_state->changes++;
+
+	// Off the new grid, go back to where we were last in this region, or else the bottom
+	// of the band
+	if (tuner_state->freq_khz > 0 && !is_valid_freq(tuner_state, tuner_state->freq_khz))
+	{
+		freq_khz = (tuner_state->cache != NULL) ? stationcache_get_last_freq(tuner_state->cache, region) : 0;
+		if (!is_valid_freq(tuner_state, freq_khz))
+			freq_khz = tuner_state->map.low_khz;
+		if (tuner_state->map.num_channels > 0)
+			tuner_set_freq(tuner_state, freq_khz);
+	}
+
+	return 0;
+}
+
+void tuner_load_map(struct fm_tuner_state *tuner_state)
+{
+	// Until the device is up there is no range, and so no channels
+	if (fmdriverif_get_channel_map(tuner_state->if_handle, tuner_state->region, &(tuner_state->map)) != 0)
+	{
+		memset(&(tuner_state->map), 0, sizeof(tuner_state->map));
+		tuner_state->map.region = tuner_state->region;
+	}
+}
+
+
+int tuner_set_freq(struct fm_tuner_state *tuner_state, int freq_khz)
+{
+	int ret = ERANGE;
+
+	// Validate the frequency
+	if (is_valid_freq(tuner_state, freq_khz))
+	{
+		// Tell the tuner to switch to this station. The request completes on the driver
+		// interface's I/O thread and the new frequency is picked up from its tune event
+		ret = fmdriverif_tunerequest(tuner_state->if_handle, freq_khz);
+	}
+
+	return ret;
+}
+
+int tuner_set_volume(struct fm_tuner_state *tuner_state, int volume)
+{
+	if (volume < 0 || volume > 100)
+		return ERANGE;
+
+	// As with tuning, the volume property is updated when the request completes
+	return fmdriverif_volrequest(tuner_state->if_handle, volume);
+}
+
+void tuner_process_events(struct fm_tuner_state *tuner_state)
+{
+	struct fmdriver_event events[TUNER_EVENT_BATCH];
+	struct fmdriver_tune_data tune_data;
+	struct fmdriver_snapshot snapshot;
+	int num_events, i;
+
+	// Take whatever the driver interface has completed since we last looked
+	while (fmdriverif_read_events(tuner_state->if_handle, events, TUNER_EVENT_BATCH, 0, &num_events) == 0)
+	{
+		for (i = 0; i < num_events; i++)
+		{
+			if (events[i].status_code != 0)
 			{
-				valid_freq = true;
+				fprintf(stderr, "tuner_process_events -- request %d failed %d\n", events[i].event_id, events[i].status_code);
+
+				// A page that started a scan hears how it ended, stopped or not
+				if (events[i].event_id == FM_EVENT_SCAN)
+				{
+					tuner_state->scan_status = events[i].status_code;
+					tuner_state->pending |= 1u << TUNER_CALLBACK_SCAN;
+				}
+				continue;
+			}
+
+			switch (events[i].event_id)
+			{
+			case FM_EVENT_TUNE:
+			case FM_EVENT_SEEK:
+				memcpy(&tune_data, events[i].event_data, sizeof(tune_data));
+				tuner_load_station(tuner_state, tune_data.freq);
+				if (tuner_state->cache != NULL)
+				{
+					stationcache_set_last_freq(tuner_state->cache, tuner_state->region, tune_data.freq);
+				}
+				tuner_state->pending |= 1u << ((events[i].event_id == FM_EVENT_TUNE) ?
+							       TUNER_CALLBACK_TUNE : TUNER_CALLBACK_SEEK);
+				break;
+
+			case FM_EVENT_VOL:
+				memcpy(&(tuner_state->volume), events[i].event_data, sizeof(int));
+				tuner_state->changes++;
+				break;
+
+			case FM_EVENT_POWER:
+				// The tuner has come up, or come back after being unplugged -- the
+				// range, and so the channel map, and volume are only known from here
+				tuner_load_map(tuner_state);
+				if (fmdriverif_get_snapshot(tuner_state->if_handle, &snapshot) == 0)
+				{
+					tuner_state->volume = snapshot.volume;
+				}
+				tuner_state->changes++;
+				break;
+
+			case FM_EVENT_SCAN:
+				// The event only carries a summary -- fetch the table that goes with it
+				fmdriverif_get_stations(tuner_state->if_handle, tuner_state->stations, FMDRIVER_MAX_STATIONS,
+							&(tuner_state->num_stations));
+				if (tuner_state->cache != NULL)
+				{
+					stationcache_update_scan(tuner_state->cache, tuner_state->region,
+								 tuner_state->stations, tuner_state->num_stations);
+				}
+				tuner_state->scan_status = 0;
+				tuner_state->pending |= 1u << TUNER_CALLBACK_SCAN;
+				break;
+
+			case FM_EVENT_RDS:
+				tuner_apply_rds(tuner_state, (const struct rds_data *)events[i].event_data);
+				tuner_state->pending |= 1u << TUNER_CALLBACK_RDS;
+				break;
+
+			default:
+				break;
 			}
 		}
-		else
+	}
+}
+
+void tuner_load_station(struct fm_tuner_state *tuner_state, int freq_khz)
+{
+	const struct station_record *record = NULL;
+
+	tuner_state->freq_khz = freq_khz;
+	tuner_state->changes++;
+
+	// Show whatever we heard from this station last time until fresh RDS arrives
+	memset(tuner_state->PICode, 0, sizeof(tuner_state->PICode));
+	memset(tuner_state->PS, 0, sizeof(tuner_state->PS));
+	memset(tuner_state->PTY, 0, sizeof(tuner_state->PTY));
+	memset(tuner_state->PTYN, 0, sizeof(tuner_state->PTYN));
+	memset(tuner_state->RT, 0, sizeof(tuner_state->RT));
+
+	if (tuner_state->cache != NULL)
+	{
+		record = stationcache_lookup(tuner_state->cache, tuner_state->region, freq_khz);
+	}
+	if (record == NULL)
+		return;
+
+	if (record->valid & STATIONCACHE_HAS_PI)
+		snprintf(tuner_state->PICode, sizeof(tuner_state->PICode), "%u", record->pi);
+	if (record->valid & STATIONCACHE_HAS_PS)
+		memcpy(tuner_state->PS, record->ps, sizeof(record->ps));
+	if (record->valid & STATIONCACHE_HAS_PTY)
+		snprintf(tuner_state->PTY, sizeof(tuner_state->PTY), "%u", record->pty);
+	if (record->valid & STATIONCACHE_HAS_PTYN)
+		memcpy(tuner_state->PTYN, record->ptyn, sizeof(record->ptyn));
+}
+
+void tuner_apply_rds(struct fm_tuner_state *tuner_state, const struct rds_data *rds)
+{
+	struct fmdriver_snapshot snapshot;
+
+	// The properties read RDS from the driver snapshot, so all that's left to do here is
+	// keep the cache up to date as the station identifies itself. File it under the
+	// station the field came from, which may not be the one we asked for last
+	if (tuner_state->cache == NULL || fmdriverif_get_snapshot(tuner_state->if_handle, &snapshot) != 0)
+		return;
+
+	stationcache_update_rds(tuner_state->cache, tuner_state->region, snapshot.freq, rds);
+}
+
+void tuner_open_cache(struct fm_tuner_state *tuner_state)
+{
+	char path[PATH_MAX];
+	const char *home = getenv("HOME");
+	int freq_khz, ret;
+
+	tuner_state->cache = NULL;
+	if (home == NULL)
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", home, STATION_CACHE_FILE);
+	ret = stationcache_open(path, &(tuner_state->cache));
+	if (ret != 0)
+	{
+		fprintf(stderr, "tuner_open_cache -- failed to open station cache %d\n", ret);
+		return;
+	}
+
+	// Warm start -- the region, last station and last scan come straight out of the mapping
+	tuner_state->region = stationcache_get_region(tuner_state->cache);
+	freq_khz = stationcache_get_last_freq(tuner_state->cache, tuner_state->region);
+	if (freq_khz > 0)
+	{
+		tuner_load_station(tuner_state, freq_khz);
+	}
+	stationcache_get_stations(tuner_state->cache, tuner_state->region, tuner_state->stations,
+				  FMDRIVER_MAX_STATIONS, &(tuner_state->num_stations));
+}
+
+void tuner_set_number(JSContextRef ctx, JSObjectRef object, const char *name, double value)
+{
+	JSStringRef jsName = JSStringCreateWithUTF8CString(name);
+
+	JSObjectSetProperty(ctx, object, jsName, JSValueMakeNumber(ctx, value), kJSPropertyAttributeReadOnly, NULL);
+	JSStringRelease(jsName);
+}
+
+JSValueRef tuner_freq_value(JSContextRef ctx, int freq_khz)
+{
+	return JSValueMakeNumber(ctx, (double)freq_khz / KHZ_PER_MHZ);
+}
+
+int tuner_freq_khz(double freq_mhz)
+{
+	// Rounded to the nearest kHz. Anything that isn't a plausible frequency, NaN included,
+	// comes out as 0 and fails validation
+	if (!(freq_mhz > 0 && freq_mhz < INT_MAX / KHZ_PER_MHZ))
+		return 0;
+
+	return (int)(freq_mhz * KHZ_PER_MHZ + 0.5);
+}
+
+int tuner_region(double value)
+{
+	// Checked as a double, since converting NaN or anything out of range is undefined. What
+	// isn't a region comes out as -1 and fails validation
+	if (!(value >= FM_REGION_AMERICAS && value <= FM_REGION_OTHER) || value != (int)value)
+		return -1;
+
+	return (int)value;
+}
+
+const char *tuner_prop_text(struct fm_tuner_state *tuner_state, const struct fmdriver_snapshot *snapshot,
+			    enum tuner_prop prop, char *number, size_t number_len)
+{
+	switch (prop)
+	{
+	case TUNER_PROP_PICODE:
+		if (!(snapshot->rds_valid & FMDRIVER_RDS_PI))
+			return tuner_state->PICode;
+		snprintf(number, number_len, "%u", snapshot->pi);
+		return number;
+
+	case TUNER_PROP_PS:
+		return (snapshot->rds_valid & FMDRIVER_RDS_PS) ? snapshot->ps : tuner_state->PS;
+
+	case TUNER_PROP_PTY:
+		if (!(snapshot->rds_valid & FMDRIVER_RDS_PTY))
+			return tuner_state->PTY;
+		snprintf(number, number_len, "%u", snapshot->pty);
+		return number;
+
+	case TUNER_PROP_PTYN:
+		return (snapshot->rds_valid & FMDRIVER_RDS_PTYN) ? snapshot->ptyn : tuner_state->PTYN;
+
+	case TUNER_PROP_RT:
+		return (snapshot->rds_valid & FMDRIVER_RDS_RT) ? snapshot->rt : tuner_state->RT;
+
+	default:
+		return NULL;
+	}
+}
+
+JSStringRef tuner_prop_string(struct fm_tuner_state *tuner_state, const struct fmdriver_snapshot *snapshot,
+			      enum tuner_prop prop)
+{
+	char number[8];
+	const char *text = tuner_prop_text(tuner_state, snapshot, prop, number, sizeof(number));
+
+	// Strings are NULL until first asked for, and the text is never longer than RT
+	if (tuner_state->prop_strings[prop] == NULL || strcmp(text, tuner_state->prop_text[prop]) != 0)
+	{
+		if (tuner_state->prop_strings[prop] != NULL)
 		{
-			valid_freq = true;
+			JSStringRelease(tuner_state->prop_strings[prop]);
 		}
+		snprintf(tuner_state->prop_text[prop], sizeof(tuner_state->prop_text[prop]), "%s", text);
+		tuner_state->prop_strings[prop] = JSStringCreateWithUTF8CString(tuner_state->prop_text[prop]);
 	}
-	
-	return valid_freq;				
+
+	return tuner_state->prop_strings[prop];
 }
 
-int tuner_set_region(struct fm_tuner_state *tuner_state, enum fm_region region)
+enum tuner_prop tuner_prop_lookup(JSStringRef propName)
 {
-	// Looks like we need some additional plumbing in the Si470x driver to change band
-	// and spacing from userland. I'll do a bit more digging and if that's the case,
-	// I'll add the logic to the driver for this. For now, let's just return a reasonable
-	// error
-	return ENOSYS;
+	// Straight off JavaScriptCore's own UTF-16 buffer
+	return tunerprops_lookup(JSStringGetCharactersPtr(propName), JSStringGetLength(propName));
 }
-	
 
-int tuner_set_freq(struct fm_tuner_state *tuner_state, float freq)
+void tuner_read_snapshot(struct fm_tuner_state *tuner_state, struct fmdriver_snapshot *snapshot)
 {
-	int ret = ERANGE;
+	// Pick up any requests that have completed since the page last looked
+	tuner_process_events(tuner_state);
 
-	// Validate the frequency
-	if (is_valid_freq(tuner_state, freq)
+	// The station and its RDS come from the driver interface's latest snapshot, which
+	// never tears and costs no lock
+	if (tuner_state->if_handle == 0 || fmdriverif_get_snapshot(tuner_state->if_handle, snapshot) != 0)
 	{
-		// Tell the tuner to switch to this station
+		memset(snapshot, 0, sizeof(struct fmdriver_snapshot));
 	}
+}
 
-	return ret;
+JSObjectRef tuner_latency_object(JSContextRef ctx, const struct fmdriver_latency *latency)
+{
+	JSObjectRef object = JSObjectMake(ctx, NULL, NULL);
+	JSValueRef buckets[FMDRIVER_LATENCY_BUCKETS];
+	JSStringRef jsName;
+	int i;
+
+	tuner_set_number(ctx, object, "count", latency->count);
+	tuner_set_number(ctx, object, "totalUs", latency->total_us);
+	tuner_set_number(ctx, object, "maxUs", latency->max_us);
+
+	// Histogram buckets are log2 microseconds -- under 1us, 1-2us, 2-4us and so on
+	for (i = 0; i < FMDRIVER_LATENCY_BUCKETS; i++)
+	{
+		buckets[i] = JSValueMakeNumber(ctx, latency->hist[i]);
+	}
+	jsName = JSStringCreateWithUTF8CString("histogram");
+	JSObjectSetProperty(ctx, object, jsName, JSObjectMakeArray(ctx, FMDRIVER_LATENCY_BUCKETS, buckets, NULL),
+			    kJSPropertyAttributeReadOnly, NULL);
+	JSStringRelease(jsName);
+
+	return object;
+}
+
+// Stats is a fresh object on every read, so a page can poll it and diff the counters
+JSValueRef tuner_stats_value(JSContextRef ctx, struct fm_tuner_state *tuner_state)
+{
+	struct fmdriver_stats stats;
+	JSObjectRef object, ops;
+	JSStringRef jsName;
+	int i;
+
+	if (tuner_state->if_handle == 0 || fmdriverif_get_stats(tuner_state->if_handle, &stats) != 0)
+		return JSValueMakeUndefined(ctx);
+
+	object = JSObjectMake(ctx, NULL, NULL);
+	tuner_set_number(ctx, object, "poolExhausted", stats.pool_exhausted);
+	tuner_set_number(ctx, object, "eventsDropped", stats.events_dropped);
+	tuner_set_number(ctx, object, "notifications", stats.notifications);
+	tuner_set_number(ctx, object, "eventsRead", stats.events_read);
+	tuner_set_number(ctx, object, "tunesCoalesced", stats.tunes_coalesced);
+	tuner_set_number(ctx, object, "volumesCoalesced", stats.volumes_coalesced);
+	tuner_set_number(ctx, object, "fifoCapacity", stats.fifo_capacity);
+	tuner_set_number(ctx, object, "fifoDepth", stats.fifo_depth);
+	tuner_set_number(ctx, object, "fifoHighWater", stats.fifo_high_water);
+	tuner_set_number(ctx, object, "rdsBlocks", stats.rds_blocks);
+	tuner_set_number(ctx, object, "rdsBlocksCorrected", stats.rds_blocks_corrected);
+	tuner_set_number(ctx, object, "rdsBlocksBad", stats.rds_blocks_bad);
+	tuner_set_number(ctx, object, "rdsGroups", stats.rds_groups);
+	tuner_set_number(ctx, object, "rdsPolls", stats.rds_polls);
+	tuner_set_number(ctx, object, "rdsPollsSaved", stats.rds_polls_saved);
+	tuner_set_number(ctx, object, "rdsPollMs", stats.rds_poll_ms);
+	tuner_set_number(ctx, object, "seeks", stats.seeks);
+	tuner_set_number(ctx, object, "seeksCached", stats.seeks_cached);
+	tuner_set_number(ctx, object, "afChecks", stats.af_checks);
+	tuner_set_number(ctx, object, "afSwitches", stats.af_switches);
+	tuner_set_number(ctx, object, "telemetrySamples", stats.telemetry_samples);
+
+	jsName = JSStringCreateWithUTF8CString("enqueueWait");
+	JSObjectSetProperty(ctx, object, jsName, tuner_latency_object(ctx, &(stats.enqueue_wait)),
+			    kJSPropertyAttributeReadOnly, NULL);
+	JSStringRelease(jsName);
+
+	jsName = JSStringCreateWithUTF8CString("afRetune");
+	JSObjectSetProperty(ctx, object, jsName, tuner_latency_object(ctx, &(stats.af_retune)),
+			    kJSPropertyAttributeReadOnly, NULL);
+	JSStringRelease(jsName);
+
+	ops = JSObjectMake(ctx, NULL, NULL);
+	for (i = 0; i < FMDRIVER_OPS; i++)
+	{
+		jsName = JSStringCreateWithUTF8CString(tuner_op_names[i]);
+		JSObjectSetProperty(ctx, ops, jsName, tuner_latency_object(ctx, &(stats.ops[i])),
+				    kJSPropertyAttributeReadOnly, NULL);
+		JSStringRelease(jsName);
+	}
+	jsName = JSStringCreateWithUTF8CString("ops");
+	JSObjectSetProperty(ctx, object, jsName, ops, kJSPropertyAttributeReadOnly, NULL);
+	JSStringRelease(jsName);
+
+	return object;
+}
+
+// Push delivery
+
+gboolean tuner_source_prepare(GSource *source, gint *timeout)
+{
+	struct tuner_source *tuner_source = (struct tuner_source *)source;
+
+	// A property read may have drained the events already and left callbacks owed
+	*timeout = -1;
+	return tuner_source->tuner_state->pending != 0;
 }
+
+gboolean tuner_source_check(GSource *source)
+{
+	struct tuner_source *tuner_source = (struct tuner_source *)source;
+
+	return (tuner_source->poll_fd.revents & G_IO_IN) || tuner_source->tuner_state->pending != 0;
+}
+
+gboolean tuner_source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+	struct tuner_source *tuner_source = (struct tuner_source *)source;
+
+	// Everything waiting goes in one pass, so a burst of RDS is one call to the page
+	tuner_process_events(tuner_source->tuner_state);
+	tuner_fire_callbacks(tuner_source->tuner_state);
+
+	return TRUE;
+}
+
+GSourceFuncs tuner_source_funcs =
+{
+	tuner_source_prepare, tuner_source_check, tuner_source_dispatch, NULL
+};
+
+void tuner_source_attach(struct fm_tuner_state *tuner_state)
+{
+	struct tuner_source *tuner_source;
+
+	// WebKit runs JavaScript from the default main context
+	tuner_state->source = g_source_new(&tuner_source_funcs, sizeof(struct tuner_source));
+	tuner_source = (struct tuner_source *)tuner_state->source;
+	tuner_source->tuner_state = tuner_state;
+	tuner_source->poll_fd.fd = tuner_state->event_fd;
+	tuner_source->poll_fd.events = G_IO_IN;
+	tuner_source->poll_fd.revents = 0;
+	g_source_add_poll(tuner_state->source, &(tuner_source->poll_fd));
+	g_source_attach(tuner_state->source, NULL);
+}
+
+void tuner_fire_callbacks(struct fm_tuner_state *tuner_state)
+{
+	JSContextRef ctx = tuner_state->js_ctx;
+	JSObjectRef object = tuner_state->js_object;
+	struct fmdriver_snapshot snapshot;
+	unsigned int pending = tuner_state->pending;
+	JSValueRef value, args[2];
+	JSObjectRef function;
+	size_t num_args;
+	int i;
+
+	tuner_state->pending = 0;
+	if (ctx == NULL)
+		return;
+
+	// A callback could drop the page's last reference to the tuner, so hold on to it
+	// until they have all run
+	JSValueProtect(ctx, object);
+	for (i = 0; i < TUNER_CALLBACKS; i++)
+	{
+		if (!(pending & (1u << i)))
+			continue;
+
+		// Callbacks are plain properties the page sets, e.g. tuner.ontune = function (freq) ...
+		value = JSObjectGetProperty(ctx, object, FMTuner_callbackNames[i], NULL);
+		if (!JSValueIsObject(ctx, value))
+			continue;
+		function = JSValueToObject(ctx, value, NULL);
+		if (!JSObjectIsFunction(ctx, function))
+			continue;
+
+		num_args = 1;
+		switch (i)
+		{
+		case TUNER_CALLBACK_SCAN:
+			args[0] = JSValueMakeNumber(ctx, tuner_state->num_stations);
+			args[1] = JSValueMakeNumber(ctx, tuner_state->scan_status);
+			num_args = 2;
+			break;
+
+		case TUNER_CALLBACK_RDS:
+			tuner_read_snapshot(tuner_state, &snapshot);
+			args[0] = tuner_state_object(ctx, tuner_state, &snapshot, snapshot.generation + tuner_state->changes);
+			break;
+
+		default:
+			args[0] = tuner_freq_value(ctx, tuner_state->freq_khz);
+			break;
+		}
+		JSObjectCallAsFunction(ctx, function, object, num_args, args, NULL);
+	}
+	JSValueUnprotect(ctx, object);
+}
+
 // Initialization/finalization
 
 void FMTuner_initCB(JSContextRef ctx, JSObjectRef object)
 {
 	struct fm_tuner_state *tuner_state = (struct fm_tuner_state *)JSObjectGetPrivate(object);
-	int fd;
+	struct fmdriver_open_params params;
+	int ret;
 
-	if (fm_tuner_state != NULL)
+	if (tuner_state != NULL)
 	{
-		// Attempt to open the FM tuner driver
-		fd = open(SI470X_DEVICE, O_RDONLY);
-		if (fd < 0)
+		tuner_state->if_handle = 0;
+		tuner_state->event_fd = -1;
+		tuner_state->num_stations = 0;
+		tuner_state->region = FM_REGION_AMERICAS;
+		memset(&(tuner_state->map), 0, sizeof(tuner_state->map));
+		tuner_state->freq_khz = 0;
+		tuner_state->changes = 0;
+		memset(tuner_state->prop_strings, 0, sizeof(tuner_state->prop_strings));
+		tuner_state->js_ctx = JSContextGetGlobalContext(ctx);
+		tuner_state->js_object = object;
+		tuner_state->source = NULL;
+		tuner_state->pending = 0;
+
+		// Load what we knew last time before touching the hardware
+		tuner_open_cache(tuner_state);
+
+		// Open the driver interface that all tuner access goes through. Which tuner that
+		// is -- the Si470x or the simulator -- is up to the interface. The page only shows
+		// the latest of everything, so a busy main loop coalesces events rather than
+		// holding up the tuner. The device is opened in the background so a slow or
+		// missing tuner doesn't hold up the page -- FM_EVENT_POWER says when it is up
+		memset(&params, 0, sizeof(params));
+		params.pollable = true;
+		params.overflow = FMDRIVER_OVERFLOW_COALESCE;
+		params.async_open = true;
+		ret = fmdriverif_open_ex(PRIMARY_TUNER_ID, &params, &(tuner_state->if_handle), &(tuner_state->event_fd));
+		if (ret != 0)
 		{
-			perror("FMTuner_initCB -- failed to open tuner driver");
- 		}
+			fprintf(stderr, "FMTuner_initCB -- failed to open driver interface %d\n", ret);
+		}
 		else
 		{
-			// Set the tuner handle
-			tuner_fd = fd;			
-			// Get the current audio info
-			ret = ioctl(tuner_fd, VIDIOCGAUDIO, &(tuner_state->aud_info);
-			if (ret < 0)
+			// Back in the region the cache was last used in. Its channel map is there
+			// once the device is up
+			if (tuner_state->region != FM_REGION_AMERICAS)
 			{
-				perror("FMTuner_initCB -- ioctl VIDIOCGAUDIO failed");
+				fmdriverif_set_region(tuner_state->if_handle, tuner_state->region);
 			}
-			else
+
+			// Events reach the page through the main loop from here on
+			tuner_source_attach(tuner_state);
+
+			if (tuner_state->freq_khz > 0)
 			{
-				// Set tuner number
-				tuner_state->tuner_info.tuner = PRIMARY_TUNER_ID;
-				ret = ioctl(tuner_fd, VIDIOCGTUNER, &(tuner_state->tuner_info);
-				if (ret < 0)
-				{
-					perror("FMTuner_initCB -- ioctl VIDIOCGTUNER failed");
-				}
-			}	
+				// Put the tuner back on the cached station -- the UI already shows it.
+				// The request runs once the device is open
+				fmdriverif_tunerequest(tuner_state->if_handle, tuner_state->freq_khz);
+			}
 		}
 	}	
 }
@@ -149,12 +742,29 @@ void FMTuner_initCB(JSContextRef ctx, JSObjectRef object)
 void FMTuner_finalizeCB(JSObjectRef object)
 {
 	struct fm_tuner_state *tuner_state = (struct fm_tuner_state *)JSObjectGetPrivate(object);
+	int i;
 	
 	if (tuner_state != NULL)
 	{
-		if (tuner_state->tuner_fd != NULL)
-		{		
-			close(tuner_state->tuner_fd);
+		if (tuner_state->source != NULL)
+		{
+			g_source_destroy(tuner_state->source);
+			g_source_unref(tuner_state->source);
+		}
+		if (tuner_state->if_handle != 0)
+		{
+			fmdriverif_close(tuner_state->if_handle);
+		}
+		if (tuner_state->cache != NULL)
+		{
+			stationcache_close(tuner_state->cache);
+		}
+		for (i = 0; i < TUNER_PROP_STRINGS; i++)
+		{
+			if (tuner_state->prop_strings[i] != NULL)
+			{
+				JSStringRelease(tuner_state->prop_strings[i]);
+			}
 		}
 		free(tuner_state);
 	}
@@ -164,7 +774,7 @@ void FMTuner_finalizeCB(JSObjectRef object)
 
 // FMTuner has the following properties that cause tuner driver requests on write:
 // Frequency (R/W) for getting/setting the current frequency
-// Region (R/W) for getting/setting the current frequency band and spacing
+// Region (R/W) for getting/setting the current frequency band and spacing, as an enum fm_region
 // Volume (R/W) on a scale from 0-100 to control the audio output volume for the radio source
 // There are also RDS accessor properties:
 // PICode (read-only) for reading the current frequency's PI code
@@ -172,66 +782,42 @@ void FMTuner_finalizeCB(JSObjectRef object)
 // PTY (read-only) for reading the Program Type code (e.g. 14 for Jazz in North America, Classical in Europe)
 // PTYN (read-only) for reading the Program Type Name (e.g. Concert)
 // RT (read-only) for reading the Radio Text string (e.g. Wynton Marsalis Live on Bourbon Street)  
+// And for diagnostics:
+// Stats (read-only) for the driver interface's counters and latency histograms
 
 bool FMTuner_hasPropCB(JSContextRef ctx, JSObjectRef object, JSStringRef propName)
 {
-	if (JSStringIsEqualToUTF8CString(propertyName, "Frequency") ||
-	    JSStringIsEqualToUTF8CString(propertyName, "PICode") ||
-	    JSStringIsEqualToUTF8CString(propertyName, "PS") ||
-	    JSStringIsEqualToUTF8CString(propertyName, "PTY") ||
-	    JSStringIsEqualToUTF8CString(propertyName, "PTYN") ||
-	    JSStringIsEqualToUTF8CString(propertyName, "RT"))
-	{
-		return true;
-	}
-	else
-	{
-		return false;
-	}
+	return tuner_prop_lookup(propName) != TUNER_PROP_NONE;
 }	    
 
 JSValueRef FMTuner_getPropCB(JSContextRef ctx, JSObjectRef object, JSStringRef propName, JSValueRef *exception)
 {
 	struct fm_tuner_state *tuner_state = (struct fm_tuner_state *)JSObjectGetPrivate(object);	
+	struct fmdriver_snapshot snapshot;
+	enum tuner_prop prop = tuner_prop_lookup(propName);
 
-	if (JSStringIsEqualToUTF8CString(propName, "Frequency"))
-	{
-		return JSValueMakeNumber(ctx, tuner_state->freq);
-	}
-	
-	if (JSStringIsEqualToUTF8CString(propName, "PICode"))
-	{		
-		JSStringRef PICodeStr = JSStringCreateWithUTF8CString(tuner_state->PICode);
+	if (prop == TUNER_PROP_NONE)
+		return JSValueMakeUndefined(ctx);
 
-		return JSValueMakeString(ctx, PICodeStr);
-	}
+	if (prop == TUNER_PROP_STATS)
+		return tuner_stats_value(ctx, tuner_state);
 
-	if (JSStringIsEqualToUTF8CString(propName, "PS"))
-	{
-		JSStringRef PSStr = JSStringCreateWithUTF8CString(tuner_state->PS);
+	// Fields the station hasn't sent yet fall back to what the station cache had for it
+	tuner_read_snapshot(tuner_state, &snapshot);
 
-		return JSValueMakeString(ctx, PSStr);
-	}
-	
-	if (JSStringIsEqualToUTF8CString(propName, "PTY"))
+	switch (prop)
 	{
-		JSStringRef PTYStr = JSStringCreateWithUTF8CString(tuner_state->PTY);
-		
-		return JSValueMakeString(ctx, PTYStr);
-	}	
-	
-	if (JSStringIsEqualToUTF8CString(propName, "PTYN"))
-	{ 
-		JSStringRef PTYNStr = JSStringCreateWithUTF8CString(tuner_state->PTYN);
+	case TUNER_PROP_FREQUENCY:
+		return tuner_freq_value(ctx, (snapshot.freq > 0) ? snapshot.freq : tuner_state->freq_khz);
 
-		return JSValueMakeString(ctx, PTYNStr);
-	}
+	case TUNER_PROP_VOLUME:
+		return JSValueMakeNumber(ctx, tuner_state->volume);
 
-	if (JSStringIsEqualToUTF8CString(propName, "RT"))
-	{
-		JSStringRef RTStr = JSStringCreateWithUTF8CString(tuner_state->RT);
+	case TUNER_PROP_REGION:
+		return JSValueMakeNumber(ctx, tuner_state->region);
 
-		return JSValueMakeString(ctx, RTStr);
+	default:
+		return JSValueMakeString(ctx, tuner_prop_string(tuner_state, &snapshot, prop));
 	}
 }
 
@@ -240,23 +826,21 @@ bool FMTuner_setPropCB(JSContextRef ctx, JSObjectRef object, JSStringRef propNam
 {
 	struct fm_tuner_state *tuner_state = (struct fm_tuner_state *)JSObjectGetPrivate(object);	
 	
-	// Only the frequency can be set, and when it is, we execute a tuning request
-	if (JSStringIsEqualToUTF8CString(propName, "Frequency"))
-	{
-		float req_freq = JSValueToNumber(value);
-		
-		// Kick off a request to the tuner and set the property if the request succeeds
-		if (tuner_set_freq(tuner_state, req_freq)
-		{
-			return true;
-		}
-		else
-		{
-			return false;
-		}
-	}
-	else
+	// Only the frequency, volume and region can be set. The first two queue a request to the
+	// tuner and the property takes the new value once the request completes; the region
+	// changes straight away
+	switch (tuner_prop_lookup(propName))
 	{
+	case TUNER_PROP_FREQUENCY:
+		return tuner_set_freq(tuner_state, tuner_freq_khz(JSValueToNumber(ctx, value, exception))) == 0;
+
+	case TUNER_PROP_VOLUME:
+		return tuner_set_volume(tuner_state, (int)JSValueToNumber(ctx, value, exception)) == 0;
+
+	case TUNER_PROP_REGION:
+		return tuner_set_region(tuner_state, (enum fm_region)tuner_region(JSValueToNumber(ctx, value, exception))) == 0;
+
+	default:
 		return false;
 	}
 }
@@ -266,22 +850,172 @@ bool FMTuner_setPropCB(JSContextRef ctx, JSObjectRef object, JSStringRef propNam
 // Power(on/off)
 // Seek(direction)
 // Scan(on/off)
+// getState([version]) for every station property at once, from one snapshot. The object
+// it returns has a version; passed back in, getState() returns null if nothing has changed
+// since, so a page can refresh on a timer for the cost of one call
+// Rather than poll at all, a page can set ontune, onseek, onscan and onrdschange -- see
+// enum tuner_callback
 
 JSValueRef FMTuner_callAsFnCB(JSContextRef ctx, JSObjectRef thisObject, size_t argCount, const JSValueRef arguments[], JSValueRef *exception)
 {	
+	// The tuner itself can't be called -- everything it does is one of the methods below
+	return JSValueMakeUndefined(ctx);
+}
+
+JSValueRef FMTuner_seekCB(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argCount,
+			  const JSValueRef arguments[], JSValueRef *exception)
+{
+	struct fm_tuner_state *tuner_state = (struct fm_tuner_state *)JSObjectGetPrivate(thisObject);
+	bool seek_up = true;
+
+	if (tuner_state == NULL)
+		return JSValueMakeBoolean(ctx, false);
+
+	// Seek() or Seek(1) goes up the band to the next station, Seek(-1) down; true and false
+	// do the same. The station it lands on comes to onseek
+	if (argCount > 0)
+	{
+		if (JSValueIsBoolean(ctx, arguments[0]))
+			seek_up = JSValueToBoolean(ctx, arguments[0]);
+		else
+			seek_up = !(JSValueToNumber(ctx, arguments[0], exception) < 0);
+	}
+
+	return JSValueMakeBoolean(ctx, fmdriverif_seekrequest(tuner_state->if_handle, seek_up) == 0);
+}
+
+JSValueRef FMTuner_scanCB(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argCount,
+			  const JSValueRef arguments[], JSValueRef *exception)
+{
+	struct fm_tuner_state *tuner_state = (struct fm_tuner_state *)JSObjectGetPrivate(thisObject);
+	bool start = true;
+
+	if (tuner_state == NULL)
+		return JSValueMakeBoolean(ctx, false);
+
+	// Scan() or Scan(true) starts a scan of the band, Scan(false) stops it. Either way the
+	// result comes to onscan
+	if (argCount > 0)
+		start = JSValueToBoolean(ctx, arguments[0]);
+
+	return JSValueMakeBoolean(ctx, fmdriverif_scanrequest(tuner_state->if_handle, !start) == 0);
+}
+
+JSValueRef FMTuner_getStateCB(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argCount,
+			      const JSValueRef arguments[], JSValueRef *exception)
+{
+	struct fm_tuner_state *tuner_state = (struct fm_tuner_state *)JSObjectGetPrivate(thisObject);
+	struct fmdriver_snapshot snapshot;
+	unsigned int version;
+
+	if (tuner_state == NULL)
+		return JSValueMakeUndefined(ctx);
+
+	tuner_read_snapshot(tuner_state, &snapshot);
+	version = snapshot.generation + tuner_state->changes;
+	if (argCount > 0 && JSValueIsNumber(ctx, arguments[0]) &&
+	    JSValueToNumber(ctx, arguments[0], exception) == (double)version)
+	{
+		return JSValueMakeNull(ctx);
+	}
+
+	return tuner_state_object(ctx, tuner_state, &snapshot, version);
+}
+
+JSObjectRef tuner_state_object(JSContextRef ctx, struct fm_tuner_state *tuner_state,
+			       const struct fmdriver_snapshot *snapshot, unsigned int version)
+{
+	JSObjectRef object = JSObjectMake(ctx, NULL, NULL);
+	int i;
+
+	// Same names and values as the properties
+	JSObjectSetProperty(ctx, object, FMTuner_versionName, JSValueMakeNumber(ctx, version),
+			    kJSPropertyAttributeReadOnly, NULL);
+	JSObjectSetProperty(ctx, object, FMTuner_propNames[TUNER_PROP_FREQUENCY],
+			    tuner_freq_value(ctx, (snapshot->freq > 0) ? snapshot->freq : tuner_state->freq_khz),
+			    kJSPropertyAttributeReadOnly, NULL);
+	JSObjectSetProperty(ctx, object, FMTuner_propNames[TUNER_PROP_VOLUME], JSValueMakeNumber(ctx, tuner_state->volume),
+			    kJSPropertyAttributeReadOnly, NULL);
+	JSObjectSetProperty(ctx, object, FMTuner_propNames[TUNER_PROP_REGION], JSValueMakeNumber(ctx, tuner_state->region),
+			    kJSPropertyAttributeReadOnly, NULL);
+	for (i = 0; i < TUNER_PROP_STRINGS; i++)
+	{
+		JSObjectSetProperty(ctx, object, FMTuner_propNames[i],
+				    JSValueMakeString(ctx, tuner_prop_string(tuner_state, snapshot, i)),
+				    kJSPropertyAttributeReadOnly, NULL);
+	}
+
+	return object;
 }
 
+// Methods on every FMTuner object
+const JSStaticFunction FMTuner_staticFunctions[] =
+{
+	{ "getState", FMTuner_getStateCB, kJSPropertyAttributeReadOnly | kJSPropertyAttributeDontDelete },
+	{ "Seek", FMTuner_seekCB, kJSPropertyAttributeReadOnly | kJSPropertyAttributeDontDelete },
+	{ "Scan", FMTuner_scanCB, kJSPropertyAttributeReadOnly | kJSPropertyAttributeDontDelete },
+	{ NULL, NULL, 0 }
+};
+
 // Constructor
 JSObjectRef FMTuner_callAsCtorCB(JSContextRef ctx, JSObjectRef thisObject, size_t argCount, const JSValueRef arguments[], JSValueRef *exception)
 {
+	struct fm_tuner_state *tuner_state;
+
+	// The state is ours from here -- FMTuner_initCB sets it up and FMTuner_finalizeCB
+	// frees it
+	tuner_state = (struct fm_tuner_state *)calloc(1, sizeof(struct fm_tuner_state));
+	if (tuner_state == NULL)
+		return NULL;
+
+	return JSObjectMake(ctx, FMTuner_class, tuner_state);
 }
 
 // Instance
 bool FMTuner_hasInstCB(JSContextRef ctx, JSObjectRef ctor, JSValueRef possibleInst, JSValueRef *exception)
 {
+	return JSValueIsObjectOfClass(ctx, possibleInst, FMTuner_class);
 }
 
 // WebKit registration
 int FMTuner_addClass(JSGlobalContextRef ctx)
 {
+	JSClassDefinition definition = kJSClassDefinitionEmpty;
+	JSStringRef jsName;
+	int i;
+
+	if (FMTuner_class == NULL)
+	{
+		// Names getState() sets, made once and kept for the life of the process
+		for (i = 0; i < TUNER_PROPS; i++)
+		{
+			FMTuner_propNames[i] = JSStringCreateWithUTF8CString(tunerprops_names[i]);
+		}
+		FMTuner_versionName = JSStringCreateWithUTF8CString("version");
+		for (i = 0; i < TUNER_CALLBACKS; i++)
+		{
+			FMTuner_callbackNames[i] = JSStringCreateWithUTF8CString(tuner_callback_names[i]);
+		}
+
+		definition.className = "FMTuner";
+		definition.staticFunctions = FMTuner_staticFunctions;
+		definition.initialize = FMTuner_initCB;
+		definition.finalize = FMTuner_finalizeCB;
+		definition.hasProperty = FMTuner_hasPropCB;
+		definition.getProperty = FMTuner_getPropCB;
+		definition.setProperty = FMTuner_setPropCB;
+		definition.hasInstance = FMTuner_hasInstCB;
+		FMTuner_class = JSClassCreate(&definition);
+		if (FMTuner_class == NULL)
+			return ENOMEM;
+	}
+
+	// Pages make their tuner with new FMTuner()
+	jsName = JSStringCreateWithUTF8CString("FMTuner");
+	JSObjectSetProperty(ctx, JSContextGetGlobalObject(ctx), jsName,
+			    JSObjectMakeConstructor(ctx, FMTuner_class, FMTuner_callAsCtorCB),
+			    kJSPropertyAttributeReadOnly | kJSPropertyAttributeDontDelete, NULL);
+	JSStringRelease(jsName);
+
+	return 0;
 }
@@ -20,6 +20,12 @@ bool FMTuner_setPropCB(JSContextRef ctx, JSObjectRef object, JSStringRef propNam
 
 // Methods
 JSValueRef FMTuner_callAsFnCB(JSContextRef ctx, JSObjectRef thisObject, size_t argCount, const JSValueRef arguments[], JSValueRef *exception);
+JSValueRef FMTuner_seekCB(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argCount,
+			  const JSValueRef arguments[], JSValueRef *exception);
+JSValueRef FMTuner_scanCB(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argCount,
+			  const JSValueRef arguments[], JSValueRef *exception);
+JSValueRef FMTuner_getStateCB(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argCount,
+			      const JSValueRef arguments[], JSValueRef *exception);
 
 // Constructor
 JSObjectRef FMTuner_callAsCtorCB(JSContextRef ctx, JSObjectRef thisObject, size_t argCount, const JSValueRef arguments[], JSValueRef *exception);
@@ -0,0 +1,222 @@
+// File: eventring.c -- lock-free single-producer/single-consumer event ring implementation
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include "eventring.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int eventring_init(struct eventring *ring, unsigned int capacity)
+{
+	unsigned int pow2_capacity = 1;
+	int ret;
+
+	if (capacity == 0 || capacity > (1U << 30))
+		return EINVAL;
+
+	// Round up to a power of two so slot indexing is a mask rather than a modulo
+	while (pow2_capacity < capacity)
+		pow2_capacity <<= 1;
+
+	ring->slots = (void **)calloc(pow2_capacity, sizeof(void *));
+	if (ring->slots == NULL)
+	{
+		perror("eventring_init() -- failed to allocate ring slots");
+		return ENOMEM;
+	}
+
+	if (sem_init(&(ring->space_sem), false, 0) != 0)
+	{
+		ret = errno;
+		perror("eventring_init() -- failed to initialize space semaphore");
+		free(ring->slots);
+		ring->slots = NULL;
+		return ret;
+	}
+
+	ring->capacity = pow2_capacity;
+	ring->mask = pow2_capacity - 1;
+	ring->cached_head = ring->cached_tail = 0;
+	atomic_init(&(ring->head), 0);
+	atomic_init(&(ring->tail), 0);
+	atomic_init(&(ring->producer_waiting), false);
+	atomic_init(&(ring->closed), false);
+	ring->stealable = false;
+
+	return 0;
+}
+
+void eventring_allow_steal(struct eventring *ring)
+{
+	ring->stealable = true;
+}
+
+int eventring_destroy(struct eventring *ring)
+{
+	int ret = 0;
+
+	if (sem_destroy(&(ring->space_sem)) != 0)
+	{
+		ret = errno;
+		perror("eventring_destroy() -- failed on sem_destroy");
+	}
+
+	free(ring->slots);
+	ring->slots = NULL;
+
+	return ret;
+}
+
+int eventring_enqueue(struct eventring *ring, void *item)
+{
+	unsigned int tail = atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+	int ret;
+
+	for (;;)
+	{
+		if (atomic_load_explicit(&(ring->closed), memory_order_acquire))
+			return ECANCELED;
+
+		// Only go back to the consumer's index when our cached copy says the ring is full
+		if (tail - ring->cached_head < ring->capacity)
+			break;
+		ring->cached_head = atomic_load_explicit(&(ring->head), memory_order_acquire);
+		if (tail - ring->cached_head < ring->capacity)
+			break;
+
+		// The ring is full. Announce that we are about to park, then look again so a
+		// dequeue that raced with the announcement cannot leave us waiting forever
+		atomic_store_explicit(&(ring->producer_waiting), true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		ring->cached_head = atomic_load_explicit(&(ring->head), memory_order_acquire);
+		if (tail - ring->cached_head < ring->capacity ||
+		    atomic_load_explicit(&(ring->closed), memory_order_acquire))
+		{
+			atomic_store_explicit(&(ring->producer_waiting), false, memory_order_relaxed);
+			continue;
+		}
+
+		// A stale post from an earlier race only costs us one extra trip around the loop
+		if (sem_wait(&(ring->space_sem)) != 0 && errno != EINTR)
+		{
+			ret = errno;
+			perror("eventring_enqueue() -- failed to wait on free slot");
+			return ret;
+		}
+	}
+
+	ring->slots[tail & ring->mask] = item;
+	atomic_store_explicit(&(ring->tail), tail + 1, memory_order_release);
+
+	return 0;
+}
+
+int eventring_dequeue(struct eventring *ring, void **item)
+{
+	unsigned int head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+	int ret;
+
+	// Only go back to the producer's index when our cached copy says the ring is empty.
+	// On a stealable ring head can overtake our cached copy, hence the signed compare
+	if ((int)(ring->cached_tail - head) <= 0)
+	{
+		ring->cached_tail = atomic_load_explicit(&(ring->tail), memory_order_acquire);
+		if (head == ring->cached_tail)
+			return EAGAIN;
+	}
+
+	if (ring->stealable)
+	{
+		// The producer can move head too, so claim the slot with a CAS. If the producer
+		// stole it first, head now holds its new value and we go round again. The copy
+		// read from a slot we lost is stale and thrown away
+		for (;;)
+		{
+			*item = ring->slots[head & ring->mask];
+			if (atomic_compare_exchange_weak_explicit(&(ring->head), &head, head + 1,
+								  memory_order_release, memory_order_relaxed))
+				break;
+			if ((int)(ring->cached_tail - head) <= 0)
+			{
+				ring->cached_tail = atomic_load_explicit(&(ring->tail), memory_order_acquire);
+				if (head == ring->cached_tail)
+					return EAGAIN;
+			}
+		}
+	}
+	else
+	{
+		*item = ring->slots[head & ring->mask];
+		atomic_store_explicit(&(ring->head), head + 1, memory_order_release);
+	}
+
+	// Pairs with the fence in eventring_enqueue -- either the producer sees our new head
+	// on its second look, or we see its waiting flag here and wake it
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&(ring->producer_waiting), memory_order_relaxed) &&
+	    atomic_exchange_explicit(&(ring->producer_waiting), false, memory_order_relaxed))
+	{
+		if (sem_post(&(ring->space_sem)) != 0)
+		{
+			ret = errno;
+			perror("eventring_dequeue() -- failed on sem_post");
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int eventring_steal(struct eventring *ring, void **item)
+{
+	unsigned int tail = atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&(ring->head), memory_order_acquire);
+
+	if (!ring->stealable)
+		return EINVAL;
+
+	// We wrote every item in the ring, so reading the oldest one is safe. Whoever moves
+	// head past it owns it
+	do
+	{
+		if (head == tail)
+			return EAGAIN;
+		*item = ring->slots[head & ring->mask];
+	}
+	while (!atomic_compare_exchange_weak_explicit(&(ring->head), &head, head + 1,
+						      memory_order_acq_rel, memory_order_acquire));
+
+	ring->cached_head = head + 1;
+	return 0;
+}
+
+int eventring_close(struct eventring *ring)
+{
+	int ret;
+
+	atomic_store_explicit(&(ring->closed), true, memory_order_release);
+
+	// Release the producer if it is parked on a full ring. It will see the closed flag
+	// and give up on its enqueue
+	atomic_thread_fence(memory_order_seq_cst);
+	if (sem_post(&(ring->space_sem)) != 0)
+	{
+		ret = errno;
+		perror("eventring_close() -- failed on sem_post");
+		return ret;
+	}
+
+	return 0;
+}
+
+unsigned int eventring_count(struct eventring *ring)
+{
+	unsigned int tail = atomic_load_explicit(&(ring->tail), memory_order_acquire);
+	unsigned int head = atomic_load_explicit(&(ring->head), memory_order_acquire);
+
+	return tail - head;
+}
+
+// end of file
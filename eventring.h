@@ -0,0 +1,65 @@
+// File: eventring.h -- lock-free single-producer/single-consumer event ring
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#ifndef EVENTRING_H
+#define EVENTRING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <semaphore.h>
+
+// Indices are padded out to their own cache lines so the producer and consumer
+// never write to the same line on the fast path
+#define EVENTRING_CACHE_LINE	64
+
+// The ring holds opaque item pointers. Exactly one thread may enqueue and exactly one
+// thread may dequeue at any given time. Neither side takes a lock unless the ring is full,
+// in which case the producer parks on a semaphore until the consumer frees a slot.
+struct eventring
+{
+	// Consumer side
+	_Alignas(EVENTRING_CACHE_LINE) atomic_uint head;	// Next read slot
+	unsigned int cached_tail;				// Consumer's last view of tail
+
+	// Producer side
+	_Alignas(EVENTRING_CACHE_LINE) atomic_uint tail;	// Next write slot
+	unsigned int cached_head;				// Producer's last view of head
+	atomic_bool producer_waiting;				// Producer is parked on space_sem
+
+	// Shared, read-mostly state
+	_Alignas(EVENTRING_CACHE_LINE) unsigned int capacity;	// Always a power of two
+	unsigned int mask;
+	atomic_bool closed;					// Set once the ring is shutting down
+	bool stealable;						// Producer may take back the oldest item
+	sem_t space_sem;					// Only touched when the ring is full
+	void **slots;
+};
+
+// Ring setup/teardown -- capacity is rounded up to the next power of two
+int eventring_init(struct eventring *ring, unsigned int capacity);
+int eventring_destroy(struct eventring *ring);
+
+// Lets the producer take items back with eventring_steal. Must be called before either
+// side touches the ring, and costs the consumer a compare-and-swap on every dequeue
+void eventring_allow_steal(struct eventring *ring);
+
+// Producer side. Blocks while the ring is full, returns ECANCELED if the ring is closed
+int eventring_enqueue(struct eventring *ring, void *item);
+
+// Producer side. Takes back the oldest item, racing the consumer for it, so a full ring
+// can make room without waiting. Returns EAGAIN if the consumer emptied the ring first
+int eventring_steal(struct eventring *ring, void **item);
+
+// Consumer side. Returns EAGAIN if the ring is empty
+int eventring_dequeue(struct eventring *ring, void **item);
+
+// Consumer side. Prevents further enqueueing and releases a blocked producer. Items still
+// in the ring can be drained with eventring_dequeue
+int eventring_close(struct eventring *ring);
+
+// Approximate number of queued items (exact when called from either end)
+unsigned int eventring_count(struct eventring *ring);
+
+#endif
@@ -0,0 +1,226 @@
+// File: fmaf.c -- RDS alternative frequency retune for the FM driver interface
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fmdriverif_priv.h"
+
+void af_update(struct fmdriverif_state *driver_state, const struct rds_data *field)
+{
+	struct af_entry *entry;
+	unsigned short pi;
+	int freq_khz, i;
+
+	if (field->data_length < 2)
+		return;
+	pi = (field->data[0] << 8) | field->data[1];
+
+	// A programme we haven't had a list for takes the entry used longest ago
+	entry = af_lookup(driver_state, pi);
+	if (entry == NULL)
+	{
+		entry = &(driver_state->af_table[0]);
+		for (i = 1; i < AF_TABLE_SIZE; i++)
+		{
+			if (driver_state->af_table[i].used < entry->used)
+				entry = &(driver_state->af_table[i]);
+		}
+		entry->pi = pi;
+	}
+
+	// Only the frequencies this tuner can reach are worth trying
+	entry->num_freqs = 0;
+	for (i = 2; i < field->data_length && entry->num_freqs < RDS_AF_MAX; i++)
+	{
+		freq_khz = RDS_AF_KHZ(field->data[i]);
+		if (freq_khz >= driver_state->range_low_khz && freq_khz <= driver_state->range_high_khz)
+			entry->freqs_khz[entry->num_freqs++] = freq_khz;
+	}
+	entry->used = ++driver_state->af_clock;
+}
+
+struct af_entry *af_lookup(struct fmdriverif_state *driver_state, unsigned short pi)
+{
+	int i;
+
+	for (i = 0; i < AF_TABLE_SIZE; i++)
+	{
+		if (driver_state->af_table[i].used != 0 && driver_state->af_table[i].pi == pi)
+			return &(driver_state->af_table[i]);
+	}
+
+	return NULL;
+}
+
+struct af_entry *af_current(struct fmdriverif_state *driver_state)
+{
+	// Only the worker writes snapshots, so it can read the current one as it stands
+	unsigned int seq = atomic_load_explicit(&(driver_state->snapshot_seq), memory_order_relaxed);
+	const struct fmdriver_snapshot *snapshot = &(driver_state->snapshots[seq & 1]);
+	struct af_entry *entry;
+
+	if (atomic_load_explicit(&(driver_state->af_threshold), memory_order_relaxed) == 0 ||
+	    !(snapshot->rds_valid & FMDRIVER_RDS_PI))
+		return NULL;
+
+	entry = af_lookup(driver_state, snapshot->pi);
+	return (entry != NULL && entry->num_freqs > 0) ? entry : NULL;
+}
+
+void af_monitor(struct fmdriverif_state *driver_state)
+{
+	struct video_tuner tuner;
+	struct af_entry *entry;
+	uint64_t now_ns = stats_now_ns();
+	int ret;
+
+	// Runs on the I/O worker after each RDS poll
+	entry = af_current(driver_state);
+	if (entry == NULL || now_ns < driver_state->af_next_check_ns)
+		return;
+	driver_state->af_next_check_ns = now_ns + AF_CHECK_MS * 1000000ULL;
+
+	// Query into a scratch struct, as a scan does, so the tuner range we keep stays put
+	memset(&tuner, 0, sizeof(tuner));
+	tuner.tuner = driver_state->tuner_info.tuner;
+	if (driver_ioctl(driver_state, VIDIOCGTUNER, &tuner) < 0 ||
+	    tuner.signal >= atomic_load_explicit(&(driver_state->af_threshold), memory_order_relaxed))
+		return;
+
+	ret = af_retune(driver_state, entry, tuner.signal);
+	if (ret == ENODEV)
+	{
+		device_detach(driver_state, ret);
+	}
+	else if (ret != 0)
+	{
+		// Nothing better around -- don't keep pulling the tuner off the station to look
+		driver_state->af_next_check_ns = now_ns +
+			atomic_load_explicit(&(driver_state->af_hold_ms), memory_order_relaxed) * 1000000ULL;
+	}
+}
+
+int af_retune(struct fmdriverif_state *driver_state, const struct af_entry *entry, int signal)
+{
+	struct fmdriver_station candidates[RDS_AF_MAX], station;
+	struct fmdriver_snapshot kept, *snapshot;
+	struct fmdriver_tune_data tune_data;
+	uint64_t start_ns = stats_now_ns();
+	unsigned short pi = entry->pi;
+	int num_candidates = 0, ret, i, j;
+	bool moved = false;
+
+	atomic_fetch_add_explicit(&(driver_state->af_checks), 1, memory_order_relaxed);
+
+	// Measure every alternative, keeping the ones stronger than where we are, strongest first
+	for (i = 0; i < entry->num_freqs && !io_interrupted(driver_state); i++)
+	{
+		if (entry->freqs_khz[i] == driver_state->freq_khz)
+			continue;
+
+		moved = true;
+		ret = scan_measure(driver_state, entry->freqs_khz[i], AF_SETTLE_US, &station);
+		if (ret == ENODEV)
+			return ret;
+		if (ret != 0 || station.signal <= signal)
+			continue;
+
+		for (j = num_candidates; j > 0 && candidates[j - 1].signal < station.signal; j--)
+		{
+			candidates[j] = candidates[j - 1];
+		}
+		candidates[j] = station;
+		num_candidates++;
+	}
+
+	// A strong signal is no good unless it is the same programme -- lists can name regional
+	// variants, and a channel can belong to someone else round here
+	for (i = 0; i < num_candidates && i < AF_VERIFY_MAX && !io_interrupted(driver_state); i++)
+	{
+		ret = af_check_pi(driver_state, candidates[i].freq, pi);
+		if (ret == ENODEV)
+			return ret;
+		if (ret != 0)
+			continue;
+
+		// Same programme, so what RDS has told the client so far still holds
+		kept = driver_state->snapshots[atomic_load_explicit(&(driver_state->snapshot_seq), memory_order_relaxed) & 1];
+		ret = report_station(driver_state, candidates[i].freq, &tune_data);
+		if (ret != 0)
+			return ret;
+		snapshot = snapshot_begin(driver_state);
+		snapshot->rds_valid = kept.rds_valid;
+		snapshot->pi = kept.pi;
+		snapshot->pty = kept.pty;
+		memcpy(snapshot->ps, kept.ps, sizeof(snapshot->ps));
+		memcpy(snapshot->ptyn, kept.ptyn, sizeof(snapshot->ptyn));
+		memcpy(snapshot->rt, kept.rt, sizeof(snapshot->rt));
+		snapshot_publish(driver_state);
+
+		// The neighbours a seek found were for the old frequency
+		seek_cache_drop(driver_state);
+
+		latency_record(&(driver_state->af_retune), stats_now_ns() - start_ns);
+		atomic_fetch_add_explicit(&(driver_state->af_switches), 1, memory_order_relaxed);
+
+		// The client sees a tune it didn't ask for
+		fifo_post_event(driver_state, FM_EVENT_TUNE, 0, &tune_data, sizeof(tune_data));
+		return 0;
+	}
+
+	// Back to the station we were on
+	if (moved)
+	{
+		ret = scan_restore(driver_state);
+		if (ret == ENODEV)
+			return ret;
+	}
+
+	return ENOENT;
+}
+
+int af_check_pi(struct fmdriverif_state *driver_state, int freq_khz, unsigned short pi)
+{
+	unsigned char records[RDS_READ_RECORDS * RDS_RECORD_SIZE];
+	unsigned long freq_units = khz_to_tuner_units(driver_state, freq_khz);
+	uint64_t deadline_ns;
+	ssize_t len, i;
+	int ret;
+
+	if (driver_ioctl(driver_state, VIDIOCSFREQ, &freq_units) < 0)
+		return errno;
+
+	// Whatever the driver still has buffered came from the station we are leaving, which
+	// has the very PI we are looking for
+	ret = rds_discard(driver_state);
+	if (ret != 0)
+		return ret;
+
+	// PI is block A of every group, so the first one the tuner gets intact settles it
+	deadline_ns = stats_now_ns() + AF_PI_WAIT_MS * 1000000ULL;
+	do
+	{
+		usleep(AF_PI_POLL_MS * 1000);
+		while ((len = driver_read_rds(driver_state, records, sizeof(records))) > 0)
+		{
+			for (i = 0; i + RDS_RECORD_SIZE <= len; i += RDS_RECORD_SIZE)
+			{
+				if ((records[i + 2] & RDS_RECORD_BLOCK_MSK) == RDS_BLOCK_A && !(records[i + 2] & RDS_RECORD_ERROR))
+					return ((records[i] | (records[i + 1] << 8)) == pi) ? 0 : EILSEQ;
+			}
+		}
+		if (len < 0 && errno != EAGAIN)
+			return errno;
+	}
+	while (stats_now_ns() < deadline_ns);
+
+	return ETIMEDOUT;
+}
+
+// end of file
@@ -0,0 +1,151 @@
+// File: fmbackend.c -- tuner backends for the FM driver interface
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "fmdriverif_priv.h"
+
+// device fspec for FM tuner driver
+#define RADIO_DEVICE		"/dev/radio"
+
+// Names the backend when the client hasn't picked one
+#define BACKEND_ENV		"FMTUNER_BACKEND"
+
+// V4L backend functions
+int v4l_open(struct fmdriverif_state *driver_state);
+void v4l_close(struct fmdriverif_state *driver_state);
+int v4l_ioctl(struct fmdriverif_state *driver_state, unsigned long request, void *arg);
+ssize_t v4l_read_rds(struct fmdriverif_state *driver_state, unsigned char *records, size_t len);
+int v4l_seek(struct fmdriverif_state *driver_state, bool seek_up, unsigned long *freq_units);
+
+// Private functions
+const struct fmdriver_backend *backend_find(const char *name);
+
+const struct fmdriver_backend v4l_backend =
+{
+	"v4l", v4l_open, v4l_close, v4l_ioctl, v4l_read_rds, v4l_seek, true
+};
+
+const struct fmdriver_backend *backends[] = { &v4l_backend, &sim_backend };
+
+// Backend picked with fmdriverif_set_backend, NULL until then
+const struct fmdriver_backend *backend_chosen;
+pthread_mutex_t backend_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int v4l_open(struct fmdriverif_state *driver_state)
+{
+	snprintf(driver_state->device_path, sizeof(driver_state->device_path), "%s%d",
+		 RADIO_DEVICE, driver_state->tuner_id);
+
+	driver_state->tuner_fd = open(driver_state->device_path, O_RDONLY);
+	if (driver_state->tuner_fd < 0)
+		return -1;
+
+	return 0;
+}
+
+void v4l_close(struct fmdriverif_state *driver_state)
+{
+	if (driver_state->tuner_fd >= 0)
+	{
+		if (close(driver_state->tuner_fd) != 0)
+		{
+			perror("v4l_close() -- failed on close");
+		}
+		driver_state->tuner_fd = -1;
+	}
+}
+
+int v4l_ioctl(struct fmdriverif_state *driver_state, unsigned long request, void *arg)
+{
+	return ioctl(driver_state->tuner_fd, request, arg);
+}
+
+ssize_t v4l_read_rds(struct fmdriverif_state *driver_state, unsigned char *records, size_t len)
+{
+	struct pollfd poll_fd;
+
+	// The driver's read blocks until it has a record, so check first
+	poll_fd.fd = driver_state->tuner_fd;
+	poll_fd.events = POLLIN;
+	if (poll(&poll_fd, 1, 0) <= 0 || !(poll_fd.revents & POLLIN))
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return read(driver_state->tuner_fd, records, len);
+}
+
+int v4l_seek(struct fmdriverif_state *driver_state, bool seek_up, unsigned long *freq_units)
+{
+	// The V4L radio interface has no way to start the tuner's own seek
+	errno = ENOSYS;
+	return -1;
+}
+
+const struct fmdriver_backend *backend_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+	{
+		if (strcmp(backends[i]->name, name) == 0)
+			return backends[i];
+	}
+
+	return NULL;
+}
+
+const struct fmdriver_backend *backend_select(void)
+{
+	const struct fmdriver_backend *backend;
+	const char *name;
+
+	pthread_mutex_lock(&backend_mutex);
+	backend = backend_chosen;
+	pthread_mutex_unlock(&backend_mutex);
+
+	if (backend == NULL)
+	{
+		name = getenv(BACKEND_ENV);
+		if (name != NULL)
+		{
+			backend = backend_find(name);
+			if (backend == NULL)
+			{
+				fprintf(stderr, "backend_select() -- unknown backend %s, using V4L\n", name);
+			}
+		}
+	}
+
+	return (backend != NULL) ? backend : &v4l_backend;
+}
+
+int fmdriverif_set_backend(const char *name)
+{
+	const struct fmdriver_backend *backend;
+
+	if (name == NULL)
+		return EINVAL;
+
+	backend = backend_find(name);
+	if (backend == NULL)
+		return ENOENT;
+
+	pthread_mutex_lock(&backend_mutex);
+	backend_chosen = backend;
+	pthread_mutex_unlock(&backend_mutex);
+
+	return 0;
+}
+
+// end of file
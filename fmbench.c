@@ -0,0 +1,1401 @@
+// File: fmbench.c -- microbenchmarks for the FM driver interface hot paths
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+
+#include "eventring.h"
+#include "rdsdecoder.h"
+#include "fmdriverif.h"
+#include "fmsim.h"
+#include "fmtelemetry.h"
+#include "tunerprops.h"
+
+#define BENCH_FIFO_CAPACITY	32
+#define BENCH_THROUGHPUT_EVENTS	2000000
+#define BENCH_LATENCY_EVENTS	200000
+#define BENCH_LATENCY_GAP_NS	10000
+#define BENCH_RDS_GROUPS	250000
+#define BENCH_RDS_ERROR_RATE	50		// One burst error per this many blocks
+#define BENCH_RDS_GROUP_RATE	11.4		// Groups per second a tuner receives on air
+#define BENCH_SIM_TUNERS	10
+#define BENCH_SIM_TUNES		50		// Tunes per simulated tuner
+#define BENCH_SIM_SPEEDUP	100		// RDS rate multiplier
+#define BENCH_SIM_TUNE_US	1000		// Simulated tune time
+#define BENCH_SIM_TIMEOUT_S	60
+#define BENCH_POLL_WINDOW_MS	3000		// Time the polling run leaves the tuners playing
+#define BENCH_SEEKS		28		// Seek presses per run, four times round the band
+#define BENCH_SEEK_GAP_US	200000		// Between presses, so a helper can prefetch
+#define BENCH_AF_RUNS		8		// Fades, each ending in a switch to an alternative
+#define BENCH_AF_FADE_MS	400
+#define BENCH_AF_TIMEOUT_MS	5000
+#define BENCH_TELEMETRY_MS	10		// Sample interval
+#define BENCH_TELEMETRY_READS	1000000		// Reads of the newest sample
+#define BENCH_PROP_GETS		200000		// Property reads per lookup method
+#define BENCH_PROP_NAME_MAX	16
+#define BENCH_OPEN_CYCLES	100		// Open/close cycles per handle
+#define BENCH_REQUESTS		2000		// Request round trips per handle
+#define BENCH_MAX_HANDLES	10		// Tuner ids run 0-9
+#define BENCH_DEFAULT_HANDLES	8
+#define BENCH_MAX_RESULTS	64
+#define BENCH_TOLERANCE_PCT	25		// Change against a baseline counted as a regression
+
+// Reference copy of the original mutex + counting semaphore FIFO, kept here so the
+// lock-free ring can be measured against it
+struct legacy_fifo
+{
+	pthread_mutex_t mutex;
+	sem_t slots;
+	void *items[BENCH_FIFO_CAPACITY];
+	int head;
+	int tail;
+};
+
+// A FIFO under test
+struct bench_fifo_ops
+{
+	const char *name;
+	void *(*create)(void);
+	int (*enqueue)(void *fifo, void *item);
+	int (*dequeue)(void *fifo, void **item);
+	void (*destroy)(void *fifo);
+};
+
+// Producer/consumer run parameters and results
+struct bench_run
+{
+	const struct bench_fifo_ops *ops;
+	void *fifo;
+	int num_events;
+	uint64_t gap_ns;		// Producer pacing, 0 for flat out
+	uint64_t *enqueue_ns;		// Per-event enqueue timestamps
+	uint64_t *latency_ns;		// Per-event enqueue-to-dequeue latency
+	int num_samples;		// Latencies recorded
+	int torn;			// Items popped before the producer wrote them
+};
+
+// One line of results. Rates are operations per second; latencies are 0 where the
+// benchmark has none
+struct bench_result
+{
+	char name[32];
+	int handles;
+	double ops_per_sec;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+};
+
+// A client thread with its own interface handle
+struct bench_client
+{
+	int tuner_id;
+	int num_ops;
+	uint64_t *latency_ns;		// One per operation
+	pthread_rwlock_t *start;	// Write locked until every client is ready to go
+	int ret;
+};
+
+// A simulated tuner being driven through the full interface
+struct bench_sim_tuner
+{
+	unsigned long if_handle;
+	int event_fd;
+	int tunes;			// Tunes completed through to the first PS
+	int next_station;
+	uint64_t tune_ns;		// When the last tune was requested
+	uint64_t tuned_ns;		// When its event arrived, 0 while waiting
+};
+
+// Simulated tuner run parameters and results
+struct bench_sim_run
+{
+	struct fmsim_config config;
+	int stations[FMSIM_MAX_STATIONS];	// Stations that send a PS
+	int num_stations;
+	uint64_t *tune_ns;			// Tune round trips
+	int num_tunes;
+	uint64_t *ps_ns;			// Tune completion to first PS
+	int num_ps;
+	unsigned long rds_events;
+	int done;				// Tuners through all their tunes
+};
+
+uint64_t bench_now_ns(void);
+int bench_cmp_u64(const void *a, const void *b);
+void *legacy_create(void);
+int legacy_enqueue(void *fifo, void *item);
+int legacy_dequeue(void *fifo, void **item);
+void legacy_destroy(void *fifo);
+void *ring_create(void);
+int ring_enqueue(void *fifo, void *item);
+int ring_dequeue(void *fifo, void **item);
+void ring_destroy(void *fifo);
+void *bench_producer(void *arg);
+int bench_fifo_run(struct bench_run *run, double *events_per_sec);
+int bench_fifo(const struct bench_fifo_ops *ops);
+void bench_record(const char *name, int handles, double ops_per_sec, uint64_t *samples, int num_samples);
+int bench_write_results(const char *path);
+int bench_compare(const char *path, int tolerance_pct, int *regressions);
+void *bench_open_client(void *arg);
+void *bench_request_client(void *arg);
+int bench_clients(const char *name, void *(*client)(void *), int num_handles, int ops_per_handle);
+int bench_handles(int max_handles);
+int bench_rds_generate(unsigned int **blocks_ptr, int *num_blocks);
+int bench_rds_load(const char *path, unsigned int **blocks_ptr, int *num_blocks);
+unsigned int bench_syndrome_bitwise(unsigned int block);
+void bench_rds_field(void *context, const struct rds_data *field);
+int bench_rds(const char *stream_path);
+int bench_sim_tune(struct bench_sim_run *run, struct bench_sim_tuner *tuner);
+int bench_sim_event(struct bench_sim_run *run, struct bench_sim_tuner *tuner, const struct fmdriver_event *event,
+		    uint64_t now);
+int bench_sim(bool managed);
+int bench_rds_polling(void);
+int bench_seek_run(const char *name, unsigned long if_handle, int num_handles, int gap_us);
+int bench_seek(void);
+int bench_af_run(unsigned long *switch_us);
+int bench_af(void);
+int bench_telemetry(void);
+bool bench_prop_equal_utf8(const unsigned short *chars, size_t len, const char *utf8);
+int bench_prop_chain(const unsigned short *chars, size_t len);
+int bench_props(void);
+
+// Results from the run, in the order they were measured
+struct bench_result bench_results[BENCH_MAX_RESULTS];
+int bench_num_results;
+
+uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+void bench_record(const char *name, int handles, double ops_per_sec, uint64_t *samples, int num_samples)
+{
+	struct bench_result *result;
+
+	if (bench_num_results >= BENCH_MAX_RESULTS)
+		return;
+	result = &(bench_results[bench_num_results++]);
+
+	snprintf(result->name, sizeof(result->name), "%s", name);
+	result->handles = handles;
+	result->ops_per_sec = ops_per_sec;
+	result->p50_ns = result->p99_ns = result->p999_ns = 0;
+	if (samples != NULL && num_samples > 0)
+	{
+		qsort(samples, num_samples, sizeof(uint64_t), bench_cmp_u64);
+		result->p50_ns = samples[num_samples / 2];
+		result->p99_ns = samples[(num_samples * 99) / 100];
+		result->p999_ns = samples[(num_samples * 999) / 1000];
+	}
+
+	printf("%-22s %2d %14.0f ops/s", result->name, handles, ops_per_sec);
+	if (samples != NULL && num_samples > 0)
+	{
+		printf("   p50 %9llu ns   p99 %9llu ns   p999 %9llu ns", (unsigned long long)result->p50_ns,
+		       (unsigned long long)result->p99_ns, (unsigned long long)result->p999_ns);
+	}
+	printf("\n");
+}
+
+// Results are written as CSV, one benchmark per line, so runs can be diffed and compared
+int bench_write_results(const char *path)
+{
+	FILE *out;
+	int i;
+
+	out = fopen(path, "w");
+	if (out == NULL)
+		return errno;
+
+	fprintf(out, "name,handles,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+	for (i = 0; i < bench_num_results; i++)
+	{
+		fprintf(out, "%s,%d,%.0f,%llu,%llu,%llu\n", bench_results[i].name, bench_results[i].handles,
+			bench_results[i].ops_per_sec, (unsigned long long)bench_results[i].p50_ns,
+			(unsigned long long)bench_results[i].p99_ns, (unsigned long long)bench_results[i].p999_ns);
+	}
+
+	return (fclose(out) == 0) ? 0 : errno;
+}
+
+// A benchmark has regressed if its rate has dropped, or its p99 has grown, by more than
+// the tolerance. Benchmarks missing from either run are skipped
+int bench_compare(const char *path, int tolerance_pct, int *regressions)
+{
+	struct bench_result base;
+	unsigned long long p50, p99, p999;
+	char line[256];
+	FILE *in;
+	int i;
+
+	*regressions = 0;
+	in = fopen(path, "r");
+	if (in == NULL)
+		return errno;
+
+	printf("\ncompared with %s, %d%% tolerance\n", path, tolerance_pct);
+	while (fgets(line, sizeof(line), in) != NULL)
+	{
+		if (sscanf(line, "%31[^,],%d,%lf,%llu,%llu,%llu", base.name, &(base.handles), &(base.ops_per_sec),
+			   &p50, &p99, &p999) != 6)
+			continue;
+		base.p99_ns = p99;
+
+		for (i = 0; i < bench_num_results; i++)
+		{
+			if (strcmp(bench_results[i].name, base.name) != 0 || bench_results[i].handles != base.handles)
+				continue;
+
+			if (bench_results[i].ops_per_sec * 100 < base.ops_per_sec * (100 - tolerance_pct))
+			{
+				printf("REGRESSION %-22s %2d   %.0f ops/s, was %.0f\n", base.name, base.handles,
+				       bench_results[i].ops_per_sec, base.ops_per_sec);
+				(*regressions)++;
+			}
+			else if (base.p99_ns > 0 && bench_results[i].p99_ns * 100 > base.p99_ns * (100 + tolerance_pct))
+			{
+				printf("REGRESSION %-22s %2d   p99 %llu ns, was %llu\n", base.name, base.handles,
+				       (unsigned long long)bench_results[i].p99_ns, (unsigned long long)base.p99_ns);
+				(*regressions)++;
+			}
+			break;
+		}
+	}
+	fclose(in);
+
+	if (*regressions == 0)
+		printf("no regressions\n");
+
+	return 0;
+}
+
+void *legacy_create(void)
+{
+	struct legacy_fifo *fifo = (struct legacy_fifo *)calloc(1, sizeof(struct legacy_fifo));
+
+	if (fifo != NULL)
+	{
+		pthread_mutex_init(&(fifo->mutex), NULL);
+		sem_init(&(fifo->slots), false, BENCH_FIFO_CAPACITY);
+	}
+	return fifo;
+}
+
+int legacy_enqueue(void *arg, void *item)
+{
+	struct legacy_fifo *fifo = (struct legacy_fifo *)arg;
+
+	sem_wait(&(fifo->slots));
+	pthread_mutex_lock(&(fifo->mutex));
+	fifo->items[fifo->tail] = item;
+	fifo->tail = (fifo->tail + 1) % BENCH_FIFO_CAPACITY;
+	pthread_mutex_unlock(&(fifo->mutex));
+	return 0;
+}
+
+int legacy_dequeue(void *arg, void **item)
+{
+	struct legacy_fifo *fifo = (struct legacy_fifo *)arg;
+	int free_slots;
+
+	sem_getvalue(&(fifo->slots), &free_slots);
+	if (free_slots >= BENCH_FIFO_CAPACITY)
+		return EAGAIN;
+
+	// The producer takes its slot before writing it, so the slot can still be empty here.
+	// Clearing it after the pop makes that show up as NULL rather than an old item
+	pthread_mutex_lock(&(fifo->mutex));
+	*item = fifo->items[fifo->head];
+	fifo->items[fifo->head] = NULL;
+	fifo->head = (fifo->head + 1) % BENCH_FIFO_CAPACITY;
+	pthread_mutex_unlock(&(fifo->mutex));
+	sem_post(&(fifo->slots));
+	return 0;
+}
+
+void legacy_destroy(void *arg)
+{
+	struct legacy_fifo *fifo = (struct legacy_fifo *)arg;
+
+	sem_destroy(&(fifo->slots));
+	pthread_mutex_destroy(&(fifo->mutex));
+	free(fifo);
+}
+
+void *ring_create(void)
+{
+	struct eventring *ring;
+
+	if (posix_memalign((void **)&ring, EVENTRING_CACHE_LINE, sizeof(struct eventring)) != 0)
+		return NULL;
+	if (eventring_init(ring, BENCH_FIFO_CAPACITY) != 0)
+	{
+		free(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+int ring_enqueue(void *fifo, void *item)
+{
+	return eventring_enqueue((struct eventring *)fifo, item);
+}
+
+int ring_dequeue(void *fifo, void **item)
+{
+	return eventring_dequeue((struct eventring *)fifo, item);
+}
+
+void ring_destroy(void *fifo)
+{
+	eventring_destroy((struct eventring *)fifo);
+	free(fifo);
+}
+
+const struct bench_fifo_ops legacy_ops = { "mutex+sem", legacy_create, legacy_enqueue, legacy_dequeue, legacy_destroy };
+const struct bench_fifo_ops ring_ops = { "spsc-ring", ring_create, ring_enqueue, ring_dequeue, ring_destroy };
+
+void *bench_producer(void *arg)
+{
+	struct bench_run *run = (struct bench_run *)arg;
+	uint64_t next = bench_now_ns();
+	int i;
+
+	for (i = 0; i < run->num_events; i++)
+	{
+		if (run->gap_ns > 0)
+		{
+			// Yield rather than sleep -- timer slack would swamp the numbers we're after
+			next += run->gap_ns;
+			while (bench_now_ns() < next)
+				sched_yield();
+		}
+		// The item is just the event index; the timestamp lives in a side array
+		run->enqueue_ns[i] = bench_now_ns();
+		run->ops->enqueue(run->fifo, (void *)(uintptr_t)(i + 1));
+	}
+	return NULL;
+}
+
+int bench_fifo_run(struct bench_run *run, double *events_per_sec)
+{
+	pthread_t producer;
+	uint64_t start, elapsed;
+	void *item;
+	int received = 0;
+
+	run->num_samples = 0;
+	run->torn = 0;
+	run->fifo = run->ops->create();
+	if (run->fifo == NULL)
+		return ENOMEM;
+
+	start = bench_now_ns();
+	if (pthread_create(&producer, NULL, bench_producer, run) != 0)
+	{
+		run->ops->destroy(run->fifo);
+		return EAGAIN;
+	}
+
+	// Consumer polls the FIFO the same way fmdriverif_read_event does
+	while (received < run->num_events)
+	{
+		if (run->ops->dequeue(run->fifo, &item) != 0)
+		{
+			// Give the producer the CPU on single core machines
+			sched_yield();
+			continue;
+		}
+		received++;
+
+		// Nothing to time an item that wasn't there
+		if (item == NULL)
+		{
+			run->torn++;
+			continue;
+		}
+		run->latency_ns[run->num_samples++] = bench_now_ns() - run->enqueue_ns[(uintptr_t)item - 1];
+	}
+	elapsed = bench_now_ns() - start;
+
+	pthread_join(producer, NULL);
+	run->ops->destroy(run->fifo);
+
+	*events_per_sec = (double)run->num_events * 1e9 / (double)elapsed;
+	return 0;
+}
+
+int bench_fifo(const struct bench_fifo_ops *ops)
+{
+	struct bench_run run;
+	double throughput, paced_rate;
+	char name[32];
+	int ret;
+
+	run.ops = ops;
+	run.enqueue_ns = (uint64_t *)malloc(BENCH_THROUGHPUT_EVENTS * sizeof(uint64_t));
+	run.latency_ns = (uint64_t *)malloc(BENCH_THROUGHPUT_EVENTS * sizeof(uint64_t));
+	if (run.enqueue_ns == NULL || run.latency_ns == NULL)
+	{
+		free(run.enqueue_ns);
+		free(run.latency_ns);
+		return ENOMEM;
+	}
+
+	// Throughput -- producer runs flat out against a 32 slot FIFO
+	run.num_events = BENCH_THROUGHPUT_EVENTS;
+	run.gap_ns = 0;
+	ret = bench_fifo_run(&run, &throughput);
+
+	// Latency -- producer paced so the FIFO stays mostly empty, as it does in real use
+	if (ret == 0)
+	{
+		run.num_events = BENCH_LATENCY_EVENTS;
+		run.gap_ns = BENCH_LATENCY_GAP_NS;
+		ret = bench_fifo_run(&run, &paced_rate);
+	}
+
+	if (ret == 0)
+	{
+		snprintf(name, sizeof(name), "fifo/%s", ops->name);
+		bench_record(name, 1, throughput, run.latency_ns, run.num_samples);
+		if (run.torn > 0)
+			printf("%s: %d of %d events popped before they were written\n", name, run.torn, run.num_events);
+	}
+
+	free(run.enqueue_ns);
+	free(run.latency_ns);
+	return ret;
+}
+
+// Builds a stream like a station sending PS, radio text and PTYN, with burst errors of up
+// to RDS_MAX_BURST bits sprinkled through it
+int bench_rds_generate(unsigned int **blocks_ptr, int *num_blocks)
+{
+	const char *ps = "KISS FM ", *rt = "Wynton Marsalis Live on Bourbon Street\r", *ptyn = "Jazz    ";
+	unsigned short b, c, d;
+	unsigned int *blocks, error;
+	int group, seg, burst, i;
+
+	blocks = (unsigned int *)malloc(BENCH_RDS_GROUPS * 4 * sizeof(unsigned int));
+	if (blocks == NULL)
+		return ENOMEM;
+
+	for (group = 0; group < BENCH_RDS_GROUPS; group++)
+	{
+		// Cycle through 4 PS groups, 10 RT groups and 2 PTYN groups
+		seg = group % 16;
+		if (seg < 4)
+		{
+			b = (0 << 12) | (14 << 5) | seg;
+			c = 0xE0CD;
+			d = (ps[seg * 2] << 8) | ps[seg * 2 + 1];
+		}
+		else if (seg < 14)
+		{
+			seg -= 4;
+			b = (2 << 12) | (14 << 5) | seg;
+			c = (rt[seg * 4] << 8) | rt[seg * 4 + 1];
+			d = (rt[seg * 4 + 2] << 8) | rt[seg * 4 + 3];
+		}
+		else
+		{
+			seg -= 14;
+			b = (10 << 12) | (14 << 5) | seg;
+			c = (ptyn[seg * 4] << 8) | ptyn[seg * 4 + 1];
+			d = (ptyn[seg * 4 + 2] << 8) | ptyn[seg * 4 + 3];
+		}
+		blocks[group * 4] = rdsdecoder_encode(0x1234, RDS_BLOCK_A);
+		blocks[group * 4 + 1] = rdsdecoder_encode(b, RDS_BLOCK_B);
+		blocks[group * 4 + 2] = rdsdecoder_encode(c, RDS_BLOCK_C);
+		blocks[group * 4 + 3] = rdsdecoder_encode(d, RDS_BLOCK_D);
+	}
+
+	srand(1);
+	for (i = 0; i < BENCH_RDS_GROUPS * 4; i++)
+	{
+		if (rand() % BENCH_RDS_ERROR_RATE == 0)
+		{
+			burst = 1 + rand() % RDS_MAX_BURST;
+			error = 1 | (1U << (burst - 1)) | (rand() & ((1U << burst) - 1));
+			blocks[i] ^= error << (rand() % (27 - burst));
+		}
+	}
+
+	*blocks_ptr = blocks;
+	*num_blocks = BENCH_RDS_GROUPS * 4;
+	return 0;
+}
+
+// Recorded streams are raw 26 bit blocks, one 32 bit host-order word each
+int bench_rds_load(const char *path, unsigned int **blocks_ptr, int *num_blocks)
+{
+	FILE *stream;
+	long len;
+	int ret = 0;
+
+	stream = fopen(path, "rb");
+	if (stream == NULL)
+		return errno;
+
+	fseek(stream, 0, SEEK_END);
+	len = ftell(stream);
+	fseek(stream, 0, SEEK_SET);
+
+	*num_blocks = len / sizeof(unsigned int);
+	*blocks_ptr = (unsigned int *)malloc(*num_blocks * sizeof(unsigned int));
+	if (*blocks_ptr == NULL)
+		ret = ENOMEM;
+	else if (fread(*blocks_ptr, sizeof(unsigned int), *num_blocks, stream) != *num_blocks)
+		ret = EIO;
+
+	fclose(stream);
+	return ret;
+}
+
+// Reference syndrome by long division, to show what the lookup tables buy
+unsigned int bench_syndrome_bitwise(unsigned int block)
+{
+	int bit;
+
+	for (bit = 25; bit >= 10; bit--)
+	{
+		if (block & (1U << bit))
+			block ^= 0x5B9U << (bit - 10);
+	}
+	return block & 0x3FF;
+}
+
+void bench_rds_field(void *context, const struct rds_data *field)
+{
+	(*(unsigned long *)context)++;
+}
+
+int bench_rds(const char *stream_path)
+{
+	struct rds_decoder decoder;
+	unsigned int *blocks, check = 0;
+	unsigned long fields = 0;
+	uint64_t start, bitwise_ns, table_ns, decode_ns;
+	double groups_per_sec;
+	int num_blocks, i, ret;
+
+	ret = (stream_path != NULL) ? bench_rds_load(stream_path, &blocks, &num_blocks) :
+				      bench_rds_generate(&blocks, &num_blocks);
+	if (ret != 0)
+		return ret;
+
+	rdsdecoder_init(&decoder, bench_rds_field, &fields);
+
+	start = bench_now_ns();
+	for (i = 0; i < num_blocks; i++)
+		check += bench_syndrome_bitwise(blocks[i]);
+	bitwise_ns = bench_now_ns() - start;
+
+	start = bench_now_ns();
+	for (i = 0; i < num_blocks; i++)
+		check -= rdsdecoder_syndrome(blocks[i]);
+	table_ns = bench_now_ns() - start;
+
+	start = bench_now_ns();
+	for (i = 0; i < num_blocks; i++)
+		rdsdecoder_push_raw(&decoder, blocks[i]);
+	decode_ns = bench_now_ns() - start;
+
+	groups_per_sec = (double)decoder.groups * 1e9 / (double)decode_ns;
+	printf("\nRDS decoder, %d blocks (%s)%s\n", num_blocks, (stream_path != NULL) ? stream_path : "generated",
+	       (check != 0) ? " -- SYNDROME MISMATCH" : "");
+	bench_record("rds/syndrome-bitwise", 1, num_blocks * 1e9 / (double)bitwise_ns, NULL, 0);
+	bench_record("rds/syndrome-table", 1, num_blocks * 1e9 / (double)table_ns, NULL, 0);
+	bench_record("rds/decode-groups", 1, groups_per_sec, NULL, 0);
+	printf("%lu corrected, %lu bad, %lu fields -- %.0f tuners per core at %.1f groups/s\n",
+	       decoder.blocks_corrected, decoder.blocks_bad, fields, groups_per_sec / BENCH_RDS_GROUP_RATE,
+	       BENCH_RDS_GROUP_RATE);
+
+	free(blocks);
+	return (check != 0) ? EINVAL : 0;
+}
+
+int bench_sim_tune(struct bench_sim_run *run, struct bench_sim_tuner *tuner)
+{
+	int station = run->stations[tuner->next_station++ % run->num_stations];
+
+	tuner->tune_ns = bench_now_ns();
+	tuner->tuned_ns = 0;
+	return fmdriverif_tunerequest(tuner->if_handle, run->config.stations[station].freq);
+}
+
+int bench_sim_event(struct bench_sim_run *run, struct bench_sim_tuner *tuner, const struct fmdriver_event *event,
+		    uint64_t now)
+{
+	const struct rds_data *rds;
+
+	if (event->event_id == FM_EVENT_TUNE)
+	{
+		tuner->tuned_ns = now;
+		run->tune_ns[run->num_tunes++] = now - tuner->tune_ns;
+		return event->status_code;
+	}
+	if (event->event_id != FM_EVENT_RDS)
+		return 0;
+
+	run->rds_events++;
+	rds = (const struct rds_data *)event->event_data;
+	if (rds->field != RDS_FIELD_PS || tuner->tuned_ns == 0 || tuner->tunes == BENCH_SIM_TUNES)
+		return 0;
+
+	run->ps_ns[run->num_ps++] = now - tuner->tuned_ns;
+	if (++tuner->tunes == BENCH_SIM_TUNES)
+	{
+		run->done++;
+		return 0;
+	}
+
+	return bench_sim_tune(run, tuner);
+}
+
+int bench_sim(bool managed)
+{
+	struct bench_sim_tuner tuners[BENCH_SIM_TUNERS];
+	struct bench_sim_run run;
+	struct fmdriver_event events[16];
+	struct fmdriver_tuner_event tuner_events[16];
+	struct fmdriver_manager_stats manager_stats;
+	struct epoll_event watch, ready[BENCH_SIM_TUNERS];
+	struct bench_sim_tuner *tuner;
+	unsigned long manager = 0;
+	uint64_t now, start;
+	int epoll_fd, num_ready, num_events, i, j, k, ret = 0;
+
+	// Every interface opened from here on gets a virtual tuner, with RDS sped up so a run
+	// sees plenty of it
+	memset(&run, 0, sizeof(run));
+	fmsim_default_config(&(run.config));
+	run.config.tune_latency_us = BENCH_SIM_TUNE_US;
+	run.config.rds_speedup = BENCH_SIM_SPEEDUP;
+	run.config.rds_sync_ms = 0;
+	for (i = 0; i < run.config.num_stations; i++)
+	{
+		if (run.config.stations[i].ps[0] != '\0')
+			run.stations[run.num_stations++] = i;
+	}
+	fmdriverif_set_backend("sim");
+	fmsim_configure(&(run.config));
+
+	run.tune_ns = (uint64_t *)malloc(BENCH_SIM_TUNERS * BENCH_SIM_TUNES * sizeof(uint64_t));
+	run.ps_ns = (uint64_t *)malloc(BENCH_SIM_TUNERS * BENCH_SIM_TUNES * sizeof(uint64_t));
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (run.tune_ns == NULL || run.ps_ns == NULL || epoll_fd < 0)
+	{
+		free(run.tune_ns);
+		free(run.ps_ns);
+		if (epoll_fd >= 0)
+			close(epoll_fd);
+		return ENOMEM;
+	}
+
+	// Either a pollable interface per tuner, each with its own worker, or every tuner
+	// under one manager and its pool
+	if (managed)
+	{
+		ret = fmdriverif_manager_create(0, &manager, NULL);
+	}
+
+	memset(tuners, 0, sizeof(tuners));
+	for (i = 0; i < BENCH_SIM_TUNERS && ret == 0; i++)
+	{
+		if (managed)
+		{
+			ret = fmdriverif_manager_add(manager, i, NULL, &(tuners[i].if_handle));
+		}
+		else
+		{
+			ret = fmdriverif_open_pollable(i, &(tuners[i].if_handle), &(tuners[i].event_fd));
+			if (ret == 0)
+			{
+				watch.events = EPOLLIN;
+				watch.data.ptr = &(tuners[i]);
+				epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tuners[i].event_fd, &watch);
+			}
+		}
+		if (ret != 0)
+			break;
+
+		// Start each tuner on a different station
+		tuners[i].next_station = i;
+		ret = bench_sim_tune(&run, &(tuners[i]));
+	}
+
+	// Each tuner measures the tune round trip, then how long the new station takes to
+	// identify itself over RDS, then moves on
+	start = bench_now_ns();
+	while (ret == 0 && run.done < BENCH_SIM_TUNERS)
+	{
+		if (bench_now_ns() - start > BENCH_SIM_TIMEOUT_S * 1000000000ULL)
+		{
+			ret = ETIMEDOUT;
+			break;
+		}
+
+		if (managed)
+		{
+			if (fmdriverif_manager_read_events(manager, tuner_events, 16, 100, &num_events) != 0)
+				continue;
+			now = bench_now_ns();
+			for (j = 0; j < num_events && ret == 0; j++)
+			{
+				ret = bench_sim_event(&run, &(tuners[tuner_events[j].tuner_id]), &(tuner_events[j].event), now);
+			}
+			continue;
+		}
+
+		num_ready = epoll_wait(epoll_fd, ready, BENCH_SIM_TUNERS, 100);
+		for (i = 0; i < num_ready && ret == 0; i++)
+		{
+			tuner = (struct bench_sim_tuner *)ready[i].data.ptr;
+			while (ret == 0 && fmdriverif_read_events(tuner->if_handle, events, 16, 0, &num_events) == 0)
+			{
+				now = bench_now_ns();
+				for (j = 0; j < num_events && ret == 0; j++)
+				{
+					ret = bench_sim_event(&run, tuner, &(events[j]), now);
+				}
+			}
+		}
+	}
+	now = bench_now_ns();
+
+	if (managed)
+	{
+		fmdriverif_manager_get_stats(manager, &manager_stats);
+		if (manager != 0)
+			fmdriverif_manager_destroy(manager);
+	}
+	else
+	{
+		for (k = 0; k < BENCH_SIM_TUNERS; k++)
+		{
+			if (tuners[k].if_handle != 0)
+				fmdriverif_close(tuners[k].if_handle);
+		}
+	}
+	close(epoll_fd);
+
+	if (ret == 0 && managed)
+	{
+		printf("\nsimulated tuners under one manager, %d workers, RDS at %dx, %d us tune\n",
+		       manager_stats.workers, BENCH_SIM_SPEEDUP, BENCH_SIM_TUNE_US);
+		bench_record("mgr/tune", BENCH_SIM_TUNERS, run.num_tunes * 1e9 / (double)(now - start), run.tune_ns, run.num_tunes);
+		bench_record("mgr/first-ps", BENCH_SIM_TUNERS, run.num_ps * 1e9 / (double)(now - start), run.ps_ns, run.num_ps);
+		bench_record("mgr/rds-events", BENCH_SIM_TUNERS, run.rds_events * 1e9 / (double)(now - start), NULL, 0);
+		printf("%lu tuner turns, %lu stolen\n", manager_stats.turns, manager_stats.steals);
+	}
+	else if (ret == 0)
+	{
+		printf("\nsimulated tuners, RDS at %dx, %d us tune\n", BENCH_SIM_SPEEDUP, BENCH_SIM_TUNE_US);
+		bench_record("sim/tune", BENCH_SIM_TUNERS, run.num_tunes * 1e9 / (double)(now - start), run.tune_ns, run.num_tunes);
+		bench_record("sim/first-ps", BENCH_SIM_TUNERS, run.num_ps * 1e9 / (double)(now - start), run.ps_ns, run.num_ps);
+		bench_record("sim/rds-events", BENCH_SIM_TUNERS, run.rds_events * 1e9 / (double)(now - start), NULL, 0);
+	}
+
+	free(run.tune_ns);
+	free(run.ps_ns);
+	return ret;
+}
+
+// RDS reads while tuners sit on a station, at the real RDS rate. Half are on a station
+// with RDS, half on one without. Reads aren't a rate to maximise, so they are only shown
+int bench_rds_polling(void)
+{
+	struct fmsim_config config;
+	struct fmdriver_open_params params;
+	struct fmdriver_stats stats;
+	unsigned long handles[BENCH_SIM_TUNERS];
+	unsigned long polls[2] = { 0, 0 };
+	long saved[2] = { 0, 0 };
+	int freq[2] = { 0, 0 };
+	int event_fd, has_rds, i, ret = 0;
+
+	fmsim_default_config(&config);
+	config.tune_latency_us = BENCH_SIM_TUNE_US;
+	for (i = 0; i < config.num_stations; i++)
+	{
+		has_rds = (config.stations[i].ps[0] != '\0');
+		if (freq[has_rds] == 0)
+			freq[has_rds] = config.stations[i].freq;
+	}
+	if (freq[0] == 0 || freq[1] == 0)
+		return EINVAL;
+	fmdriverif_set_backend("sim");
+	fmsim_configure(&config);
+
+	// Nobody reads the events, so let them coalesce rather than hold up the workers
+	memset(&params, 0, sizeof(params));
+	params.pollable = true;
+	params.overflow = FMDRIVER_OVERFLOW_COALESCE;
+	memset(handles, 0, sizeof(handles));
+	for (i = 0; i < BENCH_SIM_TUNERS && ret == 0; i++)
+	{
+		ret = fmdriverif_open_ex(i, &params, &(handles[i]), &event_fd);
+		if (ret == 0)
+			ret = fmdriverif_tunerequest(handles[i], freq[i & 1]);
+	}
+
+	if (ret == 0)
+		usleep(BENCH_POLL_WINDOW_MS * 1000);
+
+	for (i = 0; i < BENCH_SIM_TUNERS; i++)
+	{
+		if (handles[i] == 0)
+			continue;
+		if (ret == 0 && fmdriverif_get_stats(handles[i], &stats) == 0)
+		{
+			polls[i & 1] += stats.rds_polls;
+			saved[i & 1] += stats.rds_polls_saved;
+		}
+		fmdriverif_close(handles[i]);
+	}
+
+	if (ret == 0)
+	{
+		printf("\nRDS polling, %d simulated tuners for %d ms\n", BENCH_SIM_TUNERS, BENCH_POLL_WINDOW_MS);
+		printf("with RDS       %6.1f reads/s per tuner, %ld saved against fixed-rate polling\n",
+		       polls[1] * 1000.0 / BENCH_POLL_WINDOW_MS / ((BENCH_SIM_TUNERS + 1) / 2), saved[1]);
+		printf("without RDS    %6.1f reads/s per tuner, %ld saved against fixed-rate polling\n",
+		       polls[0] * 1000.0 / BENCH_POLL_WINDOW_MS / (BENCH_SIM_TUNERS / 2), saved[0]);
+	}
+
+	return ret;
+}
+
+int bench_seek_run(const char *name, unsigned long if_handle, int num_handles, int gap_us)
+{
+	uint64_t samples[BENCH_SEEKS], start, total = 0;
+	int ret, i;
+
+	for (i = 0; i < BENCH_SEEKS; i++)
+	{
+		start = bench_now_ns();
+		ret = fmdriverif_seekrequest(if_handle, true);
+		if (ret != 0)
+			return ret;
+		samples[i] = bench_now_ns() - start;
+		total += samples[i];
+
+		if (gap_us > 0)
+			usleep(gap_us);
+	}
+
+	bench_record(name, num_handles, BENCH_SEEKS * 1e9 / total, samples, BENCH_SEEKS);
+
+	return 0;
+}
+
+// Seek up the band on a tuner with no seek of its own, as on the V4L radio interface: with
+// nothing to go on, with an idle second tuner prefetching, and from a scan's station table
+int bench_seek(void)
+{
+	struct fmsim_config config;
+	unsigned long if_handle, helper;
+	int ret;
+
+	fmsim_default_config(&config);
+	config.tune_latency_us = BENCH_SIM_TUNE_US;
+	config.seek_spacing_khz = 0;
+	fmdriverif_set_backend("sim");
+	fmsim_configure(&config);
+
+	printf("\nseek, simulated tuner without hardware seek\n");
+	ret = fmdriverif_open(0, NULL, &if_handle);
+	if (ret != 0)
+		return ret;
+
+	ret = fmdriverif_tunerequest(if_handle, config.stations[0].freq);
+	if (ret == 0)
+		ret = bench_seek_run("seek/sweep", if_handle, 1, 0);
+
+	if (ret == 0)
+	{
+		ret = fmdriverif_open(1, NULL, &helper);
+		if (ret == 0)
+		{
+			ret = bench_seek_run("seek/prefetch", if_handle, 2, BENCH_SEEK_GAP_US);
+			fmdriverif_close(helper);
+		}
+	}
+
+	if (ret == 0)
+		ret = fmdriverif_scanrequest(if_handle, false);
+	if (ret == 0)
+		ret = bench_seek_run("seek/table", if_handle, 1, 0);
+
+	fmdriverif_close(if_handle);
+
+	return ret;
+}
+
+int bench_af_run(unsigned long *switch_us)
+{
+	struct fmdriver_event events[BENCH_FIFO_CAPACITY];
+	struct fmdriver_stats stats;
+	unsigned long if_handle;
+	uint64_t start;
+	int event_fd, num_events, ret;
+
+	// The simulated signal fades from when the tuner is opened, so each run is a new one
+	ret = fmdriverif_open_pollable(0, &if_handle, &event_fd);
+	if (ret != 0)
+		return ret;
+
+	ret = fmdriverif_tunerequest(if_handle, 88100);
+	start = bench_now_ns();
+	while (ret == 0)
+	{
+		fmdriverif_read_events(if_handle, events, BENCH_FIFO_CAPACITY, 50, &num_events);
+		fmdriverif_get_stats(if_handle, &stats);
+		if (stats.af_switches > 0)
+		{
+			*switch_us = stats.af_retune.total_us;
+			break;
+		}
+		if (bench_now_ns() - start > BENCH_AF_TIMEOUT_MS * 1000000ULL)
+			ret = ETIMEDOUT;
+	}
+
+	fmdriverif_close(if_handle);
+
+	return ret;
+}
+
+// Drive out of range of a station whose AF list names a stronger station with another PI
+// and a weaker one with the same PI. Each switch measures the alternatives, checks the PI
+// of the stronger, then moves to the weaker. RDS runs in real time, since the PI check
+// waits on it
+int bench_af(void)
+{
+	struct fmsim_config config;
+	struct fmsim_station *station;
+	uint64_t samples[BENCH_AF_RUNS], total = 0;
+	unsigned long switch_us;
+	int ret = 0, i;
+
+	fmsim_default_config(&config);
+	config.tune_latency_us = BENCH_SIM_TUNE_US;
+	config.num_stations = 3;
+	station = &(config.stations[0]);
+	*station = (struct fmsim_station){ 88100, 0x9000, true, 0x1A31, 14, "JAZZ 88 ", "" };
+	station->af_khz[0] = 88100;
+	station->af_khz[1] = 95300;
+	station->af_khz[2] = 99100;
+	station->num_af = 3;
+	station->fade_ms = BENCH_AF_FADE_MS;
+	config.stations[1] = (struct fmsim_station){ 95300, 0xD000, true, 0x4C21, 2, "HITS 953", "" };
+	config.stations[2] = (struct fmsim_station){ 99100, 0x8000, true, 0x1A31, 14, "JAZZ 88 ", "" };
+	fmdriverif_set_backend("sim");
+	fmsim_configure(&config);
+
+	printf("\nalternative frequency retune, simulated tuner fading out\n");
+	for (i = 0; i < BENCH_AF_RUNS && ret == 0; i++)
+	{
+		ret = bench_af_run(&switch_us);
+		samples[i] = switch_us * 1000ULL;
+		total += samples[i];
+	}
+	if (ret == 0)
+		bench_record("af/retune", 1, BENCH_AF_RUNS * 1e9 / total, samples, BENCH_AF_RUNS);
+
+	return ret;
+}
+
+// A dashboard following a tuner's telemetry: each read is of the newest sample, from the
+// shared-memory ring, while the tuner goes on sampling into it
+int bench_telemetry(void)
+{
+	const struct fmtelemetry_ring *ring;
+	struct fmtelemetry_sample sample;
+	struct fmsim_config config;
+	unsigned long if_handle;
+	uint64_t start, elapsed, head;
+	unsigned long overwritten = 0, i;
+	int ret;
+
+	fmsim_default_config(&config);
+	config.tune_latency_us = BENCH_SIM_TUNE_US;
+	fmdriverif_set_backend("sim");
+	fmsim_configure(&config);
+
+	printf("\ntelemetry, simulated tuner sampled every %d ms\n", BENCH_TELEMETRY_MS);
+	ret = fmdriverif_open(0, NULL, &if_handle);
+	if (ret != 0)
+		return ret;
+
+	ret = fmdriverif_set_telemetry(if_handle, BENCH_TELEMETRY_MS);
+	if (ret == 0)
+		ret = fmtelemetry_open(0, &ring);
+	if (ret != 0)
+	{
+		fmdriverif_close(if_handle);
+		return ret;
+	}
+
+	// Wait for the first sample
+	while (fmtelemetry_head(ring) == 0)
+	{
+		usleep(BENCH_TELEMETRY_MS * 1000);
+	}
+
+	start = bench_now_ns();
+	for (i = 0; i < BENCH_TELEMETRY_READS; i++)
+	{
+		head = fmtelemetry_head(ring);
+		if (fmtelemetry_read(ring, head - 1, &sample) != 0)
+			overwritten++;
+	}
+	elapsed = bench_now_ns() - start;
+
+	bench_record("telemetry/read", 1, BENCH_TELEMETRY_READS * 1e9 / elapsed, NULL, 0);
+	printf("%.1f ns a read, %lu of %d caught mid-write\n", (double)elapsed / BENCH_TELEMETRY_READS, overwritten,
+	       BENCH_TELEMETRY_READS);
+
+	fmtelemetry_close(ring);
+	fmdriverif_close(if_handle);
+
+	return 0;
+}
+
+// What JSStringIsEqualToUTF8CString does: make a UTF-16 string from the C string, compare,
+// free it. Property names are ASCII, so each byte is a character
+bool bench_prop_equal_utf8(const unsigned short *chars, size_t len, const char *utf8)
+{
+	size_t utf8_len = strlen(utf8), i;
+	unsigned short *converted;
+	bool equal;
+
+	converted = (unsigned short *)malloc((utf8_len + 1) * sizeof(unsigned short));
+	if (converted == NULL)
+		return false;
+	for (i = 0; i < utf8_len; i++)
+		converted[i] = (unsigned char)utf8[i];
+	equal = (utf8_len == len && memcmp(converted, chars, len * sizeof(unsigned short)) == 0);
+	free(converted);
+
+	return equal;
+}
+
+// The lookup FMTuner used to do -- compare the name against each property in turn
+int bench_prop_chain(const unsigned short *chars, size_t len)
+{
+	static const char *order[] = { "Frequency", "Volume", "Region", "PICode", "PS", "PTY", "PTYN", "RT", "Stats" };
+	int i;
+
+	for (i = 0; i < sizeof(order) / sizeof(order[0]); i++)
+	{
+		if (bench_prop_equal_utf8(chars, len, order[i]))
+			return i;
+	}
+	return -1;
+}
+
+// A property read from the page is a has-property check then a get, each looking the name
+// up. Names are cycled through every property plus a miss, as a page refresh would
+int bench_props(void)
+{
+	static const char *names[] = { "Frequency", "Volume", "Region", "PICode", "PS", "PTY", "PTYN", "RT", "Stats",
+				       "getState" };
+	unsigned short chars[sizeof(names) / sizeof(names[0])][BENCH_PROP_NAME_MAX];
+	size_t lens[sizeof(names) / sizeof(names[0])];
+	int num_names = sizeof(names) / sizeof(names[0]);
+	uint64_t start, chain_ns, table_ns;
+	int chain_hits = 0, table_hits = 0;
+	size_t j;
+	int i, n;
+
+	for (n = 0; n < num_names; n++)
+	{
+		lens[n] = strlen(names[n]);
+		for (j = 0; j < lens[n]; j++)
+			chars[n][j] = (unsigned char)names[n][j];
+	}
+
+	start = bench_now_ns();
+	for (i = 0; i < BENCH_PROP_GETS; i++)
+	{
+		n = i % num_names;
+		if (bench_prop_chain(chars[n], lens[n]) >= 0 && bench_prop_chain(chars[n], lens[n]) >= 0)
+			chain_hits++;
+	}
+	chain_ns = bench_now_ns() - start;
+
+	start = bench_now_ns();
+	for (i = 0; i < BENCH_PROP_GETS; i++)
+	{
+		n = i % num_names;
+		if (tunerprops_lookup(chars[n], lens[n]) != TUNER_PROP_NONE &&
+		    tunerprops_lookup(chars[n], lens[n]) != TUNER_PROP_NONE)
+			table_hits++;
+	}
+	table_ns = bench_now_ns() - start;
+
+	printf("\nFMTuner property lookup, %d names%s\n", num_names,
+	       (chain_hits != table_hits) ? " -- LOOKUP MISMATCH" : "");
+	bench_record("props/lookup-chain", 1, BENCH_PROP_GETS * 1e9 / (double)chain_ns, NULL, 0);
+	bench_record("props/lookup-table", 1, BENCH_PROP_GETS * 1e9 / (double)table_ns, NULL, 0);
+	printf("%.1f ns a read by name comparison, %.1f ns by table\n", (double)chain_ns / BENCH_PROP_GETS,
+	       (double)table_ns / BENCH_PROP_GETS);
+
+	return (chain_hits != table_hits) ? EINVAL : 0;
+}
+
+void *bench_open_client(void *arg)
+{
+	struct bench_client *client = (struct bench_client *)arg;
+	unsigned long if_handle;
+	uint64_t start;
+	int i;
+
+	pthread_rwlock_rdlock(client->start);
+	pthread_rwlock_unlock(client->start);
+	for (i = 0; i < client->num_ops; i++)
+	{
+		start = bench_now_ns();
+		client->ret = fmdriverif_open(client->tuner_id, NULL, &if_handle);
+		if (client->ret != 0)
+			break;
+		fmdriverif_close(if_handle);
+		client->latency_ns[i] = bench_now_ns() - start;
+	}
+	return NULL;
+}
+
+void *bench_request_client(void *arg)
+{
+	struct bench_client *client = (struct bench_client *)arg;
+	unsigned long if_handle = 0;
+	uint64_t start;
+	int i;
+
+	// No condition variable, so each request returns once the I/O worker has run it
+	client->ret = fmdriverif_open(client->tuner_id, NULL, &if_handle);
+	pthread_rwlock_rdlock(client->start);
+	pthread_rwlock_unlock(client->start);
+	for (i = 0; i < client->num_ops && client->ret == 0; i++)
+	{
+		start = bench_now_ns();
+		client->ret = fmdriverif_volrequest(if_handle, i % 101);
+		client->latency_ns[i] = bench_now_ns() - start;
+	}
+	if (if_handle != 0)
+		fmdriverif_close(if_handle);
+	return NULL;
+}
+
+// Runs num_handles clients at once, each on its own handle
+int bench_clients(const char *name, void *(*client)(void *), int num_handles, int ops_per_handle)
+{
+	struct bench_client clients[BENCH_MAX_HANDLES];
+	pthread_t threads[BENCH_MAX_HANDLES];
+	pthread_rwlock_t start_lock;
+	uint64_t *latency_ns, start;
+	int started, i, ret = 0;
+
+	latency_ns = (uint64_t *)malloc(num_handles * ops_per_handle * sizeof(uint64_t));
+	if (latency_ns == NULL)
+		return ENOMEM;
+
+	// The clients hold at the lock until they have all been started, so they really do
+	// run together
+	pthread_rwlock_init(&start_lock, NULL);
+	pthread_rwlock_wrlock(&start_lock);
+
+	for (started = 0; started < num_handles; started++)
+	{
+		clients[started].tuner_id = started;
+		clients[started].num_ops = ops_per_handle;
+		clients[started].latency_ns = &(latency_ns[started * ops_per_handle]);
+		clients[started].start = &start_lock;
+		clients[started].ret = 0;
+		if (pthread_create(&(threads[started]), NULL, client, &(clients[started])) != 0)
+			break;
+	}
+	if (started < num_handles)
+	{
+		fprintf(stderr, "bench_clients() -- failed to start client threads\n");
+		ret = EAGAIN;
+	}
+
+	start = bench_now_ns();
+	pthread_rwlock_unlock(&start_lock);
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+		if (clients[i].ret != 0)
+			ret = clients[i].ret;
+	}
+
+	if (ret == 0)
+		bench_record(name, num_handles, num_handles * ops_per_handle * 1e9 / (double)(bench_now_ns() - start),
+			     latency_ns, num_handles * ops_per_handle);
+
+	pthread_rwlock_destroy(&start_lock);
+	free(latency_ns);
+	return ret;
+}
+
+int bench_handles(int max_handles)
+{
+	struct fmsim_config config;
+	int handles, ret = 0;
+
+	// Simulated tuners with no latency of their own, so only the interface is measured
+	fmsim_default_config(&config);
+	config.tune_latency_us = 0;
+	config.seek_step_us = 0;
+	fmdriverif_set_backend("sim");
+	fmsim_configure(&config);
+
+	printf("\ndriver interface, simulated tuners, 1-%d handles\n", max_handles);
+	// Doubling the handles each time, finishing on the most asked for
+	handles = 1;
+	while (ret == 0)
+	{
+		ret = bench_clients("if/open-close", bench_open_client, handles, BENCH_OPEN_CYCLES);
+		if (ret == 0)
+			ret = bench_clients("if/request-roundtrip", bench_request_client, handles, BENCH_REQUESTS);
+
+		if (handles == max_handles)
+			break;
+		handles = (handles * 2 < max_handles) ? handles * 2 : max_handles;
+	}
+
+	return ret;
+}
+
+// fmbench [-n max handles] [-o results.csv] [-b baseline.csv] [-t tolerance %] [rds stream]
+int main(int argc, char *argv[])
+{
+	const char *out_path = NULL, *baseline_path = NULL;
+	int max_handles = BENCH_DEFAULT_HANDLES, tolerance_pct = BENCH_TOLERANCE_PCT, regressions = 0;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "n:o:b:t:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			max_handles = atoi(optarg);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'b':
+			baseline_path = optarg;
+			break;
+		case 't':
+			tolerance_pct = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n handles] [-o results.csv] [-b baseline.csv] [-t tolerance%%] [rds stream]\n",
+				argv[0]);
+			return EINVAL;
+		}
+	}
+	if (max_handles < 1 || max_handles > BENCH_MAX_HANDLES)
+	{
+		fprintf(stderr, "fmbench -- handles must be 1-%d\n", BENCH_MAX_HANDLES);
+		return EINVAL;
+	}
+
+	printf("event FIFO, capacity %d, 1 producer / 1 consumer\n", BENCH_FIFO_CAPACITY);
+	ret = bench_fifo(&legacy_ops);
+	if (ret == 0)
+		ret = bench_fifo(&ring_ops);
+
+	if (ret != 0)
+		fprintf(stderr, "fmbench -- FIFO benchmark failed %d\n", ret);
+
+	// An optional argument names a recorded RDS stream to decode instead of the generated one
+	if (ret == 0)
+	{
+		ret = bench_rds((optind < argc) ? argv[optind] : NULL);
+		if (ret != 0)
+			fprintf(stderr, "fmbench -- RDS benchmark failed %d\n", ret);
+	}
+
+	if (ret == 0)
+	{
+		ret = bench_props();
+		if (ret != 0)
+			fprintf(stderr, "fmbench -- property lookup benchmark failed %d\n", ret);
+	}
+
+	// Open/close and request round trips, with more and more handles at once
+	if (ret == 0)
+	{
+		ret = bench_handles(max_handles);
+		if (ret != 0)
+			fprintf(stderr, "fmbench -- driver interface benchmark failed %d\n", ret);
+	}
+
+	// End to end through the driver interface, on simulated tuners -- a worker per tuner,
+	// then all of them on a manager's pool
+	if (ret == 0)
+	{
+		ret = bench_sim(false);
+		if (ret == 0)
+			ret = bench_sim(true);
+		if (ret == 0)
+			ret = bench_rds_polling();
+		if (ret == 0)
+			ret = bench_seek();
+		if (ret == 0)
+			ret = bench_af();
+		if (ret == 0)
+			ret = bench_telemetry();
+		if (ret != 0)
+			fprintf(stderr, "fmbench -- simulated tuner benchmark failed %d\n", ret);
+	}
+
+	if (ret == 0 && out_path != NULL)
+	{
+		ret = bench_write_results(out_path);
+		if (ret != 0)
+			fprintf(stderr, "fmbench -- failed to write %s %d\n", out_path, ret);
+	}
+
+	// Regressions against the baseline fail the run
+	if (ret == 0 && baseline_path != NULL)
+	{
+		ret = bench_compare(baseline_path, tolerance_pct, &regressions);
+		if (ret != 0)
+			fprintf(stderr, "fmbench -- failed to read %s %d\n", baseline_path, ret);
+		else if (regressions > 0)
+			ret = EDOM;
+	}
+
+	return ret;
+}
+
+// end of file
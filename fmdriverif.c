@@ -4,7 +4,6 @@
 // (c) 2012, David Switzer
 
 #include "fmdriverif.h"
-#include <math.h>
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -13,346 +12,2349 @@
 #include <getopt.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <limits.h>
-#include <semaphore.h>
+#include <time.h>
 
 #include "videodev.h"
+#include "fmdriverif_priv.h"
 
-// device fspec for FM tuner driver
-#define RADIO_DEVICE		"/dev/radio"
-
-#define EVENT_FIFO_CAPACITY	32
-#define IFSTATE_GOOD		0xDCBAABCD
-
-// Driver state definition
-struct fmdriverif_state
-{	
-	int sig;				// Magic number indicating struct is good
-	pthread_cond_t *cond;			// Interface client condition callback
-	pthread_mutex_t event_fifo_mutex;	// Mutex controlling access to event fifo state
-	sem_t event_fifo_slots;			// Counting semaphore controlling read/write from/to fifo
-
-	struct fmdriver_event *event_fifo[EVENT_FIFO_CAPACITY];	
-	int event_fifo_head;			// Next write slot
-	int event_fifo_tail;			// Next read slot
-	bool fifo_clear;			// If true, we are clearing the FIFO 
-	
-	int tuner_fd;				// File system handle to tuner driver
-};
+// Private methods
+int pool_init(struct fmdriverif_state *driver_state)
+{
+	int ret, i;
 
+	atomic_init(&(driver_state->pool_exhausted), 0);
+	driver_state->spare_event = NULL;
 
-// FIFO functions
-int fifo_enqueue(struct fmdriverif_state *driver_state, struct fmdriver_event *evt);
-int fifo_dequeue(struct fmdriverif_state *driver_state, struct fmdriver_event *evt);
-int fifo_clear(struct fmdriverif_state *driver_state);
+	// Enough slots to fill the fifo with some left over
+	driver_state->pool_size = driver_state->event_fifo.capacity + EVENT_POOL_HEADROOM;
 
-// Private methods
-int fifo_enqueue(struct fmdriverif_state *driver_state, struct fmdriver_event *evt)
-{
-	int ret;
-	
-	// Acquire a free slot
-	ret = sem_wait(&(driver_state->event_fifo_slots));
+	// One contiguous, cache-line aligned block for all the event slots
+	ret = posix_memalign((void **)&(driver_state->event_pool), EVENTRING_CACHE_LINE,
+			     driver_state->pool_size * sizeof(struct fmdriver_event));
 	if (ret != 0)
 	{
-		perror("fifo_enqueue() -- failed to wait on FIFO slot");
-		return errno;
+		fprintf(stderr, "pool_init() -- failed to allocate event pool %d\n", ret);
+		return ENOMEM;
+	}
+	memset(driver_state->event_pool, 0, driver_state->pool_size * sizeof(struct fmdriver_event));
+
+	// A coalescing fifo also keeps the latest event of each kind
+	if (driver_state->overflow == FMDRIVER_OVERFLOW_COALESCE)
+	{
+		driver_state->latest = (struct event_latest *)calloc(EVENT_KINDS, sizeof(struct event_latest));
+		if (driver_state->latest == NULL)
+		{
+			perror("pool_init() -- failed to allocate latest events");
+			free(driver_state->event_pool);
+			return ENOMEM;
+		}
+		for (i = 0; i < EVENT_KINDS; i++)
+		{
+			atomic_init(&(driver_state->latest[i].seq), 0);
+			atomic_init(&(driver_state->latest[i].pending), false);
+		}
 	}
 
-	// lock access to the fifo state
-	ret = pthread_mutex_lock(&(driver_state->event_fifo_mutex));
+	ret = eventring_init(&(driver_state->event_pool_free), driver_state->pool_size);
 	if (ret != 0)
 	{
-		fprintf(stderr, "fifo_enqueue() -- failed on pthread_mutex_lock %d\n", ret);
+		fprintf(stderr, "pool_init() -- failed to initialize free list %d\n", ret);
+		free(driver_state->latest);
+		free(driver_state->event_pool);
 		return ret;
 	}
 
-	// Don't enqueue if the fifo has been cleared -- we are probably shutting down the interface
-	if (!driver_state->fifo_clear)
+	// Everything starts out free -- the free list is never full, so this can't block
+	for (i = 0; i < driver_state->pool_size; i++)
 	{
-		// Put the event at the back of the fifo
-		driver_state->event_fifo[driver_state->event_fifo_tail] = evt;
-		// Move tail index -- modulo takes care of wrapping and semaphore count takes care of
-		// overwriting
-		driver_state->event_fifo_tail = (driver_state->event_fifo_tail + 1) % EVENT_FIFO_CAPACITY;
+		eventring_enqueue(&(driver_state->event_pool_free), &(driver_state->event_pool[i]));
 	}
 
-	// Unlock access
-	ret = pthread_mutex_unlock(&(driver_state->event_fifo_mutex));
-	if (ret != 0)
+	return 0;
+}
+
+int pool_destroy(struct fmdriverif_state *driver_state)
+{
+	int ret;
+
+	ret = eventring_destroy(&(driver_state->event_pool_free));
+	free(driver_state->event_pool);
+	driver_state->event_pool = NULL;
+	free(driver_state->latest);
+	driver_state->latest = NULL;
+
+	return ret;
+}
+
+struct fmdriver_event *pool_alloc_event(struct fmdriverif_state *driver_state)
+{
+	struct fmdriver_event *evt;
+
+	// A slot taken back from the fifo can't go onto the free list from this side, so it
+	// is used up first
+	if (driver_state->spare_event != NULL)
 	{
-		fprintf(stderr, "fifo_enqueue() -- failed on pthread_mutex_unlock %d\n", ret);
+		evt = driver_state->spare_event;
+		driver_state->spare_event = NULL;
+		return evt;
 	}
 
-	return ret;
+	if (eventring_dequeue(&(driver_state->event_pool_free), (void **)&evt) != 0)
+	{
+		atomic_fetch_add_explicit(&(driver_state->pool_exhausted), 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	return evt;
 }
 
-int fifo_dequeue(struct fmdriverif_state *driver_state, struct fmdriver_event *evt)
+int fifo_enqueue(struct fmdriverif_state *driver_state, struct fmdriver_event *evt)
 {
-	int free_slots, ret;
- 	
-	// Find out whether we have any items to dequeue by getting the semaphore count
-	ret = sem_getvalue(&(driver_state->event_fifo_slots), &free_slots);
-	if (ret != 0)
+	struct fmdriver_event *oldest;
+	uint64_t blocked_at = 0;
+	int depth, ret;
+
+	// If the fifo is full the client has fallen behind, so make sure it is awake to drain
+	// it even though this batch hasn't been flushed yet. Then it is down to the overflow
+	// policy what gives way
+	if (eventring_count(&(driver_state->event_fifo)) >= driver_state->event_fifo.capacity)
 	{
-		perror("fifo_dequeue() -- failed on sem_getvalue()");
-		return errno;
+		fifo_notify(driver_state);
+
+		switch (driver_state->overflow)
+		{
+		case FMDRIVER_OVERFLOW_DROP_NEWEST:
+			driver_state->spare_event = evt;
+			atomic_fetch_add_explicit(&(driver_state->events_dropped), 1, memory_order_relaxed);
+			return ENOSPC;
+
+		case FMDRIVER_OVERFLOW_DROP_OLDEST:
+			// Unless the client gets to it first, the oldest event makes way and we
+			// keep its slot
+			if (eventring_steal(&(driver_state->event_fifo), (void **)&oldest) == 0)
+			{
+				driver_state->spare_event = oldest;
+				atomic_fetch_add_explicit(&(driver_state->events_dropped), 1, memory_order_relaxed);
+			}
+			break;
+
+		default:
+			// We are about to block. Only a blocked enqueue is timed, which keeps the
+			// clock off the usual path. A coalescing fifo holds at most one marker of
+			// each kind, so it only ends up here if it is smaller than EVENT_KINDS
+			blocked_at = stats_now_ns();
+			break;
+		}
 	}
-	
-	// Semaphore count < 0 means the fifo is full and the enqueue thread is blocked
-	// waiting on a free slot, so we have to check for this condition 	
 
-	if (free_slots < 0 || EVENT_FIFO_CAPACITY - free_slots > 0)
+	// Put the event at the back of the fifo -- blocks while the fifo is full
+	ret = eventring_enqueue(&(driver_state->event_fifo), evt);
+	if (blocked_at != 0)
 	{
-		// There are items to dequeue, so lock fifo access
-		ret = pthread_mutex_lock(&(driver_state->event_fifo_mutex));
-		if (ret != 0)
+		latency_record(&(driver_state->enqueue_wait), stats_now_ns() - blocked_at);
+	}
+	if (ret == 0)
+	{
+		depth = eventring_count(&(driver_state->event_fifo));
+		if (depth > atomic_load_explicit(&(driver_state->fifo_high_water), memory_order_relaxed))
 		{
-			fprintf(stderr, "fifo_dequeue() -- failed on pthread_mutex_lock %d\n", ret);
-			return ret;
-		}	
-			
-		// Take the event from the head
-		evt = driver_state->event_fifo[driver_state->event_fifo_head];
-		// Mark the pointer as NULL  -- consumer is responsible for freeing when done
-		driver_state->event_fifo[driver_state->event_fifo_head] = NULL;	
-		// Move the head to the next in line
-		driver_state->event_fifo_head = (driver_state->event_fifo_head + 1) % EVENT_FIFO_CAPACITY;
-			
-		// Unlock fifo access
-		ret = pthread_mutex_unlock(&(driver_state->event_fifo_mutex));
-		if (ret != 0)
+			atomic_store_explicit(&(driver_state->fifo_high_water), depth, memory_order_relaxed);
+		}
+	}
+	else
+	{
+		// ECANCELED means the fifo has been cleared -- we are probably shutting down the
+		// interface, so the event is simply dropped. Its slot goes away with the pool
+		if (ret != ECANCELED)
 		{
-			fprintf(stderr, "fifo_dequeue() -- failed on pthread_mutex_unlock %d\n", ret);
-			return ret;
+			fprintf(stderr, "fifo_enqueue() -- failed to enqueue event %d\n", ret);
 		}
+	}
+
+	return ret;
+}
+
+int fifo_dequeue(struct fmdriverif_state *driver_state, struct fmdriver_event *evt)
+{
+	struct fmdriver_event *head_evt;
+	int ret;
 
-		// Increment the semaphore because we've freed a slot
-		ret = sem_post(&(driver_state->event_fifo_slots));
+	// Take the event from the head, if there is one. If there isn't, arm the fifo so the
+	// next event posted wakes us up
+	ret = eventring_dequeue(&(driver_state->event_fifo), (void **)&head_evt);
+	if (ret != 0)
+	{
+		if (ret == EAGAIN && !fifo_arm(driver_state))
+		{
+			// An event slipped in while we were arming
+			ret = eventring_dequeue(&(driver_state->event_fifo), (void **)&head_evt);
+		}
 		if (ret != 0)
 		{
-			perror("fifo_dequeue() -- failed on sem_post");
-			return errno;
+			return ret;
 		}
 	}
 
+	// Copy the event out to the caller, payload and all, then recycle the slot. The free
+	// list has room for every slot in the pool, so this never blocks
+	*evt = *head_evt;
+	ret = eventring_enqueue(&(driver_state->event_pool_free), head_evt);
+
+	// On a coalescing fifo the event was only a marker for its kind
+	if (driver_state->latest != NULL)
+	{
+		fifo_read_latest(driver_state, evt);
+	}
+
 	return ret;
 }
 
+int fifo_dequeue_batch(struct fmdriverif_state *driver_state, struct fmdriver_event *events, int max_events)
+{
+	int count = 0;
+
+	while (count < max_events && fifo_dequeue(driver_state, &(events[count])) == 0)
+	{
+		count++;
+	}
+
+	return count;
+}
+
 int fifo_clear(struct fmdriverif_state *driver_state)
 {
-	int ret, free_slots, filled_slots;	
+	struct fmdriver_event *evt;
+	int ret;
 
-	ret = sem_getvalue(&(driver_state->event_fifo_slots), &free_slots);
-	if (ret != 0)
+	// Prevent further enqueueing and release a producer blocked on a full fifo
+	ret = eventring_close(&(driver_state->event_fifo));
+
+	// Step through the fifo, returning the enqueued items to the pool
+	while (eventring_dequeue(&(driver_state->event_fifo), (void **)&evt) == 0)
 	{
-		perror("fifo_clear() -- failed on sem_getvalue()");
-		return errno;
+		eventring_enqueue(&(driver_state->event_pool_free), evt);
 	}
 
-	if (free_slots < 0)
+	return ret;
+}
+
+bool fifo_arm(struct fmdriverif_state *driver_state)
+{
+	uint64_t count;
+
+	// On a pollable interface, reset the eventfd so the client's poll stops reporting
+	// the fd readable. This has to happen before arming: the driver side only writes
+	// once it has seen the armed flag, so a write can never be lost to this read
+	if (driver_state->notify_fd >= 0)
 	{
-		filled_slots = EVENT_FIFO_CAPACITY;
+		if (read(driver_state->notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		{
+			perror("fifo_arm() -- failed to reset event fd");
+		}
 	}
-	else
+
+	// Pairs with the fence in fifo_notify -- either the driver side sees the armed flag,
+	// or we see its event when we look at the fifo again
+	atomic_store_explicit(&(driver_state->consumer_armed), true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return eventring_count(&(driver_state->event_fifo)) == 0;
+}
+
+int fifo_notify(struct fmdriverif_state *driver_state)
+{
+	int ret;
+
+	// Nothing to do unless the client has drained the fifo since the last wakeup
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(&(driver_state->consumer_armed), memory_order_relaxed) ||
+	    !atomic_exchange_explicit(&(driver_state->consumer_armed), false, memory_order_relaxed))
 	{
-		filled_slots = EVENT_FIFO_CAPACITY - free_slots;
+		return 0;
 	}
 
-	if (filled_slots > 0)
+	atomic_fetch_add_explicit(&(driver_state->notifications), 1, memory_order_relaxed);
+
+	// Wake a client blocked in fmdriverif_read_events
+	ret = pthread_mutex_lock(&(driver_state->wait_mutex));
+	if (ret != 0)
 	{
-		ret = pthread_mutex_lock(&(driver_state->event_fifo_mutex));
-		if (ret != 0)
-		{
-			fprintf(stderr, "fifo_clear() -- failed on pthread_mutex_lock %d\n", ret);
-			return ret;
-		}	
-					
-		// Set clear flag to prevent further enqueueing
-		driver_state->fifo_clear = true;
+		fprintf(stderr, "fifo_notify() -- failed on pthread_mutex_lock %d\n", ret);
+		return ret;
+	}
+	pthread_cond_broadcast(&(driver_state->wait_cond));
+	pthread_mutex_unlock(&(driver_state->wait_mutex));
 
-		// Step through the fifo, freeing the enqueued items
-		while (filled_slots > 0)
-		{
-			// We free any event slots that are not NULL			
-			if (driver_state->event_fifo[driver_state->event_fifo_head] != NULL)
-			{
-				struct fmdriver_event *evt = driver_state->event_fifo[driver_state->event_fifo_head];
-				free(evt);
-				driver_state->event_fifo[driver_state->event_fifo_head] = NULL;
-			}
-			driver_state->event_fifo_head = (driver_state->event_fifo_head + 1) % EVENT_FIFO_CAPACITY;
-			filled_slots--;
-		}			
-		
-		// Done, unlock
-		ret = pthread_mutex_unlock(&(driver_state->event_fifo_mutex));
-		if (ret != 0)
+	// Make a pollable interface's eventfd readable
+	if (driver_state->notify_fd >= 0)
+	{
+		uint64_t count = 1;
+
+		if (write(driver_state->notify_fd, &count, sizeof(count)) < 0)
 		{
-			fprintf(stderr, "fifo_clear() -- failed on pthread_mutex_unlock %d\n", ret);
-			return ret;
+			perror("fifo_notify() -- failed to write event fd");
 		}
+	}
+
+	// A managed tuner wakes the manager's client instead
+	if (driver_state->manager != NULL)
+	{
+		manager_notify(driver_state->manager);
+	}
 
-		// And post to the semaphore to release the blocked enqueue thread
-		ret = sem_post(&(driver_state->event_fifo_slots));
+	// And let the client know there are events waiting
+	if (driver_state->cond != NULL)
+	{
+		ret = pthread_cond_signal(driver_state->cond);
 		if (ret != 0)
 		{
-			perror("fifo_clear() -- failed to post to fifo_semaphore");
-			return errno;
+			fprintf(stderr, "fifo_notify() -- failed on pthread_cond_signal %d\n", ret);
 		}
-	}	
-		
+	}
+
 	return ret;
 }
 
-int fmdriverif_open(int tuner_id, pthread_cond_t *callback_cond, unsigned long *if_handle_ptr)
+// Posts an event without waking the client. The driver side calls fifo_notify once it
+// has posted a whole batch
+int fifo_post_event(struct fmdriverif_state *driver_state, enum fmdriver_event_id event_id,
+		    int status_code, const void *data, int data_len)
 {
-	char radio_driver_path[64];
-	char radio_device_id[4];
-	int fd, ret;
+	struct fmdriver_event *evt;
 
-	// Set the interface handle pointer to 0 in case there is an error during open
-	*if_handle_ptr = 0;
-	
-	if (tuner_id < 0 || tuner_id > 9)
+	if (data_len < 0 || data_len > FMDRIVER_EVENT_DATA_MAX)
 		return EINVAL;
 
-	// Convert the tuner id to a string
-	sprintf(radio_device_id, "%d", tuner_id);
-
-	// Construct the driver path with tuner_id
-	strcpy(radio_driver_path, RADIO_DEVICE);
-	strcat(radio_driver_path, radio_device_id);
+	// Take a slot from the pool -- if there isn't one, the event is dropped and counted
+	evt = pool_alloc_event(driver_state);
+	if (evt == NULL)
+		return ENOBUFS;
 
-	// Attempt to open the FM tuner driver
-	fd = open(radio_driver_path, O_RDONLY);
-	if (fd < 0)
+	evt->event_id = event_id;
+	evt->status_code = status_code;
+	evt->data_len = data_len;
+	if (data_len > 0)
 	{
-		perror("fmdriverif_open() -- failed to open tuner driver");
-		return errno;
- 	}
+		memcpy(evt->event_data, data, data_len);
+	}
 
-	// Attempt to allocate a driver state struct
-	struct fmdriverif_state *driver_state = (struct fmdriverif_state *)malloc(sizeof(struct fmdriverif_state));
-	if (driver_state == NULL)
-	{		
-		perror("fmdriverif_open() -- failed to allocate driver state");
-		return ENOMEM;
+	// When coalescing, an event whose kind already has a marker in the fifo only needs
+	// to update the latest copy
+	if (driver_state->latest != NULL && fifo_coalesce(driver_state, evt))
+	{
+		driver_state->spare_event = evt;
+		return 0;
 	}
 
-	// Set the tuner driver fd
-	driver_state->tuner_fd = fd;
+	return fifo_enqueue(driver_state, evt);
+}
 
-	// Set the condition variable
-	driver_state->cond = callback_cond;
+int fifo_event_kind(const struct fmdriver_event *evt)
+{
+	const struct rds_data *field = (const struct rds_data *)evt->event_data;
 
-	// Init the FIFO mutex (use default attributes)
-	ret = pthread_mutex_init(&(driver_state->event_fifo_mutex), NULL);
-	if (ret != 0)
+	if (evt->event_id == FM_EVENT_RDS)
+		return FM_EVENT_RDS + field->field;
+
+	return evt->event_id;
+}
+
+bool fifo_coalesce(struct fmdriverif_state *driver_state, struct fmdriver_event *evt)
+{
+	struct event_latest *latest = &(driver_state->latest[fifo_event_kind(evt)]);
+	unsigned int seq = atomic_load_explicit(&(latest->seq), memory_order_relaxed);
+
+	// Only the worker writes here, so it can read the sequence without ordering
+	atomic_store_explicit(&(latest->seq), seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	latest->evt = *evt;
+	atomic_store_explicit(&(latest->seq), seq + 2, memory_order_release);
+
+	// If the client hasn't read the marker for this kind yet, it gets this event in
+	// place of the one the marker was posted for
+	if (atomic_exchange_explicit(&(latest->pending), true, memory_order_acq_rel))
 	{
-		fprintf(stderr, "fmdriverif_open() -- failed to initialize event mutex %d\n", ret);
-		return ret;
+		atomic_fetch_add_explicit(&(driver_state->events_dropped), 1, memory_order_relaxed);
+		return true;
 	}
 
-	// Init the FIFO semaphore
-	ret = sem_init(&(driver_state->event_fifo_slots), false, EVENT_FIFO_CAPACITY);
-	if (ret != 0)
+	return false;
+}
+
+void fifo_read_latest(struct fmdriverif_state *driver_state, struct fmdriver_event *evt)
+{
+	struct event_latest *latest = &(driver_state->latest[fifo_event_kind(evt)]);
+	unsigned int seq;
+
+	// Clear pending first, so anything posted from here on gets a marker of its own. At
+	// worst the client reads the same latest event twice
+	atomic_exchange_explicit(&(latest->pending), false, memory_order_acq_rel);
+
+	// The worker only holds the sequence odd for the length of a copy
+	do
 	{
-		perror("fmdriverif_open() -- failed to initialize FIFO semaphore");
-		return ret;
+		seq = atomic_load_explicit(&(latest->seq), memory_order_acquire);
+		*evt = latest->evt;
+		atomic_thread_fence(memory_order_acquire);
 	}
-	
-	// Initialize FIFO head and tail
-	driver_state->event_fifo_head = driver_state->event_fifo_tail = 0;
-	// Not clearing fifo
-	driver_state->fifo_clear = false;
+	while ((seq & 1) || atomic_load_explicit(&(latest->seq), memory_order_relaxed) != seq);
+}
 
-	// Zero out the FIFO slots
-	memset(driver_state->event_fifo, 0, (EVENT_FIFO_CAPACITY * sizeof(struct fmdriver_event)));
+uint64_t stats_now_ns(void)
+{
+	struct timespec now;
 
-	// Set the good magic number
-	driver_state->sig = IFSTATE_GOOD;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
 
-	// Cast the driver state pointer to an int and return to caller
-	*if_handle_ptr = (unsigned long)driver_state; 		
+void timespec_add_ms(struct timespec *ts, int ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
 
-	return 0;
+uint64_t timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
 }
 
-int fmdriverif_close(unsigned long if_handle)
-{	
-	struct fmdriverif_state *driver_state;
-	int ret;		
-	
-	if (if_handle == 0)
-		return EINVAL;
+void timespec_from_ns(struct timespec *ts, uint64_t ns)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
 
-	// Cast the handle to state pointer
-	driver_state = (struct fmdriverif_state *)if_handle;
+void latency_init(struct latency_stats *stats)
+{
+	int i;
 
-	// Check the sig
-	if (driver_state->sig != IFSTATE_GOOD)
-		return EINVAL;
+	atomic_init(&(stats->count), 0);
+	atomic_init(&(stats->total_us), 0);
+	atomic_init(&(stats->max_us), 0);
+	for (i = 0; i < FMDRIVER_LATENCY_BUCKETS; i++)
+	{
+		atomic_init(&(stats->hist[i]), 0);
+	}
+}
 
-	// Free any event structs that are sitting in the fifo
-	ret = fifo_clear(driver_state);
+void latency_record(struct latency_stats *stats, uint64_t elapsed_ns)
+{
+	unsigned long elapsed_us = elapsed_ns / 1000;
+	int bucket;
 
-	// Now the enqueue thread will not be waiting on the semaphore because
-	// the fifo has been cleared and the clear flag is set, preventing any new
-	// events from being enqueued. So we can safely destroy it.
-	ret = sem_destroy(&(driver_state->event_fifo_slots));
-	if (ret != 0)
+	// Bucket 0 is under 1us, bucket n is 2^(n-1)us up to 2^n
+	for (bucket = 0; bucket < FMDRIVER_LATENCY_BUCKETS - 1 && (elapsed_us >> bucket) != 0; bucket++)
+		;
+	atomic_fetch_add_explicit(&(stats->hist[bucket]), 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&(stats->count), 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&(stats->total_us), elapsed_us, memory_order_relaxed);
+
+	// There is only one writer, so the maximum needs no compare and swap
+	if (elapsed_us > atomic_load_explicit(&(stats->max_us), memory_order_relaxed))
 	{
-		perror("fmdriverif_close() -- failed on sem_destroy");
+		atomic_store_explicit(&(stats->max_us), elapsed_us, memory_order_relaxed);
 	}
+}
 
-	// Close the tuner driver handle
-	ret = close(driver_state->tuner_fd);
-	if (ret != 0)
+void latency_read(struct latency_stats *stats, struct fmdriver_latency *latency)
+{
+	int i;
+
+	latency->count = atomic_load_explicit(&(stats->count), memory_order_relaxed);
+	latency->total_us = atomic_load_explicit(&(stats->total_us), memory_order_relaxed);
+	latency->max_us = atomic_load_explicit(&(stats->max_us), memory_order_relaxed);
+	for (i = 0; i < FMDRIVER_LATENCY_BUCKETS; i++)
 	{
-		perror("fmdriverif_close() -- failed on close");
+		latency->hist[i] = atomic_load_explicit(&(stats->hist[i]), memory_order_relaxed);
 	}
+}
 
-	// Destroy the mutex
-	ret = pthread_mutex_destroy(&(driver_state->event_fifo_mutex));
-	if (ret != 0)
+int driver_ioctl(struct fmdriverif_state *driver_state, unsigned long request, void *arg)
+{
+	enum fmdriver_op op;
+	uint64_t start = stats_now_ns();
+	int ret, err;
+
+	ret = driver_state->backend->ioctl(driver_state, request, arg);
+	err = errno;
+
+	switch (request)
 	{
-		fprintf(stderr, "fmdriverif_close() -- failed on pthread_mutex_destroy %d\n", ret);
+	case VIDIOCSFREQ:
+		op = FMDRIVER_OP_SET_FREQ;
+		break;
+	case VIDIOCGFREQ:
+		op = FMDRIVER_OP_GET_FREQ;
+		break;
+	case VIDIOCGTUNER:
+		op = FMDRIVER_OP_GET_TUNER;
+		break;
+	case VIDIOCGAUDIO:
+		op = FMDRIVER_OP_GET_AUDIO;
+		break;
+	case VIDIOCSAUDIO:
+		op = FMDRIVER_OP_SET_AUDIO;
+		break;
+	default:
+		op = FMDRIVER_OP_OTHER;
+		break;
 	}
+	latency_record(&(driver_state->op_latency[op]), stats_now_ns() - start);
 
-	// Free the driver state
-	free(driver_state);		 	
+	errno = err;
+	return ret;
+}
 
+ssize_t driver_read_rds(struct fmdriverif_state *driver_state, unsigned char *records, size_t len)
+{
+	uint64_t start = stats_now_ns();
+	ssize_t ret;
+	int err;
+
+	ret = driver_state->backend->read_rds(driver_state, records, len);
+	err = errno;
+	latency_record(&(driver_state->op_latency[FMDRIVER_OP_READ_RDS]), stats_now_ns() - start);
+
+	errno = err;
 	return ret;
 }
 
-int fmdriverif_powerrequest(unsigned long if_handle, enum fmdriver_power_state req_state)
+int driver_seek(struct fmdriverif_state *driver_state, bool seek_up, unsigned long *freq_units)
 {
-	return 0;
+	uint64_t start = stats_now_ns();
+	int ret, err;
+
+	ret = driver_state->backend->seek(driver_state, seek_up, freq_units);
+	err = errno;
+	latency_record(&(driver_state->op_latency[FMDRIVER_OP_SEEK]), stats_now_ns() - start);
+
+	errno = err;
+	return ret;
 }
 
-int fmdriverif_tunerequest(unsigned long if_handle, int tune_freq)
+unsigned long khz_to_tuner_units(struct fmdriverif_state *driver_state, int freq_khz)
 {
-	return 0;
+	// The driver counts in 1/16 kHz steps if it reports VIDEO_TUNER_LOW, 1/16 MHz otherwise
+	if (driver_state->tuner_info.flags & VIDEO_TUNER_LOW)
+		return (unsigned long)freq_khz * 16;
+	else
+		return ((unsigned long)freq_khz * 16 + 500) / 1000;
 }
 
-int fmdriverif_seekrequest(unsigned long if_handle, bool seek_up)
+int tuner_units_to_khz(struct fmdriverif_state *driver_state, unsigned long freq_units)
 {
-	return 0;
+	if (driver_state->tuner_info.flags & VIDEO_TUNER_LOW)
+		return (int)(freq_units / 16);
+	else
+		return (int)((freq_units * 1000) / 16);
 }
 
-int fmdriverif_scanrequest(unsigned long if_handle, bool stop_scan)
+int request_tune(struct fmdriverif_state *driver_state, int freq_khz, struct fmdriver_tune_data *tune_data)
 {
-	return 0;
+	unsigned long freq_units;
+	int ret;
+
+	// Make sure the frequency is within the tuner's range
+	freq_units = khz_to_tuner_units(driver_state, freq_khz);
+	if (freq_units < driver_state->tuner_info.rangelow || freq_units > driver_state->tuner_info.rangehigh)
+		return ERANGE;
+
+	if (driver_ioctl(driver_state, VIDIOCSFREQ, &freq_units) < 0)
+	{
+		ret = errno;
+		perror("request_tune() -- ioctl VIDIOCSFREQ failed");
+		return ret;
+	}
+
+	return report_station(driver_state, freq_khz, tune_data);
 }
 
-int fmdriverif_volrequest(unsigned long if_handle, int vol_level)
+int request_seek(struct fmdriverif_state *driver_state, bool seek_up, struct fmdriver_tune_data *tune_data)
 {
+	// See fmseek.c
+	return seek_station(driver_state, seek_up, tune_data);
+}
+
+int report_station(struct fmdriverif_state *driver_state, int freq_khz, struct fmdriver_tune_data *tune_data)
+{
+	int ret;
+
+	driver_state->freq_khz = freq_khz;
+
+	// Anything the decoder has is for the old station
+	rdsdecoder_reset(&(driver_state->rds));
+
+	// Report the signal on the new station
+	if (driver_ioctl(driver_state, VIDIOCGTUNER, &(driver_state->tuner_info)) < 0)
+	{
+		ret = errno;
+		perror("report_station() -- ioctl VIDIOCGTUNER failed");
+		return ret;
+	}
+	rds_schedule_reset(driver_state);
+
+	report_tune_data(driver_state, freq_khz, tune_data);
+	snapshot_tuned(driver_state, tune_data);
+
 	return 0;
 }
 
-int fmdriverif_read_event(unsigned long if_handle, struct fmdriver_event *event)
+void report_tune_data(struct fmdriverif_state *driver_state, int freq_khz, struct fmdriver_tune_data *tune_data)
+{
+	// From the tuner as last queried, so a tune and a re-plug describe a station alike
+	tune_data->freq = freq_khz;
+	tune_data->signal = driver_state->tuner_info.signal;
+	tune_data->flags = 0;
+	if (driver_state->tuner_info.flags & VIDEO_TUNER_STEREO_ON)
+		tune_data->flags |= FMDRIVER_TUNER_STEREO;
+	if (driver_state->tuner_info.flags & VIDEO_TUNER_RDS_ON)
+		tune_data->flags |= FMDRIVER_TUNER_RDS;
+}
+
+int device_attach(struct fmdriverif_state *driver_state, bool restore)
 {
+	unsigned long freq_units;
+	int ret;
+
+	if (driver_state->backend->open(driver_state) < 0)
+	{
+		ret = errno;
+		perror("device_attach() -- failed to open tuner driver");
+		return ret;
+	}
+
+	// Get the tuner range, then either pick up the station and audio settings the tuner
+	// has, or after a re-plug, give it back ours. The I/O worker keeps these up to date
+	// from here on
+	driver_state->tuner_info.tuner = 0;
+	if (driver_ioctl(driver_state, VIDIOCGTUNER, &(driver_state->tuner_info)) < 0)
+	{
+		ret = errno;
+		perror("device_attach() -- failed to query tuner driver");
+		driver_state->backend->close(driver_state);
+		return ret;
+	}
+
+	if (restore)
+	{
+		freq_units = khz_to_tuner_units(driver_state, driver_state->freq_khz);
+		if ((driver_state->freq_khz > 0 && driver_ioctl(driver_state, VIDIOCSFREQ, &freq_units) < 0) ||
+		    driver_ioctl(driver_state, VIDIOCSAUDIO, &(driver_state->aud_info)) < 0)
+		{
+			ret = errno;
+			perror("device_attach() -- failed to restore tuner settings");
+			driver_state->backend->close(driver_state);
+			return ret;
+		}
+	}
+	else
+	{
+		if (driver_ioctl(driver_state, VIDIOCGAUDIO, &(driver_state->aud_info)) < 0)
+		{
+			ret = errno;
+			perror("device_attach() -- failed to query tuner audio");
+			driver_state->backend->close(driver_state);
+			return ret;
+		}
+		driver_state->power_state = (driver_state->aud_info.flags & VIDEO_AUDIO_MUTE) ? FM_POWER_OFF : FM_POWER_ON;
+
+		// Pick up the station the tuner is already on, so RDS starts without a tune request
+		if (driver_ioctl(driver_state, VIDIOCGFREQ, &freq_units) == 0)
+		{
+			driver_state->freq_khz = tuner_units_to_khz(driver_state, freq_units);
+		}
+	}
+	// Other threads read the range and maps without a lock once range_known is set, so they
+	// are only written before then
+	if (!atomic_load_explicit(&(driver_state->range_known), memory_order_relaxed))
+	{
+		driver_state->range_low_khz = tuner_units_to_khz(driver_state, driver_state->tuner_info.rangelow);
+		driver_state->range_high_khz = tuner_units_to_khz(driver_state, driver_state->tuner_info.rangehigh);
+		region_maps_build(driver_state);
+		atomic_store_explicit(&(driver_state->range_known), true, memory_order_release);
+	}
+
+	atomic_store_explicit(&(driver_state->device_up), true, memory_order_release);
+	return 0;
+}
+
+void device_detach(struct fmdriverif_state *driver_state, int reason)
+{
+	int power_state = FM_POWER_OFF;
+
+	if (!atomic_load_explicit(&(driver_state->device_up), memory_order_relaxed))
+		return;
+
+	// Whatever the decoder had half built came from the old device
+	driver_state->backend->close(driver_state);
+	atomic_store_explicit(&(driver_state->device_up), false, memory_order_release);
+	rdsdecoder_reset(&(driver_state->rds));
+
+	if (driver_state->async)
+	{
+		fifo_post_event(driver_state, FM_EVENT_POWER, reason, &power_state, sizeof(int));
+		fifo_notify(driver_state);
+	}
+}
+
+void device_request(struct fmdriverif_state *driver_state, int device)
+{
+	int status;
+
+	if (device == DEVICE_DETACH)
+	{
+		device_detach(driver_state, ENODEV);
+		return;
+	}
+
+	// Node events also come for a device we already have, e.g. when udev sets its
+	// permissions. The range is only known once the device has been up, and after that
+	// the settings to put back on it are ours
+	if (atomic_load_explicit(&(driver_state->device_up), memory_order_relaxed))
+		return;
+	status = device_attach(driver_state, driver_state->range_high_khz != 0);
+
+	if (status == 0)
+	{
+		device_attached(driver_state);
+	}
+
+	// A node can show up before it is ready to open, so failed re-plugs wait quietly for
+	// the next node event
+	if (driver_state->async && (status == 0 || device == DEVICE_OPEN))
+	{
+		fifo_post_event(driver_state, FM_EVENT_POWER, status,
+				(status == 0) ? (void *)&(driver_state->power_state) : NULL,
+				(status == 0) ? sizeof(int) : 0);
+		fifo_notify(driver_state);
+	}
+}
+
+void device_attached(struct fmdriverif_state *driver_state)
+{
+	struct fmdriver_snapshot *snapshot;
+	struct fmdriver_tune_data tune_data;
+
+	// Readers see the station and volume the device came up with
+	rds_schedule_reset(driver_state);
+	report_tune_data(driver_state, driver_state->freq_khz, &tune_data);
+	snapshot_tuned(driver_state, &tune_data);
+	snapshot = snapshot_begin(driver_state);
+	snapshot->volume = (driver_state->aud_info.volume * 100) / 65535;
+	snapshot_publish(driver_state);
+}
+
+int request_volume(struct fmdriverif_state *driver_state, int vol_level)
+{
+	unsigned short old_volume = driver_state->aud_info.volume;
+	int ret;
+
+	if (vol_level < 0 || vol_level > 100)
+		return EINVAL;
+
+	// Scale 0-100 to the driver's 16 bit volume
+	driver_state->aud_info.volume = (vol_level * 65535) / 100;
+	if (driver_ioctl(driver_state, VIDIOCSAUDIO, &(driver_state->aud_info)) < 0)
+	{
+		ret = errno;
+		perror("request_volume() -- ioctl VIDIOCSAUDIO failed");
+		driver_state->aud_info.volume = old_volume;
+		return ret;
+	}
+
+	snapshot_begin(driver_state)->volume = vol_level;
+	snapshot_publish(driver_state);
+
+	return 0;
+}
+
+int request_power(struct fmdriverif_state *driver_state, enum fmdriver_power_state req_state)
+{
+	int ret;
+
+	// Down after a failed reboot, or unplugged. Hot-plug only brings back a node that went
+	// away, so powering on or rebooting tries the device again. Reopened, it already has
+	// everything a reboot would put back
+	if (!atomic_load_explicit(&(driver_state->device_up), memory_order_relaxed))
+	{
+		if (req_state != FM_POWER_ON && req_state != FM_POWER_REBOOT)
+			return ENODEV;
+		ret = device_attach(driver_state, driver_state->range_high_khz != 0);
+		if (ret != 0)
+			return ret;
+		device_attached(driver_state);
+		if (req_state == FM_POWER_REBOOT)
+			req_state = driver_state->power_state;
+	}
+
+	switch (req_state)
+	{
+	case FM_POWER_OFF:
+	case FM_POWER_SLEEP:
+		// The V4L radio interface has no power control, so off and sleep mute the audio
+		driver_state->aud_info.flags |= VIDEO_AUDIO_MUTE;
+		break;
+
+	case FM_POWER_ON:
+	case FM_POWER_WAKE:
+		// RDS polling stops while asleep, so pick it up again as if we had just tuned
+		driver_state->aud_info.flags &= ~VIDEO_AUDIO_MUTE;
+		rds_schedule_reset(driver_state);
+		break;
+
+	case FM_POWER_REBOOT:
+		// Reopen the device, which resets the driver's view of the tuner, then put
+		// back the station and audio settings we had
+		driver_state->backend->close(driver_state);
+		if (driver_state->backend->open(driver_state) < 0)
+		{
+			// Down, and the client told so, until a power on or reboot gets it back
+			ret = errno;
+			perror("request_power() -- failed to reopen tuner driver");
+			device_detach(driver_state, ret);
+			return ret;
+		}
+		rdsdecoder_reset(&(driver_state->rds));
+
+		if (driver_state->freq_khz > 0)
+		{
+			unsigned long freq_units = khz_to_tuner_units(driver_state, driver_state->freq_khz);
+
+			if (driver_ioctl(driver_state, VIDIOCSFREQ, &freq_units) < 0)
+			{
+				ret = errno;
+				perror("request_power() -- ioctl VIDIOCSFREQ failed");
+				return ret;
+			}
+		}
+		// Restore the power state we had before the reboot
+		req_state = driver_state->power_state;
+		break;
+
+	default:
+		return EINVAL;
+	}
+
+	if (driver_ioctl(driver_state, VIDIOCSAUDIO, &(driver_state->aud_info)) < 0)
+	{
+		ret = errno;
+		perror("request_power() -- ioctl VIDIOCSAUDIO failed");
+		return ret;
+	}
+	driver_state->power_state = req_state;
+
+	return 0;
+}
+
+int execute_request(struct fmdriverif_state *driver_state, struct fmdriver_request *req,
+		    void *data, int *data_len)
+{
+	int ret;
+
+	*data_len = 0;
+
+	// Nothing to talk to while the tuner is unplugged -- but see request_power
+	if (!atomic_load_explicit(&(driver_state->device_up), memory_order_relaxed) && req->type != FM_EVENT_POWER)
+		return ENODEV;
+
+	switch (req->type)
+	{
+	case FM_EVENT_TUNE:
+		ret = request_tune(driver_state, req->arg, (struct fmdriver_tune_data *)data);
+		if (ret == 0)
+			*data_len = sizeof(struct fmdriver_tune_data);
+		break;
+
+	case FM_EVENT_VOL:
+		ret = request_volume(driver_state, req->arg);
+		// The level in effect, which is still the old one if the driver turned it down
+		*(int *)data = driver_state->snapshots[atomic_load_explicit(&(driver_state->snapshot_seq),
+									    memory_order_relaxed) & 1].volume;
+		*data_len = sizeof(int);
+		break;
+
+	case FM_EVENT_POWER:
+		ret = request_power(driver_state, (enum fmdriver_power_state)req->arg);
+		*(int *)data = driver_state->power_state;
+		*data_len = sizeof(int);
+		break;
+
+	case FM_EVENT_SCAN:
+		ret = scan_band(driver_state, (struct fmdriver_scan_data *)data);
+		if (ret == 0)
+			*data_len = sizeof(struct fmdriver_scan_data);
+		break;
+
+	case FM_EVENT_SEEK:
+		ret = request_seek(driver_state, req->arg, (struct fmdriver_tune_data *)data);
+		if (ret == 0)
+			*data_len = sizeof(struct fmdriver_tune_data);
+		break;
+
+	default:
+		ret = ENOSYS;
+		break;
+	}
+
+	// Once the client has a station playing, the tuner is theirs until they power it off
+	if (ret == 0 && (req->type == FM_EVENT_TUNE || req->type == FM_EVENT_SEEK))
+		driver_state->client_active = true;
+	else if (ret == 0 && req->type == FM_EVENT_POWER && req->arg != FM_POWER_REBOOT)
+		driver_state->client_active = (driver_state->power_state == FM_POWER_ON ||
+					       driver_state->power_state == FM_POWER_WAKE);
+
+	return ret;
+}
+
+bool rds_active(struct fmdriverif_state *driver_state)
+{
+	// Only worth reading while a station is playing, and only if the client can be told.
+	// A synchronous client never reads events, so RDS would just fill the fifo
+	return driver_state->async && driver_state->freq_khz > 0 &&
+	       atomic_load_explicit(&(driver_state->device_up), memory_order_relaxed) &&
+	       (driver_state->power_state == FM_POWER_ON || driver_state->power_state == FM_POWER_WAKE);
+}
+
+struct fmdriver_snapshot *snapshot_begin(struct fmdriverif_state *driver_state)
+{
+	// Only the worker writes snapshots, so it can read the sequence without ordering
+	unsigned int seq = atomic_load_explicit(&(driver_state->snapshot_seq), memory_order_relaxed);
+	struct fmdriver_snapshot *next = &(driver_state->snapshots[(seq + 1) & 1]);
+
+	// A reader may still be copying the buffer we are about to overwrite. The fence keeps
+	// our writes behind the last publish, so that reader is sure to see it and retry
+	atomic_thread_fence(memory_order_release);
+	*next = driver_state->snapshots[seq & 1];
+
+	return next;
+}
+
+void snapshot_publish(struct fmdriverif_state *driver_state)
+{
+	unsigned int seq = atomic_load_explicit(&(driver_state->snapshot_seq), memory_order_relaxed);
+
+	driver_state->snapshots[(seq + 1) & 1].generation++;
+	atomic_store_explicit(&(driver_state->snapshot_seq), seq + 1, memory_order_release);
+}
+
+void snapshot_tuned(struct fmdriverif_state *driver_state, struct fmdriver_tune_data *tune_data)
+{
+	struct fmdriver_snapshot *snapshot = snapshot_begin(driver_state);
+	unsigned int generation = snapshot->generation;
+	int volume = snapshot->volume;
+
+	// New station, so everything RDS told us about the old one goes
+	memset(snapshot, 0, sizeof(struct fmdriver_snapshot));
+	snapshot->generation = generation;
+	snapshot->volume = volume;
+	snapshot->freq = tune_data->freq;
+	snapshot->signal = tune_data->signal;
+	snapshot->flags = tune_data->flags;
+	snapshot_publish(driver_state);
+}
+
+void rds_emit_event(void *context, const struct rds_data *field)
+{
+	struct fmdriverif_state *driver_state = (struct fmdriverif_state *)context;
+	struct fmdriver_snapshot *snapshot;
+	char text[RDS_DATA_MAX + 1];
+	unsigned int valid_bit;
+	bool changed;
+	int len;
+
+	len = (field->data_length < RDS_DATA_MAX) ? field->data_length : RDS_DATA_MAX;
+	memcpy(text, field->data, len);
+	text[len] = '\0';
+
+	// Compare against what readers already have, and only publish and post real changes
+	snapshot = snapshot_begin(driver_state);
+	switch (field->field)
+	{
+	case RDS_FIELD_PI:
+		valid_bit = FMDRIVER_RDS_PI;
+		changed = (len >= 2 && snapshot->pi != ((field->data[0] << 8) | field->data[1]));
+		snapshot->pi = (len >= 2) ? (field->data[0] << 8) | field->data[1] : 0;
+		break;
+
+	case RDS_FIELD_PTY:
+		valid_bit = FMDRIVER_RDS_PTY;
+		changed = (len >= 1 && snapshot->pty != field->data[0]);
+		snapshot->pty = (len >= 1) ? field->data[0] : 0;
+		break;
+
+	case RDS_FIELD_PS:
+		valid_bit = FMDRIVER_RDS_PS;
+		text[(len < sizeof(snapshot->ps)) ? len : sizeof(snapshot->ps) - 1] = '\0';
+		changed = (strcmp(snapshot->ps, text) != 0);
+		strcpy(snapshot->ps, text);
+		break;
+
+	case RDS_FIELD_PTYN:
+		valid_bit = FMDRIVER_RDS_PTYN;
+		text[(len < sizeof(snapshot->ptyn)) ? len : sizeof(snapshot->ptyn) - 1] = '\0';
+		changed = (strcmp(snapshot->ptyn, text) != 0);
+		strcpy(snapshot->ptyn, text);
+		break;
+
+	case RDS_FIELD_RT:
+		valid_bit = FMDRIVER_RDS_RT;
+		changed = (strcmp(snapshot->rt, text) != 0);
+		strcpy(snapshot->rt, text);
+		break;
+
+	case RDS_FIELD_AF:
+		// Kept for retuning when the signal drops, see fmaf.c. Nothing for the client
+		af_update(driver_state, field);
+		return;
+
+	default:
+		return;
+	}
+	if (!(snapshot->rds_valid & valid_bit))
+	{
+		changed = true;
+	}
+	if (!changed)
+		return;
+
+	snapshot->rds_valid |= valid_bit;
+	snapshot_publish(driver_state);
+
+	// RDS repeats itself and the snapshot has the field, so if the client has fallen
+	// behind, drop the event rather than block the worker on a full fifo. The other
+	// overflow policies never block
+	if (driver_state->overflow == FMDRIVER_OVERFLOW_BLOCK &&
+	    eventring_count(&(driver_state->event_fifo)) >= driver_state->event_fifo.capacity)
+	{
+		atomic_fetch_add_explicit(&(driver_state->events_dropped), 1, memory_order_relaxed);
+		return;
+	}
+
+	fifo_post_event(driver_state, FM_EVENT_RDS, 0, field, sizeof(struct rds_data));
+}
+
+void rds_schedule_reset(struct fmdriverif_state *driver_state)
+{
+	// Poll hard for a station that says it has RDS. One that doesn't starts at the
+	// normal rate and backs off from there
+	if (driver_state->tuner_info.flags & VIDEO_TUNER_RDS_ON)
+	{
+		driver_state->rds_fast_polls = RDS_POLL_FAST_POLLS;
+		atomic_store_explicit(&(driver_state->rds_poll_ms), RDS_POLL_FAST_MS, memory_order_relaxed);
+	}
+	else
+	{
+		driver_state->rds_fast_polls = 0;
+		atomic_store_explicit(&(driver_state->rds_poll_ms), RDS_POLL_MS, memory_order_relaxed);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &(driver_state->rds_next_poll));
+	timespec_add_ms(&(driver_state->rds_next_poll), atomic_load_explicit(&(driver_state->rds_poll_ms), memory_order_relaxed));
+}
+
+void rds_schedule(struct fmdriverif_state *driver_state, unsigned long blocks, unsigned long blocks_bad)
+{
+	int poll_ms = atomic_load_explicit(&(driver_state->rds_poll_ms), memory_order_relaxed);
+
+	// A fixed-rate poller would have read this many times over the same stretch -- the
+	// difference is what fmdriverif_get_stats reports as saved
+	atomic_fetch_add_explicit(&(driver_state->rds_polls), 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&(driver_state->rds_polled_ms), poll_ms, memory_order_relaxed);
+
+	if (driver_state->rds_fast_polls > 0)
+	{
+		driver_state->rds_fast_polls--;
+		poll_ms = (driver_state->rds_fast_polls > 0) ? RDS_POLL_FAST_MS : RDS_POLL_MS;
+	}
+	else if (blocks == 0 || blocks_bad * 100 > blocks * RDS_POLL_BAD_PCT)
+	{
+		// Nothing to decode -- back off
+		poll_ms = (poll_ms * 2 > RDS_POLL_MAX_MS) ? RDS_POLL_MAX_MS : poll_ms * 2;
+	}
+	else
+	{
+		// Locked on -- straight back to the normal rate
+		poll_ms = RDS_POLL_MS;
+	}
+
+	// A station with alternatives has its signal watched on each poll
+	if (poll_ms > AF_CHECK_MS && af_current(driver_state) != NULL)
+	{
+		poll_ms = AF_CHECK_MS;
+	}
+	atomic_store_explicit(&(driver_state->rds_poll_ms), poll_ms, memory_order_relaxed);
+}
+
+int rds_discard(struct fmdriverif_state *driver_state)
+{
+	unsigned char records[RDS_READ_RECORDS * RDS_RECORD_SIZE];
+	ssize_t len;
+
+	// After a retune, read the driver's buffer empty -- it is still from the old frequency
+	while ((len = driver_read_rds(driver_state, records, sizeof(records))) > 0)
+		;
+
+	return (len < 0 && errno != EAGAIN) ? errno : 0;
+}
+
+int rds_poll(struct fmdriverif_state *driver_state)
+{
+	unsigned char records[RDS_READ_RECORDS * RDS_RECORD_SIZE];
+	unsigned long blocks, blocks_bad, groups;
+	ssize_t len;
+	int ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &(driver_state->rds_next_poll));
+	blocks = driver_state->rds.blocks;
+	blocks_bad = driver_state->rds.blocks_bad;
+	groups = driver_state->rds.groups;
+
+	// Take whatever the driver has buffered without ever blocking the worker on it
+	for (;;)
+	{
+		len = driver_read_rds(driver_state, records, sizeof(records));
+		if (len <= 0)
+		{
+			if (len < 0 && errno != EAGAIN)
+				ret = errno;
+			break;
+		}
+		rdsdecoder_push_records(&(driver_state->rds), records, len / RDS_RECORD_SIZE);
+		if (len < sizeof(records))
+			break;
+	}
+
+	// Telemetry counts the station as locked while groups keep coming
+	if (driver_state->rds.groups != groups)
+	{
+		driver_state->rds_last_group_ns = timespec_ns(&(driver_state->rds_next_poll));
+	}
+
+	// Pick the next poll from how this one went
+	rds_schedule(driver_state, driver_state->rds.blocks - blocks, driver_state->rds.blocks_bad - blocks_bad);
+	timespec_add_ms(&(driver_state->rds_next_poll), atomic_load_explicit(&(driver_state->rds_poll_ms), memory_order_relaxed));
+
+	// Move to an alternative frequency if this one is fading
+	if (ret == 0)
+	{
+		af_monitor(driver_state);
+	}
+
+	// Decoder statistics for fmdriverif_get_stats
+	atomic_store_explicit(&(driver_state->rds_blocks), driver_state->rds.blocks, memory_order_relaxed);
+	atomic_store_explicit(&(driver_state->rds_blocks_corrected), driver_state->rds.blocks_corrected, memory_order_relaxed);
+	atomic_store_explicit(&(driver_state->rds_blocks_bad), driver_state->rds.blocks_bad, memory_order_relaxed);
+	atomic_store_explicit(&(driver_state->rds_groups), driver_state->rds.groups, memory_order_relaxed);
+
+	// One wakeup for everything decoded
+	fifo_notify(driver_state);
+
+	// The device went away under us -- hot-plug puts it back when it returns
+	if (ret == ENODEV)
+	{
+		device_detach(driver_state, ret);
+	}
+
+	return ret;
+}
+
+uint64_t io_timer_due(struct fmdriverif_state *driver_state)
+{
+	uint64_t due_ns = 0, telemetry_ns;
+
+	// The sooner of the next RDS poll and the next telemetry sample, 0 if neither is running
+	if (rds_active(driver_state))
+	{
+		due_ns = timespec_ns(&(driver_state->rds_next_poll));
+	}
+	if (telemetry_active(driver_state))
+	{
+		telemetry_ns = telemetry_due_ns(driver_state);
+		if (due_ns == 0 || telemetry_ns < due_ns)
+			due_ns = telemetry_ns;
+	}
+
+	return due_ns;
+}
+
+void io_timer_run(struct fmdriverif_state *driver_state)
+{
+	uint64_t now_ns = stats_now_ns();
+
+	// Whichever of the two has come due
+	if (rds_active(driver_state) && now_ns >= timespec_ns(&(driver_state->rds_next_poll)))
+	{
+		rds_poll(driver_state);
+	}
+	if (telemetry_active(driver_state) && now_ns >= telemetry_due_ns(driver_state))
+	{
+		telemetry_sample(driver_state);
+	}
+}
+
+void *io_worker(void *arg)
+{
+	struct fmdriverif_state *driver_state = (struct fmdriverif_state *)arg;
+	struct timespec due;
+	uint64_t due_ns;
+
+	pthread_mutex_lock(&(driver_state->request_mutex));
+	while (!driver_state->io_shutdown)
+	{
+		if (driver_state->request_count == 0)
+		{
+			// Between requests, read RDS and sample telemetry while a station is playing
+			due_ns = io_timer_due(driver_state);
+			if (due_ns == 0)
+			{
+				pthread_cond_wait(&(driver_state->request_cond), &(driver_state->request_mutex));
+				continue;
+			}
+			timespec_from_ns(&due, due_ns);
+			if (pthread_cond_timedwait(&(driver_state->request_cond), &(driver_state->request_mutex),
+						   &due) == ETIMEDOUT)
+			{
+				pthread_mutex_unlock(&(driver_state->request_mutex));
+				io_timer_run(driver_state);
+				pthread_mutex_lock(&(driver_state->request_mutex));
+			}
+			continue;
+		}
+
+		io_run_request(driver_state);
+		io_update_lendable(driver_state);
+	}
+
+	io_cancel_requests(driver_state);
+	pthread_mutex_unlock(&(driver_state->request_mutex));
+
+	return NULL;
+}
+
+void io_run_request(struct fmdriverif_state *driver_state)
+{
+	unsigned char data[FMDRIVER_EVENT_DATA_MAX];
+	struct fmdriver_request req;
+	int status, data_len;
+
+	// Take the oldest request and run it without holding the queue lock, so callers
+	// can keep submitting while the driver is busy
+	req = driver_state->request_queue[driver_state->request_head];
+	driver_state->request_head = (driver_state->request_head + 1) % REQUEST_QUEUE_CAPACITY;
+	driver_state->request_count--;
+	pthread_mutex_unlock(&(driver_state->request_mutex));
+
+	// Share of another interface's scan or seek -- nothing to report to our own client
+	if (req.job != NULL)
+	{
+		scan_helper(driver_state, req.job);
+		pthread_mutex_lock(&(driver_state->request_mutex));
+		return;
+	}
+	if (req.prefetch != NULL)
+	{
+		seek_helper(driver_state, req.prefetch);
+		pthread_mutex_lock(&(driver_state->request_mutex));
+		return;
+	}
+
+	// Device opened or lost -- reported with FM_EVENT_POWER
+	if (req.device != 0)
+	{
+		device_request(driver_state, req.device);
+		pthread_mutex_lock(&(driver_state->request_mutex));
+		return;
+	}
+
+	// Complete the requests this one superseded before running it
+	while (req.superseded > 0)
+	{
+		fifo_post_event(driver_state, req.type, FMDRIVER_STATUS_SUPERSEDED, NULL, 0);
+		req.superseded--;
+	}
+
+	status = execute_request(driver_state, &req, data, &data_len);
+	if (status == ENODEV)
+	{
+		device_detach(driver_state, status);
+	}
+
+	if (req.waiter != NULL)
+	{
+		// Synchronous caller is waiting on the result
+		pthread_mutex_lock(&(driver_state->request_mutex));
+		req.waiter->status = status;
+		req.waiter->done = true;
+		pthread_cond_broadcast(&(driver_state->complete_cond));
+	}
+	else
+	{
+		// Post the completion -- done outside the lock since a full FIFO blocks us
+		fifo_post_event(driver_state, req.type, status, data, data_len);
+		fifo_notify(driver_state);
+		pthread_mutex_lock(&(driver_state->request_mutex));
+	}
+}
+
+void io_cancel_requests(struct fmdriverif_state *driver_state)
+{
+	struct fmdriver_request req;
+
+	// Shutting down -- fail anything still queued
+	while (driver_state->request_count > 0)
+	{
+		req = driver_state->request_queue[driver_state->request_head];
+		driver_state->request_head = (driver_state->request_head + 1) % REQUEST_QUEUE_CAPACITY;
+		driver_state->request_count--;
+		if (req.waiter != NULL)
+		{
+			req.waiter->status = ECANCELED;
+			req.waiter->done = true;
+		}
+		if (req.job != NULL)
+		{
+			scan_job_release(req.job);
+		}
+		if (req.prefetch != NULL)
+		{
+			seek_job_release(req.prefetch);
+		}
+	}
+	pthread_cond_broadcast(&(driver_state->complete_cond));
+}
+
+void io_wake(struct fmdriverif_state *driver_state)
+{
+	// A managed tuner has no worker of its own -- it gets a turn on the manager's pool
+	if (driver_state->manager != NULL)
+	{
+		manager_schedule(driver_state->manager, driver_state);
+	}
+	else
+	{
+		pthread_cond_signal(&(driver_state->request_cond));
+	}
+}
+
+void io_update_lendable(struct fmdriverif_state *driver_state)
+{
+	// Called on the worker between requests. A tuner left on a station by whoever had it
+	// before can be lent; one the client is listening to can't. Recruiting clears this, so
+	// a tuner is only ever lent to one interface at a time
+	atomic_store_explicit(&(driver_state->lendable),
+			      atomic_load_explicit(&(driver_state->device_up), memory_order_relaxed) &&
+			      !driver_state->client_active, memory_order_relaxed);
+}
+
+bool io_interrupted(struct fmdriverif_state *driver_state)
+{
+	bool waiting;
+
+	// For long jobs on the worker that aren't the client's own -- an AF search, or a share
+	// of another interface's scan or seek. A request from the client, or closing, comes first
+	pthread_mutex_lock(&(driver_state->request_mutex));
+	waiting = (driver_state->request_count > 0 || driver_state->io_shutdown);
+	pthread_mutex_unlock(&(driver_state->request_mutex));
+
+	return waiting;
+}
+
+struct fmdriver_request *find_coalescable(struct fmdriverif_state *driver_state, enum fmdriver_event_id type)
+{
+	struct fmdriver_request *req;
+	int i;
+
+	// Only the latest tune frequency and volume level matter, so a new one can replace one
+	// that hasn't run yet. Tune and volume don't affect each other, so look back past
+	// either of them, but stop at anything else so requests still run in a sensible order
+	if (type != FM_EVENT_TUNE && type != FM_EVENT_VOL)
+		return NULL;
+
+	for (i = driver_state->request_count - 1; i >= 0; i--)
+	{
+		req = &(driver_state->request_queue[(driver_state->request_head + i) % REQUEST_QUEUE_CAPACITY]);
+		if (req->type == type)
+			return req;
+		if (req->type != FM_EVENT_TUNE && req->type != FM_EVENT_VOL)
+			break;
+	}
+
+	return NULL;
+}
+
+int submit_device_request(struct fmdriverif_state *driver_state, int device)
+{
+	struct fmdriver_request *req;
+	int ret = 0;
+
+	pthread_mutex_lock(&(driver_state->request_mutex));
+	if (driver_state->io_shutdown)
+	{
+		ret = ECANCELED;
+	}
+	else if (driver_state->request_count == REQUEST_QUEUE_CAPACITY)
+	{
+		ret = EBUSY;
+	}
+	else
+	{
+		req = &(driver_state->request_queue[(driver_state->request_head + driver_state->request_count) % REQUEST_QUEUE_CAPACITY]);
+		memset(req, 0, sizeof(struct fmdriver_request));
+		req->type = FM_EVENT_POWER;
+		req->device = device;
+		driver_state->request_count++;
+		io_wake(driver_state);
+	}
+	pthread_mutex_unlock(&(driver_state->request_mutex));
+
+	return ret;
+}
+
+int submit_request(unsigned long if_handle, enum fmdriver_event_id type, int arg)
+{
+	struct fmdriverif_state *driver_state;
+	struct request_waiter waiter;
+	struct fmdriver_request *req;
+	int ret;
+
+	if (if_handle == 0)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	ret = pthread_mutex_lock(&(driver_state->request_mutex));
+	if (ret != 0)
+	{
+		fprintf(stderr, "submit_request() -- failed on pthread_mutex_lock %d\n", ret);
+		return ret;
+	}
+
+	// Collapse into a pending request of the same kind if there is one
+	req = (driver_state->io_shutdown) ? NULL : find_coalescable(driver_state, type);
+	if (req != NULL)
+	{
+		if (req->waiter != NULL)
+		{
+			// Release the synchronous caller that was waiting on the old request. Calls
+			// return an errno, so it gets ECANCELED rather than the event status
+			req->waiter->status = ECANCELED;
+			req->waiter->done = true;
+			pthread_cond_broadcast(&(driver_state->complete_cond));
+		}
+		else
+		{
+			req->superseded++;
+		}
+		atomic_fetch_add_explicit((type == FM_EVENT_TUNE) ? &(driver_state->tunes_coalesced) : &(driver_state->volumes_coalesced),
+					  1, memory_order_relaxed);
+	}
+
+	if (driver_state->io_shutdown)
+	{
+		ret = ECANCELED;
+	}
+	else if (req == NULL && driver_state->request_count == REQUEST_QUEUE_CAPACITY)
+	{
+		// Queue is bounded -- the caller is submitting faster than the driver can keep up
+		ret = EBUSY;
+	}
+	else
+	{
+		if (req == NULL)
+		{
+			req = &(driver_state->request_queue[(driver_state->request_head + driver_state->request_count) % REQUEST_QUEUE_CAPACITY]);
+			req->type = type;
+			req->superseded = 0;
+			req->job = NULL;
+			req->prefetch = NULL;
+			req->device = 0;
+			driver_state->request_count++;
+		}
+		req->arg = arg;
+		req->waiter = NULL;
+		if (!driver_state->async)
+		{
+			waiter.done = false;
+			waiter.status = 0;
+			req->waiter = &waiter;
+		}
+		io_wake(driver_state);
+
+		// Without a condition variable to report on, block until the request completes
+		if (!driver_state->async)
+		{
+			while (!waiter.done)
+			{
+				pthread_cond_wait(&(driver_state->complete_cond), &(driver_state->request_mutex));
+			}
+			ret = waiter.status;
+		}
+	}
+
+	pthread_mutex_unlock(&(driver_state->request_mutex));
+
+	return ret;
+}
+
+int init_interface(struct fmdriverif_state *driver_state, const struct fmdriver_open_params *params)
+{
+	pthread_condattr_t cond_attr;
+	int capacity, ret, i;
+
+	// Set the condition variable
+	driver_state->cond = params->callback_cond;
+
+	// Pollable interfaces signal through an eventfd instead. A managed tuner uses the
+	// manager's
+	if (params->pollable && driver_state->manager == NULL)
+	{
+		driver_state->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (driver_state->notify_fd < 0)
+		{
+			ret = errno;
+			perror("fmdriverif_open() -- failed to create event fd");
+			return ret;
+		}
+	}
+
+	// Requests only block when there is no way of reporting their completion
+	driver_state->async = (params->callback_cond != NULL || params->pollable || driver_state->manager != NULL);
+
+	// Init the event FIFO. A coalescing one needs room for a marker of every kind, and
+	// one that drops its oldest events lets the driver side take them back
+	driver_state->overflow = params->overflow;
+	capacity = (params->fifo_capacity != 0) ? params->fifo_capacity : FMDRIVER_FIFO_CAPACITY;
+	if (driver_state->overflow == FMDRIVER_OVERFLOW_COALESCE && capacity < EVENT_KINDS)
+	{
+		capacity = EVENT_KINDS;
+	}
+	ret = eventring_init(&(driver_state->event_fifo), capacity);
+	if (ret != 0)
+	{
+		fprintf(stderr, "fmdriverif_open() -- failed to initialize event FIFO %d\n", ret);
+		return ret;
+	}
+	if (driver_state->overflow == FMDRIVER_OVERFLOW_DROP_OLDEST)
+	{
+		eventring_allow_steal(&(driver_state->event_fifo));
+	}
+	driver_state->init_stages |= IFSTAGE_FIFO;
+
+	// Preallocate the event slots
+	ret = pool_init(driver_state);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	driver_state->init_stages |= IFSTAGE_POOL;
+
+	// Init the client wakeup -- timed waits run off the monotonic clock
+	ret = pthread_condattr_init(&cond_attr);
+	if (ret == 0)
+	{
+		pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+		ret = pthread_cond_init(&(driver_state->wait_cond), &cond_attr);
+		pthread_condattr_destroy(&cond_attr);
+	}
+	if (ret == 0)
+	{
+		ret = pthread_mutex_init(&(driver_state->wait_mutex), NULL);
+		if (ret != 0)
+		{
+			pthread_cond_destroy(&(driver_state->wait_cond));
+		}
+	}
+	if (ret != 0)
+	{
+		fprintf(stderr, "fmdriverif_open() -- failed to initialize wait condition %d\n", ret);
+		return ret;
+	}
+	driver_state->init_stages |= IFSTAGE_WAIT;
+
+	// The client hasn't read anything yet, so the first event wakes it
+	atomic_init(&(driver_state->consumer_armed), true);
+	atomic_init(&(driver_state->notifications), 0);
+	atomic_init(&(driver_state->read_batches), 0);
+	atomic_init(&(driver_state->events_read), 0);
+	for (i = 0; i < FMDRIVER_BATCH_BUCKETS; i++)
+	{
+		atomic_init(&(driver_state->batch_size_hist[i]), 0);
+	}
+	atomic_init(&(driver_state->events_dropped), 0);
+	atomic_init(&(driver_state->fifo_high_water), 0);
+	latency_init(&(driver_state->enqueue_wait));
+	atomic_init(&(driver_state->rds_blocks), 0);
+	atomic_init(&(driver_state->rds_blocks_corrected), 0);
+	atomic_init(&(driver_state->rds_blocks_bad), 0);
+	atomic_init(&(driver_state->rds_groups), 0);
+	atomic_init(&(driver_state->rds_poll_ms), RDS_POLL_MS);
+	atomic_init(&(driver_state->rds_polls), 0);
+	atomic_init(&(driver_state->rds_polled_ms), 0);
+	rds_schedule_reset(driver_state);
+
+	// No scan yet -- the region defaults to the Americas
+	atomic_init(&(driver_state->region), FM_REGION_AMERICAS);
+	atomic_init(&(driver_state->scan_cancel), false);
+	atomic_init(&(driver_state->lendable), false);
+	io_update_lendable(driver_state);
+	memset(driver_state->num_stations, 0, sizeof(driver_state->num_stations));
+	atomic_init(&(driver_state->seek_threshold), SEEK_SIGNAL_THRESHOLD);
+	atomic_init(&(driver_state->seek_settle_us), SEEK_SETTLE_US);
+	atomic_init(&(driver_state->seek_cancel), false);
+	driver_state->seek_cache = NULL;
+	atomic_init(&(driver_state->seeks), 0);
+	atomic_init(&(driver_state->seeks_cached), 0);
+
+	// No AF lists until stations send them
+	memset(driver_state->af_table, 0, sizeof(driver_state->af_table));
+	driver_state->af_clock = 0;
+	driver_state->af_next_check_ns = 0;
+	atomic_init(&(driver_state->af_threshold), AF_SIGNAL_THRESHOLD);
+	atomic_init(&(driver_state->af_hold_ms), AF_HOLD_MS);
+	atomic_init(&(driver_state->af_checks), 0);
+	atomic_init(&(driver_state->af_switches), 0);
+	latency_init(&(driver_state->af_retune));
+
+	// Telemetry stays off until asked for
+	atomic_init(&(driver_state->telemetry), NULL);
+	driver_state->telemetry_fd = -1;
+	driver_state->telemetry_last_ns = 0;
+	driver_state->rds_last_group_ns = 0;
+	atomic_init(&(driver_state->telemetry_samples), 0);
+
+	// The RDS decoder posts straight to the fifo
+	rdsdecoder_init(&(driver_state->rds), rds_emit_event, driver_state);
+
+	// First snapshot is whatever station the tuner was on at open
+	memset(driver_state->snapshots, 0, sizeof(driver_state->snapshots));
+	driver_state->snapshots[0].freq = driver_state->freq_khz;
+	driver_state->snapshots[0].volume = (driver_state->aud_info.volume * 100) / 65535;
+	atomic_init(&(driver_state->snapshot_seq), 0);
+
+	// Init the request queue. The worker's RDS polling waits on the monotonic clock
+	atomic_init(&(driver_state->tunes_coalesced), 0);
+	atomic_init(&(driver_state->volumes_coalesced), 0);
+	atomic_init(&(driver_state->io_scheduled), false);
+	atomic_init(&(driver_state->io_due_ns), 0);
+	ret = pthread_mutex_init(&(driver_state->request_mutex), NULL);
+	if (ret == 0)
+	{
+		ret = pthread_condattr_init(&cond_attr);
+		if (ret == 0)
+		{
+			pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+			ret = pthread_cond_init(&(driver_state->request_cond), &cond_attr);
+			pthread_condattr_destroy(&cond_attr);
+		}
+		if (ret == 0)
+		{
+			ret = pthread_cond_init(&(driver_state->complete_cond), NULL);
+			if (ret != 0)
+			{
+				pthread_cond_destroy(&(driver_state->request_cond));
+			}
+		}
+		if (ret != 0)
+		{
+			pthread_mutex_destroy(&(driver_state->request_mutex));
+		}
+	}
+	if (ret != 0)
+	{
+		fprintf(stderr, "fmdriverif_open() -- failed to initialize request queue %d\n", ret);
+		return ret;
+	}
+	driver_state->init_stages |= IFSTAGE_REQUESTS;
+
+	// A managed tuner's requests run on the manager's pool
+	if (driver_state->manager != NULL)
+		return 0;
+
+	// Start the I/O worker -- from here on it owns all driver ioctls
+	ret = pthread_create(&(driver_state->io_thread), NULL, io_worker, driver_state);
+	if (ret != 0)
+	{
+		fprintf(stderr, "fmdriverif_open() -- failed to start I/O worker %d\n", ret);
+		return ret;
+	}
+	driver_state->init_stages |= IFSTAGE_IO;
+
+	return 0;
+}
+
+int teardown_interface(struct fmdriverif_state *driver_state)
+{
+	int ret = 0;
+
+	// Take the interface out of the scan registry so no other scan recruits it, and stop
+	// any scan or seek of our own. Hot-plug stops queueing device requests too
+	scan_unregister(driver_state);
+	hotplug_unregister(driver_state);
+	atomic_store_explicit(&(driver_state->scan_cancel), true, memory_order_relaxed);
+	atomic_store_explicit(&(driver_state->seek_cancel), true, memory_order_relaxed);
+
+	// Stop the I/O worker. Clearing the fifo first releases the worker if it is blocked
+	// posting to a full fifo, and stops it from posting anything further
+	if (driver_state->init_stages & IFSTAGE_IO)
+	{
+		pthread_mutex_lock(&(driver_state->request_mutex));
+		driver_state->io_shutdown = true;
+		pthread_cond_signal(&(driver_state->request_cond));
+		pthread_mutex_unlock(&(driver_state->request_mutex));
+
+		fifo_clear(driver_state);
+		pthread_join(driver_state->io_thread, NULL);
+	}
+
+	// Nothing runs on the worker now, so its seek cache can go. A helper still sweeping for
+	// it frees it when done. Telemetry readers see sampling stop
+	seek_cache_drop(driver_state);
+	telemetry_close(driver_state);
+
+	if (driver_state->init_stages & IFSTAGE_REQUESTS)
+	{
+		pthread_cond_destroy(&(driver_state->complete_cond));
+		pthread_cond_destroy(&(driver_state->request_cond));
+		ret = pthread_mutex_destroy(&(driver_state->request_mutex));
+		if (ret != 0)
+		{
+			fprintf(stderr, "fmdriverif_close() -- failed on pthread_mutex_destroy %d\n", ret);
+		}
+	}
+
+	// Free any event structs that are sitting in the fifo
+	if (driver_state->init_stages & IFSTAGE_FIFO)
+	{
+		fifo_clear(driver_state);
+
+		// Now the enqueue side will not be waiting on a free slot because the fifo has
+		// been closed, preventing any new events from being enqueued. So we can safely
+		// tear it down.
+		eventring_destroy(&(driver_state->event_fifo));
+	}
+
+	// Release the event slots
+	if (driver_state->init_stages & IFSTAGE_POOL)
+	{
+		pool_destroy(driver_state);
+	}
+
+	// Tear down the client wakeup
+	if (driver_state->init_stages & IFSTAGE_WAIT)
+	{
+		pthread_cond_destroy(&(driver_state->wait_cond));
+		ret = pthread_mutex_destroy(&(driver_state->wait_mutex));
+		if (ret != 0)
+		{
+			fprintf(stderr, "fmdriverif_close() -- failed on pthread_mutex_destroy %d\n", ret);
+		}
+	}
+
+	// Close the eventfd -- the client must have removed it from any poll set by now
+	if (driver_state->notify_fd >= 0)
+	{
+		close(driver_state->notify_fd);
+	}
+
+	// Close the tuner driver handle
+	if (atomic_load_explicit(&(driver_state->device_up), memory_order_relaxed))
+	{
+		driver_state->backend->close(driver_state);
+	}
+
+	// Invalidate the sig so a stale handle is rejected
+	driver_state->sig = 0;
+
+	// Free the driver state
+	free(driver_state);
+
+	return ret;
+}
+
+int open_interface(int tuner_id, const struct fmdriver_open_params *params, struct fmdriver_manager *manager,
+		   unsigned long *if_handle_ptr)
+{
+	int ret, i;
+
+	// Set the interface handle pointer to 0 in case there is an error during open
+	*if_handle_ptr = 0;
+	
+	if (tuner_id < 0 || tuner_id >= FMDRIVER_MAX_TUNERS)
+		return EINVAL;
+
+	if (params->fifo_capacity < 0 || params->fifo_capacity > FMDRIVER_FIFO_CAPACITY_MAX ||
+	    params->overflow < FMDRIVER_OVERFLOW_BLOCK || params->overflow > FMDRIVER_OVERFLOW_COALESCE)
+		return EINVAL;
+
+	// Attempt to allocate a driver state struct -- the event ring needs cache-line alignment
+	struct fmdriverif_state *driver_state;
+	ret = posix_memalign((void **)&driver_state, EVENTRING_CACHE_LINE, sizeof(struct fmdriverif_state));
+	if (ret != 0)
+	{		
+		fprintf(stderr, "fmdriverif_open() -- failed to allocate driver state %d\n", ret);
+		return ENOMEM;
+	}
+	memset(driver_state, 0, sizeof(struct fmdriverif_state));
+	driver_state->notify_fd = -1;
+	driver_state->tuner_fd = -1;
+	driver_state->tuner_id = tuner_id;
+	driver_state->manager = manager;
+	for (i = 0; i < FMDRIVER_OPS; i++)
+	{
+		latency_init(&(driver_state->op_latency[i]));
+	}
+
+	// Attempt to open the FM tuner driver, or whatever stands in for it. An async open
+	// leaves that to the I/O worker
+	atomic_init(&(driver_state->device_up), false);
+	atomic_init(&(driver_state->range_known), false);
+	driver_state->backend = backend_select();
+	if (!params->async_open)
+	{
+		ret = device_attach(driver_state, false);
+		if (ret != 0)
+		{
+			teardown_interface(driver_state);
+			return ret;
+		}
+	}
+
+	ret = init_interface(driver_state, params);
+	if (ret == 0 && params->async_open)
+	{
+		ret = submit_device_request(driver_state, DEVICE_OPEN);
+	}
+	if (ret != 0)
+	{
+		teardown_interface(driver_state);
+		return ret;
+	}
+
+	// Set the good magic number
+	driver_state->sig = IFSTATE_GOOD;
+
+	// Make the tuner available to scans on other interfaces, and reconnect it if it is
+	// unplugged
+	scan_register(driver_state);
+	if (driver_state->backend->hotplug)
+	{
+		hotplug_register(driver_state);
+	}
+
+	// Cast the driver state pointer to an int and return to caller
+	*if_handle_ptr = (unsigned long)driver_state; 		
+
+	return 0;
+}
+
+int fmdriverif_open(int tuner_id, pthread_cond_t *callback_cond, unsigned long *if_handle_ptr)
+{
+	struct fmdriver_open_params params;
+
+	memset(&params, 0, sizeof(params));
+	params.callback_cond = callback_cond;
+
+	return open_interface(tuner_id, &params, NULL, if_handle_ptr);
+}
+
+int fmdriverif_open_pollable(int tuner_id, unsigned long *if_handle_ptr, int *event_fd_ptr)
+{
+	struct fmdriver_open_params params;
+
+	memset(&params, 0, sizeof(params));
+	params.pollable = true;
+
+	return fmdriverif_open_ex(tuner_id, &params, if_handle_ptr, event_fd_ptr);
+}
+
+int fmdriverif_open_ex(int tuner_id, const struct fmdriver_open_params *params, unsigned long *if_handle_ptr,
+		       int *event_fd_ptr)
+{
+	int ret;
+
+	if (params == NULL)
+		return EINVAL;
+
+	if (event_fd_ptr != NULL)
+	{
+		*event_fd_ptr = -1;
+	}
+
+	ret = open_interface(tuner_id, params, NULL, if_handle_ptr);
+	if (ret == 0 && event_fd_ptr != NULL)
+	{
+		*event_fd_ptr = ((struct fmdriverif_state *)*if_handle_ptr)->notify_fd;
+	}
+
+	return ret;
+}
+
+int fmdriverif_close(unsigned long if_handle)
+{	
+	struct fmdriverif_state *driver_state;
+	
+	if (if_handle == 0)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	// A managed tuner goes with its manager
+	if (driver_state->manager != NULL)
+		return EBUSY;
+
+	return teardown_interface(driver_state);
+}
+
+int fmdriverif_powerrequest(unsigned long if_handle, enum fmdriver_power_state req_state)
+{
+	return submit_request(if_handle, FM_EVENT_POWER, req_state);
+}
+
+int fmdriverif_tunerequest(unsigned long if_handle, int tune_freq)
+{
+	return submit_request(if_handle, FM_EVENT_TUNE, tune_freq);
+}
+
+int fmdriverif_seekrequest(unsigned long if_handle, bool seek_up)
+{
+	struct fmdriverif_state *driver_state;
+
+	if (if_handle == 0)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	// Clear any stop left over from an earlier seek
+	atomic_store_explicit(&(driver_state->seek_cancel), false, memory_order_relaxed);
+
+	return submit_request(if_handle, FM_EVENT_SEEK, seek_up);
+}
+
+int fmdriverif_set_seek_params(unsigned long if_handle, int signal_threshold, int settle_us)
+{
+	struct fmdriverif_state *driver_state;
+
+	if (if_handle == 0 || signal_threshold <= 0 || signal_threshold > 65535 || settle_us < 0 || settle_us > 1000000)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	// Picked up by the next seek
+	atomic_store_explicit(&(driver_state->seek_threshold), signal_threshold, memory_order_relaxed);
+	atomic_store_explicit(&(driver_state->seek_settle_us), settle_us, memory_order_relaxed);
+
+	return 0;
+}
+
+int fmdriverif_set_telemetry(unsigned long if_handle, int interval_ms)
+{
+	struct fmdriverif_state *driver_state;
+	int ret;
+
+	if (if_handle == 0 || interval_ms < 0 || interval_ms > 60000 || (interval_ms > 0 && interval_ms < FMDRIVER_TELEMETRY_MIN_MS))
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	ret = pthread_mutex_lock(&(driver_state->request_mutex));
+	if (ret != 0)
+	{
+		fprintf(stderr, "fmdriverif_set_telemetry() -- failed on pthread_mutex_lock %d\n", ret);
+		return ret;
+	}
+
+	// The worker may be waiting on an RDS poll or nothing at all -- have it look again
+	ret = telemetry_start(driver_state, interval_ms);
+	if (ret == 0)
+	{
+		io_wake(driver_state);
+	}
+	pthread_mutex_unlock(&(driver_state->request_mutex));
+
+	return ret;
+}
+
+int fmdriverif_set_af_params(unsigned long if_handle, int signal_threshold, int hold_ms)
+{
+	struct fmdriverif_state *driver_state;
+
+	if (if_handle == 0 || signal_threshold < 0 || signal_threshold > 65535 || hold_ms < 0 || hold_ms > 600000)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	// Picked up by the next signal check
+	atomic_store_explicit(&(driver_state->af_threshold), signal_threshold, memory_order_relaxed);
+	atomic_store_explicit(&(driver_state->af_hold_ms), hold_ms, memory_order_relaxed);
+
+	return 0;
+}
+
+int fmdriverif_scanrequest(unsigned long if_handle, bool stop_scan)
+{
+	struct fmdriverif_state *driver_state;
+
+	if (if_handle == 0)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	// A stop can't wait behind the scan it is stopping, so it bypasses the request queue.
+	// It stops a seek sweep too
+	atomic_store_explicit(&(driver_state->scan_cancel), stop_scan, memory_order_relaxed);
+	if (stop_scan)
+	{
+		atomic_store_explicit(&(driver_state->seek_cancel), true, memory_order_relaxed);
+		return 0;
+	}
+
+	return submit_request(if_handle, FM_EVENT_SCAN, 0);
+}
+
+int fmdriverif_volrequest(unsigned long if_handle, int vol_level)
+{
+	return submit_request(if_handle, FM_EVENT_VOL, vol_level);
+}
+
+int fmdriverif_set_region(unsigned long if_handle, enum fm_region region)
+{
+	struct fmdriverif_state *driver_state;
+
+	if (if_handle == 0 || region < FM_REGION_AMERICAS || region > FM_REGION_OTHER)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	// Selects the region's channel map and station table. Anything the worker is already
+	// doing finishes on the old one
+	atomic_store_explicit(&(driver_state->region), region, memory_order_relaxed);
+
+	return 0;
+}
+
+int fmdriverif_get_channel_map(unsigned long if_handle, enum fm_region region, struct fmdriver_channel_map *map)
+{
+	struct fmdriverif_state *driver_state;
+
+	if (if_handle == 0 || region < FM_REGION_AMERICAS || region > FM_REGION_OTHER || map == NULL)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	// Built along with the range, once the device has come up
+	if (!atomic_load_explicit(&(driver_state->range_known), memory_order_acquire))
+		return EAGAIN;
+
+	*map = driver_state->channel_maps[region];
+
+	return 0;
+}
+
+int fmdriverif_region_channel(enum fm_region region, int freq_khz)
+{
+	const struct fm_region_band *band;
+
+	if (region < FM_REGION_AMERICAS || region > FM_REGION_OTHER)
+		return -1;
+	band = &(fm_region_bands[region]);
+
+	if (freq_khz < band->low_khz || freq_khz > band->high_khz || (freq_khz - band->low_khz) % band->spacing_khz != 0)
+		return -1;
+
+	return (freq_khz - band->low_khz) / band->spacing_khz;
+}
+
+int fmdriverif_get_stations(unsigned long if_handle, struct fmdriver_station *stations, int max_stations,
+			    int *num_stations)
+{
+	struct fmdriverif_state *driver_state;
+	int region, ret;
+
+	if (if_handle == 0 || stations == NULL || max_stations < 0 || num_stations == NULL)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	ret = pthread_mutex_lock(&(driver_state->request_mutex));
+	if (ret != 0)
+	{
+		fprintf(stderr, "fmdriverif_get_stations() -- failed on pthread_mutex_lock %d\n", ret);
+		return ret;
+	}
+	region = atomic_load_explicit(&(driver_state->region), memory_order_relaxed);
+	*num_stations = (driver_state->num_stations[region] < max_stations) ? driver_state->num_stations[region] : max_stations;
+	memcpy(stations, driver_state->stations[region], *num_stations * sizeof(struct fmdriver_station));
+	pthread_mutex_unlock(&(driver_state->request_mutex));
+
+	return 0;
+}
+
+int fmdriverif_read_event(unsigned long if_handle, struct fmdriver_event *event)
+{
+	struct fmdriverif_state *driver_state;
+
+	if (if_handle == 0 || event == NULL)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	// A managed tuner's events are read through the manager
+	if (driver_state->manager != NULL)
+		return EBUSY;
+
+	// Take the next event from the FIFO, or EAGAIN if there isn't one
+	return fifo_dequeue(driver_state, event);
+}
+
+int fmdriverif_read_events(unsigned long if_handle, struct fmdriver_event *events, int max_events,
+			   int timeout_ms, int *num_events)
+{
+	struct fmdriverif_state *driver_state;
+	struct timespec deadline;
+	int count, bucket, ret = 0;
+
+	if (if_handle == 0 || events == NULL || max_events <= 0 || num_events == NULL)
+		return EINVAL;
+
+	*num_events = 0;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	if (driver_state->manager != NULL)
+		return EBUSY;
+
+	// Fast path -- take whatever is already waiting without touching the wait mutex
+	count = fifo_dequeue_batch(driver_state, events, max_events);
+
+	if (count == 0 && timeout_ms != 0)
+	{
+		if (timeout_ms > 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += timeout_ms / 1000;
+			deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L)
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+		}
+
+		ret = pthread_mutex_lock(&(driver_state->wait_mutex));
+		if (ret != 0)
+		{
+			fprintf(stderr, "fmdriverif_read_events() -- failed on pthread_mutex_lock %d\n", ret);
+			return ret;
+		}
+
+		// The fifo was armed when we found it empty, and the driver side takes the wait
+		// mutex before signalling, so a wakeup can't slip between the check and the wait
+		while ((count = fifo_dequeue_batch(driver_state, events, max_events)) == 0 && ret == 0)
+		{
+			if (timeout_ms < 0)
+			{
+				ret = pthread_cond_wait(&(driver_state->wait_cond), &(driver_state->wait_mutex));
+			}
+			else
+			{
+				ret = pthread_cond_timedwait(&(driver_state->wait_cond), &(driver_state->wait_mutex), &deadline);
+			}
+		}
+
+		pthread_mutex_unlock(&(driver_state->wait_mutex));
+	}
+
+	if (count == 0)
+	{
+		return (timeout_ms == 0) ? EAGAIN : ret;
+	}
+
+	// Record the batch size in log2 buckets
+	for (bucket = 0; bucket < FMDRIVER_BATCH_BUCKETS - 1 && (count >> (bucket + 1)) != 0; bucket++)
+		;
+	atomic_fetch_add_explicit(&(driver_state->read_batches), 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&(driver_state->events_read), count, memory_order_relaxed);
+	atomic_fetch_add_explicit(&(driver_state->batch_size_hist[bucket]), 1, memory_order_relaxed);
+
+	*num_events = count;
+	return 0;
+}
+
+int fmdriverif_get_snapshot(unsigned long if_handle, struct fmdriver_snapshot *snapshot)
+{
+	struct fmdriverif_state *driver_state;
+	unsigned int seq;
+
+	if (if_handle == 0 || snapshot == NULL)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	// Copy the current buffer. The worker writes the other one, so we only go round again
+	// if it published while we were copying -- at RDS rates, next to never
+	do
+	{
+		seq = atomic_load_explicit(&(driver_state->snapshot_seq), memory_order_acquire);
+		*snapshot = driver_state->snapshots[seq & 1];
+		atomic_thread_fence(memory_order_acquire);
+	}
+	while (atomic_load_explicit(&(driver_state->snapshot_seq), memory_order_relaxed) != seq);
+
+	return 0;
+}
+
+int fmdriverif_get_range(unsigned long if_handle, int *low_khz, int *high_khz)
+{
+	struct fmdriverif_state *driver_state;
+
+	if (if_handle == 0)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	// An async open doesn't know the range until the device has come up
+	if (!atomic_load_explicit(&(driver_state->range_known), memory_order_acquire))
+		return EAGAIN;
+
+	*low_khz = driver_state->range_low_khz;
+	*high_khz = driver_state->range_high_khz;
+
+	return 0;
+}
+
+int fmdriverif_get_stats(unsigned long if_handle, struct fmdriver_stats *stats)
+{
+	struct fmdriverif_state *driver_state;
+	int i;
+
+	if (if_handle == 0 || stats == NULL)
+		return EINVAL;
+
+	// Cast the handle to state pointer
+	driver_state = (struct fmdriverif_state *)if_handle;
+
+	// Check the sig
+	if (driver_state->sig != IFSTATE_GOOD)
+		return EINVAL;
+
+	memset(stats, 0, sizeof(struct fmdriver_stats));
+	stats->pool_exhausted = atomic_load_explicit(&(driver_state->pool_exhausted), memory_order_relaxed);
+	stats->notifications = atomic_load_explicit(&(driver_state->notifications), memory_order_relaxed);
+	stats->read_batches = atomic_load_explicit(&(driver_state->read_batches), memory_order_relaxed);
+	stats->events_read = atomic_load_explicit(&(driver_state->events_read), memory_order_relaxed);
+	stats->tunes_coalesced = atomic_load_explicit(&(driver_state->tunes_coalesced), memory_order_relaxed);
+	stats->volumes_coalesced = atomic_load_explicit(&(driver_state->volumes_coalesced), memory_order_relaxed);
+	for (i = 0; i < FMDRIVER_BATCH_BUCKETS; i++)
+	{
+		stats->batch_size_hist[i] = atomic_load_explicit(&(driver_state->batch_size_hist[i]), memory_order_relaxed);
+	}
+	stats->events_dropped = atomic_load_explicit(&(driver_state->events_dropped), memory_order_relaxed);
+
+	stats->fifo_capacity = driver_state->event_fifo.capacity;
+	stats->fifo_depth = eventring_count(&(driver_state->event_fifo));
+	stats->fifo_high_water = atomic_load_explicit(&(driver_state->fifo_high_water), memory_order_relaxed);
+	latency_read(&(driver_state->enqueue_wait), &(stats->enqueue_wait));
+	for (i = 0; i < FMDRIVER_OPS; i++)
+	{
+		latency_read(&(driver_state->op_latency[i]), &(stats->ops[i]));
+	}
+
+	stats->rds_blocks = atomic_load_explicit(&(driver_state->rds_blocks), memory_order_relaxed);
+	stats->rds_blocks_corrected = atomic_load_explicit(&(driver_state->rds_blocks_corrected), memory_order_relaxed);
+	stats->rds_blocks_bad = atomic_load_explicit(&(driver_state->rds_blocks_bad), memory_order_relaxed);
+	stats->rds_groups = atomic_load_explicit(&(driver_state->rds_groups), memory_order_relaxed);
+	stats->rds_polls = atomic_load_explicit(&(driver_state->rds_polls), memory_order_relaxed);
+	stats->rds_polls_saved = (long)(atomic_load_explicit(&(driver_state->rds_polled_ms), memory_order_relaxed) / RDS_POLL_MS) -
+				 (long)stats->rds_polls;
+	stats->rds_poll_ms = atomic_load_explicit(&(driver_state->rds_poll_ms), memory_order_relaxed);
+
+	stats->seeks = atomic_load_explicit(&(driver_state->seeks), memory_order_relaxed);
+	stats->seeks_cached = atomic_load_explicit(&(driver_state->seeks_cached), memory_order_relaxed);
+
+	stats->af_checks = atomic_load_explicit(&(driver_state->af_checks), memory_order_relaxed);
+	stats->af_switches = atomic_load_explicit(&(driver_state->af_switches), memory_order_relaxed);
+	latency_read(&(driver_state->af_retune), &(stats->af_retune));
+
+	stats->telemetry_samples = atomic_load_explicit(&(driver_state->telemetry_samples), memory_order_relaxed);
+
 	return 0;
 }
 
@@ -9,6 +9,9 @@
 #include <pthread.h>
 #include <stdbool.h>
 
+// Tuners are /dev/radio0 to /dev/radio9, or their simulated equivalents
+#define FMDRIVER_MAX_TUNERS	10
+
 enum fmdriver_power_state
 {
 	FM_POWER_OFF,
@@ -18,6 +21,47 @@ enum fmdriver_power_state
 	FM_POWER_WAKE
 };
 
+// FM radio regions -- each has its own band edges and channel spacing, in kHz. Frequencies
+// are integer kHz everywhere below the page; channel n of a region is low + n * spacing.
+// The enum and the band table are both generated from this list
+#define FM_REGION_LIST(X) \
+	X(FM_REGION_AMERICAS,	87900,	107900,	200) \
+	X(FM_REGION_EUAFRICA,	87500,	108000,	100) \
+	X(FM_REGION_JPN,	76000,	90000,	100) \
+	X(FM_REGION_OTHER,	87500,	108000,	50)
+
+#define FM_REGION_ENUM(region, low_khz, high_khz, spacing_khz)	region,
+
+enum fm_region
+{
+	FM_REGION_LIST(FM_REGION_ENUM)
+};
+
+#define FM_REGIONS		(FM_REGION_OTHER + 1)
+
+struct fm_region_band
+{
+	int low_khz;
+	int high_khz;
+	int spacing_khz;
+	int num_channels;
+};
+
+// Indexed by enum fm_region
+extern const struct fm_region_band fm_region_bands[FM_REGIONS];
+
+// A region's channels as one tuner can receive them -- its band cut down to the tuner range.
+// Channel first_channel of the region is at low_khz, and num_channels follow it
+struct fmdriver_channel_map
+{
+	enum fm_region region;
+	int low_khz;
+	int high_khz;
+	int spacing_khz;
+	int first_channel;
+	int num_channels;		// 0 if the tuner can't reach the band
+};
+
 enum fmdriver_event_id
 {
 	FM_EVENT_POWER,
@@ -34,16 +78,32 @@ enum rds_field
 	RDS_FIELD_PI,
 	RDS_FIELD_PTY,
 	RDS_FIELD_PTYN,
-	RDS_FIELD_RT
+	RDS_FIELD_RT,
+	RDS_FIELD_AF
 };
 
+// Longest RDS field is the radio text (64 chars)
+#define RDS_DATA_MAX		64
+
+// FM_EVENT_RDS payload. PI is two bytes, most significant first, and PTY is one byte.
+// The text fields (PS, PTYN and RT) are characters with no terminator. AF is the PI the list
+// belongs to, as above, then one AF code a byte. The interface keeps AF lists for itself
+// rather than posting them, see fmdriverif_set_af_params
+
+// AF codes 1-204 are 87.6-107.9 MHz. A list has at most 25 of them
+#define RDS_AF_MAX		25
+#define RDS_AF_KHZ(code)	(87500 + (code) * 100)
+
 struct rds_data
 {
 	enum rds_field field;
 	int data_length;
-	unsigned char *data;
+	unsigned char data[RDS_DATA_MAX];
 };		
 
+// Event payloads are stored inline so events can live in a preallocated pool
+#define FMDRIVER_EVENT_DATA_MAX	sizeof(struct rds_data)
+
 // Since all tuner requests are async and RDS data arrives async as well, we define
 // an event payload struct for the FM driver interface. The interface client provides a
 // pthread condition variable to be signalled on when a driver event occurs 
@@ -52,26 +112,350 @@ struct fmdriver_event
 	enum fmdriver_event_id event_id;
 	int status_code;
 	int data_len;
-	unsigned char *event_data;
+	unsigned char event_data[FMDRIVER_EVENT_DATA_MAX];
 };		
 
+// Event status codes are 0 on success or an errno value on failure. A tune or volume
+// request that was replaced by a newer one of the same kind before it reached the driver
+// completes with this status instead
+#define FMDRIVER_STATUS_SUPERSEDED	(-1)
+
+// Tuner flags reported with tune results
+#define FMDRIVER_TUNER_STEREO	0x01	// Station is in stereo
+#define FMDRIVER_TUNER_RDS	0x02	// Station carries RDS
+
+// FM_EVENT_TUNE payload. FM_EVENT_VOL and FM_EVENT_POWER carry the volume level or power
+// state in effect once the request has run, as an int
+struct fmdriver_tune_data
+{
+	int freq;			// Frequency in kHz (e.g. 101500)
+	int signal;			// Signal strength, 0-65535
+	unsigned int flags;		// FMDRIVER_TUNER_* flags
+};
+
+// Station found by a scan
+struct fmdriver_station
+{
+	int freq;			// Frequency in kHz
+	unsigned short signal;		// Signal strength, 0-65535
+	unsigned short flags;		// FMDRIVER_TUNER_* flags
+};
+
+// Most stations a scan can report. A station has to be a local signal peak, so this
+// covers every channel of the widest band at the finest spacing
+#define FMDRIVER_MAX_STATIONS	256
+
+// FM_EVENT_SCAN payload. The station table itself is too big to travel in an event, so
+// it is read with fmdriverif_get_stations once the scan event arrives
+struct fmdriver_scan_data
+{
+	int num_stations;		// Stations in the table
+	int channels_scanned;		// Channels measured across all tuners
+	int tuners_used;		// Tuners that took part in the scan
+	int scan_ms;			// Wall-clock scan time
+};
+
+// RDS fields held in a snapshot
+#define FMDRIVER_RDS_PI		0x01
+#define FMDRIVER_RDS_PS		0x02
+#define FMDRIVER_RDS_PTY	0x04
+#define FMDRIVER_RDS_PTYN	0x08
+#define FMDRIVER_RDS_RT		0x10
+
+// The station the tuner is on and what it has said about itself, see fmdriverif_get_snapshot.
+// RDS fields are cleared on every retune. Strings are NULL terminated
+struct fmdriver_snapshot
+{
+	unsigned int generation;	// Goes up by one with every change
+	int freq;			// Frequency in kHz, 0 if not known
+	int signal;			// Signal strength at the last tune, 0-65535
+	unsigned int flags;		// FMDRIVER_TUNER_* flags at the last tune
+	int volume;			// 0-100
+	unsigned int rds_valid;		// FMDRIVER_RDS_* flags for the fields received
+	unsigned short pi;
+	unsigned char pty;
+	char ps[9];
+	char ptyn[9];
+	char rt[RDS_DATA_MAX + 1];
+};
+
+// Batch sizes are counted in log2 buckets: 1, 2-3, 4-7, 8-15, 16-31, 32+
+#define FMDRIVER_BATCH_BUCKETS	6
+
+// Calls into the tuner driver, timed separately in the statistics
+enum fmdriver_op
+{
+	FMDRIVER_OP_SET_FREQ,
+	FMDRIVER_OP_GET_FREQ,
+	FMDRIVER_OP_GET_TUNER,
+	FMDRIVER_OP_GET_AUDIO,
+	FMDRIVER_OP_SET_AUDIO,
+	FMDRIVER_OP_READ_RDS,
+	FMDRIVER_OP_SEEK,
+	FMDRIVER_OP_OTHER,
+	FMDRIVER_OPS
+};
+
+// Latencies are counted in log2 microsecond buckets: under 1us, 1-2us, 2-4us and so on,
+// with the last bucket taking everything from 2^18us (262ms) up
+#define FMDRIVER_LATENCY_BUCKETS	20
+
+struct fmdriver_latency
+{
+	unsigned long count;
+	unsigned long total_us;
+	unsigned long max_us;
+	unsigned long hist[FMDRIVER_LATENCY_BUCKETS];
+};
+
+// Interface statistics, see fmdriverif_get_stats
+struct fmdriver_stats
+{
+	unsigned long pool_exhausted;	// Events dropped because no event slot was free
+	unsigned long events_dropped;	// Events thrown away because the client had fallen behind
+	unsigned long notifications;	// Client wakeups issued by the driver side
+	unsigned long read_batches;	// fmdriverif_read_events calls that returned events
+	unsigned long events_read;	// Events returned by those calls
+	unsigned long tunes_coalesced;	// Tune requests superseded before reaching the driver
+	unsigned long volumes_coalesced;	// Volume requests superseded before reaching the driver
+	unsigned long batch_size_hist[FMDRIVER_BATCH_BUCKETS];
+
+	int fifo_capacity;
+	int fifo_depth;			// Events waiting to be read
+	int fifo_high_water;		// Most events ever waiting at once
+	struct fmdriver_latency enqueue_wait;	// Driver side blocked on a full FIFO
+	struct fmdriver_latency ops[FMDRIVER_OPS];	// Driver calls, by enum fmdriver_op
+
+	// RDS decoding
+	unsigned long rds_blocks;
+	unsigned long rds_blocks_corrected;
+	unsigned long rds_blocks_bad;
+	unsigned long rds_groups;
+
+	// RDS polling. Polls are reads of the tuner's RDS buffer, each a trip over USB on the
+	// Si470x; saved counts the reads a fixed 40 ms poll would have made on top of those,
+	// and goes negative while a freshly tuned station is polled faster than that
+	unsigned long rds_polls;
+	long rds_polls_saved;
+	int rds_poll_ms;		// Current interval
+
+	// Seeking. Cached seeks were answered from the station table or the neighbours found
+	// after the last seek, in a single tune
+	unsigned long seeks;
+	unsigned long seeks_cached;
+
+	// Alternative frequencies. Checks are the times the signal dropped on a station with an
+	// AF list; switches are the checks that ended on an alternative. The retune latency runs
+	// from the drop being seen to the tuner landing
+	unsigned long af_checks;
+	unsigned long af_switches;
+	struct fmdriver_latency af_retune;
+
+	// Telemetry samples written to the shared-memory ring
+	unsigned long telemetry_samples;
+};
+
+// Multi-tuner manager statistics, see fmdriverif_manager_get_stats
+struct fmdriver_manager_stats
+{
+	int workers;			// Threads in the pool
+	int tuners;			// Tuners the manager has open
+	unsigned long turns;		// Times a worker has run a tuner's queued work
+	unsigned long steals;		// ... taken from another worker's run queue
+};
+
+// Event from one of a manager's tuners
+struct fmdriver_tuner_event
+{
+	int tuner_id;
+	struct fmdriver_event event;
+};
+
+// Tuner backends -- "v4l" drives /dev/radioN, "sim" is a simulated tuner for running
+// without the hardware (see fmsim.h). Picks the backend for interfaces opened from then on.
+// Until it is called, the FMTUNER_BACKEND environment variable names the backend, and
+// failing that it is V4L. Returns ENOENT for an unknown name
+int fmdriverif_set_backend(const char *name);
+
+// What the driver side does with a new event when the client has fallen behind and the
+// event FIFO is full
+enum fmdriver_overflow
+{
+	FMDRIVER_OVERFLOW_BLOCK,	// Wait for the client to make room. RDS events are dropped
+	FMDRIVER_OVERFLOW_DROP_OLDEST,	// Throw away the oldest unread event
+	FMDRIVER_OVERFLOW_DROP_NEWEST,	// Throw away the new event
+	FMDRIVER_OVERFLOW_COALESCE	// Keep only the latest unread event of each kind
+};
+
+// Default event FIFO capacity, and the most an interface can ask for
+#define FMDRIVER_FIFO_CAPACITY		32
+#define FMDRIVER_FIFO_CAPACITY_MAX	4096
+
+// Interface options for fmdriverif_open_ex. Zeroed params give an interface like
+// fmdriverif_open with a NULL condition variable
+struct fmdriver_open_params
+{
+	pthread_cond_t *callback_cond;	// As for fmdriverif_open
+	bool pollable;			// As for fmdriverif_open_pollable
+	int fifo_capacity;		// Events the FIFO holds, rounded up to a power of two. 0 for the default
+	enum fmdriver_overflow overflow;
+	bool async_open;		// Open the device in the background, see fmdriverif_open_ex
+};
+
 // Driver open/close
 // On open, the client provides a pthread condition variable for receiving callbacks on
 // If the condition callback is NULL, all requests will block until complete.
 int fmdriverif_open(int tuner_id, pthread_cond_t *callback_cond, unsigned long *if_handle_ptr);
 int fmdriverif_close(unsigned long if_handle);
 
-// Driver requests -- async unless the interface was opened with a NULL condition variable
+// Pollable open -- instead of a condition variable, the interface signals through an eventfd
+// returned in event_fd_ptr, so any number of interfaces can be watched from one poll/epoll
+// loop, or from a GLib main loop as FMTuner does. The fd becomes readable when events are
+// waiting and stays readable until the FIFO has been drained with fmdriverif_read_event(s);
+// the client must not read or close it. Requests on a pollable interface are async.
+int fmdriverif_open_pollable(int tuner_id, unsigned long *if_handle_ptr, int *event_fd_ptr);
+
+// Open with options. The two opens above are shorthand for this with the default FIFO and
+// FMDRIVER_OVERFLOW_BLOCK. Coalescing (by event id, and by field for RDS) happens whenever
+// an unread event of the same kind is waiting, not just when the FIFO is full: the client
+// reads the latest one in the older one's place. event_fd_ptr is only written for a
+// pollable interface and may be NULL otherwise. Every event thrown away is counted in
+// the stats as events_dropped.
+// With async_open, the handle comes back as soon as the interface is set up and the device
+// is opened on the interface's worker. A callback or pollable interface gets FM_EVENT_POWER
+// when it is done: status 0 and the power state once the tuner is up, or the errno it
+// failed with. Requests made in the meantime run once it is up. The tuner range isn't
+// known until then.
+// Tuners on /dev/radioN are watched for hot-plug whichever way they were opened. When the
+// node goes away, the interface posts FM_EVENT_POWER with ENODEV and requests fail with
+// ENODEV. When it comes back the device is reopened, put back on the station and volume it
+// had, and FM_EVENT_POWER is posted with status 0 again. A tuner that failed an async open
+// comes up the same way once it is plugged in. A tuner that fails to reopen on
+// FM_POWER_REBOOT goes down the same way, and FM_POWER_ON or FM_POWER_REBOOT tries it again
+int fmdriverif_open_ex(int tuner_id, const struct fmdriver_open_params *params, unsigned long *if_handle_ptr,
+		       int *event_fd_ptr);
+
+// Driver requests -- async unless the interface was opened with a NULL condition variable.
+// Requests are queued to an I/O worker thread owned by the interface, which issues the
+// driver ioctls and posts an event with the same id as the request when it completes.
+// Returns EBUSY if too many requests are already waiting. Frequencies are in kHz.
+// A blocking tune or volume request that another one replaces before it reaches the driver
+// returns ECANCELED -- the event status for the same case is FMDRIVER_STATUS_SUPERSEDED.
 int fmdriverif_powerrequest(unsigned long if_handle, enum fmdriver_power_state req_state);
 int fmdriverif_tunerequest(unsigned long if_handle, int tune_freq);
 int fmdriverif_seekrequest(unsigned long if_handle, bool seek_up);
 int fmdriverif_scanrequest(unsigned long if_handle, bool stop_scan);
 int fmdriverif_volrequest(unsigned long if_handle, int vol_level); // 0-100
 
+// Seeking -- a seek request tunes to the next station up or down the band, wrapping at the
+// ends, and completes with a struct fmdriver_tune_data, or ENOENT if there is nothing but
+// the station it started on. With a station table from a scan, the next station comes
+// straight from that. Otherwise the tuner's own seek is used, or where it has none, as on
+// the V4L radio interface, the channels are swept one by one at the region's spacing: each
+// is given settle_us after the retune and the first whose signal reaches signal_threshold
+// (then the peak next to it) is taken. Once a seek lands, an idle tuner, if there is one,
+// looks for the next stations either way in the background, so the next press is a single
+// tune too. The defaults are 0x4000 and 2000 us. A scan request with stop_scan stops a sweep
+// in progress, which completes with ECANCELED back on the station it started from
+int fmdriverif_set_seek_params(unsigned long if_handle, int signal_threshold, int settle_us);
+
+// Alternative frequencies -- stations that send AF lists (RDS group 0A) have them kept by PI.
+// While a station plays its signal is checked every 200 ms, and when it falls below
+// signal_threshold the alternatives are measured and the tuner moves to the strongest that
+// turns out to carry the same PI. The client just gets an FM_EVENT_TUNE for the new
+// frequency; the RDS fields in the snapshot carry over, since it is the same programme.
+// If no alternative will do, the tuner goes back to the station and doesn't look again for
+// hold_ms. A request from the client cuts the search short. signal_threshold of 0 turns
+// this off. The defaults are 0x2000 and 3000 ms
+int fmdriverif_set_af_params(unsigned long if_handle, int signal_threshold, int hold_ms);
+
+// Telemetry -- samples the tuner's signal, stereo and RDS flags every interval_ms into a ring
+// in POSIX shared memory that dashboards in other processes read without system calls, see
+// fmtelemetry.h. Samples are taken on the interface's I/O worker between requests, like the
+// RDS polls, while a station is playing. The ring is created the first time this is called
+// with a non-zero interval; 0 stops sampling, and closing the interface removes the ring.
+// Only one interface writes a tuner's ring at a time -- EBUSY if another handle, here or in
+// another process, already has telemetry on for the tuner. Intervals run from
+// FMDRIVER_TELEMETRY_MIN_MS to 60000
+#define FMDRIVER_TELEMETRY_MIN_MS	10
+int fmdriverif_set_telemetry(unsigned long if_handle, int interval_ms);
+
+// Scanning -- a scan request sweeps the tuner's whole range at the region's channel spacing,
+// measuring every channel, then retunes to the original station and posts FM_EVENT_SCAN
+// with a struct fmdriver_scan_data. If other tuners are open, idle ones each take a share of
+// the channels so the band is covered concurrently. A scan stopped with stop_scan completes
+// with ECANCELED and leaves the previous station table in place.
+// The region defaults to FM_REGION_AMERICAS. Every region's channel map is built when the
+// device first comes up, so switching region just selects another map: the device stays
+// open and the station playing carries on, and scans and seeks from then on use the new
+// band and spacing. Each region keeps its own station table, so switching back finds the
+// last scan there again
+int fmdriverif_set_region(unsigned long if_handle, enum fm_region region);
+
+// Copies out a region's channel map for the tuner. EAGAIN until the device has come up, as
+// with fmdriverif_get_range
+int fmdriverif_get_channel_map(unsigned long if_handle, enum fm_region region, struct fmdriver_channel_map *map);
+
+// Channel of a frequency in a region's band, or -1 if it is outside the band or off the
+// channel grid
+int fmdriverif_region_channel(enum fm_region region, int freq_khz);
+
+// Copies out the station table from the last completed scan in the current region, sorted
+// by frequency
+int fmdriverif_get_stations(unsigned long if_handle, struct fmdriver_station *stations, int max_stations,
+			    int *num_stations);
+
 // Event data access -- reads the next event from the event FIFO. Typically, the client will 
 // have a worker thread that waits until its condition variable is signalled, then calls this
-// function to retrieve the event data
+// function to retrieve the event data. Returns EAGAIN if the FIFO is empty. The event,
+// including its payload, is copied into the caller's struct
 int fmdriverif_read_event(unsigned long if_handle, struct fmdriver_event *event);
 
+// Batched event access -- reads up to max_events events from the FIFO in one call. Waits up
+// to timeout_ms for the first event if the FIFO is empty (0 never waits, -1 waits forever).
+// Returns EAGAIN (no wait) or ETIMEDOUT if nothing arrived, otherwise stores the number of
+// events read in num_events. The driver side signals the condition variable once per batch
+// rather than once per event, so a single wakeup should normally be followed by one call
+// to this function that drains everything pending
+int fmdriverif_read_events(unsigned long if_handle, struct fmdriver_event *events, int max_events,
+			   int timeout_ms, int *num_events);
+
+// Station state -- copies out the latest snapshot. The I/O worker publishes a new snapshot
+// whenever the frequency or an RDS field changes, and FM_EVENT_RDS is only posted when a
+// field's content has actually changed. Safe to call from any thread at any rate: it takes
+// no locks and the worker never waits for readers
+int fmdriverif_get_snapshot(unsigned long if_handle, struct fmdriver_snapshot *snapshot);
+
+// Frequency range the tuner can reach, in kHz. EAGAIN until the tuner has been up
+int fmdriverif_get_range(unsigned long if_handle, int *low_khz, int *high_khz);
+
+// Statistics -- safe to call from any thread while the interface is open. Counters are
+// kept without locks, so a copy taken while the interface is busy may be a few updates
+// out between one field and the next
+int fmdriverif_get_stats(unsigned long if_handle, struct fmdriver_stats *stats);
+
+// Multi-tuner manager -- serves any number of tuners from a small pool of worker threads
+// rather than a worker per tuner. A tuner with requests queued or RDS due takes a turn on
+// whichever worker picks it up; a worker with nothing of its own to run takes the oldest
+// tuner queued on another. num_workers of 0 gives a worker per core. Events from all of
+// the manager's tuners are read together with fmdriverif_manager_read_events, which works
+// like fmdriverif_read_events; the eventfd returned in event_fd_ptr is readable while any
+// of them are waiting, on the same terms as a pollable interface's
+int fmdriverif_manager_create(int num_workers, unsigned long *manager_ptr, int *event_fd_ptr);
+int fmdriverif_manager_destroy(unsigned long manager);
+
+// Opens a tuner under the manager. The handle takes requests and the other calls above as
+// usual, except that its events only come through the manager, and it stays open until
+// the manager is destroyed -- fmdriverif_close and fmdriverif_read_event(s) refuse it with
+// EBUSY. Requests are always async; the condition variable and pollable flag in params are
+// ignored. params may be NULL for the defaults. Returns EEXIST if the manager already has
+// the tuner
+int fmdriverif_manager_add(unsigned long manager, int tuner_id, const struct fmdriver_open_params *params,
+			   unsigned long *if_handle_ptr);
+
+int fmdriverif_manager_read_events(unsigned long manager, struct fmdriver_tuner_event *events, int max_events,
+				   int timeout_ms, int *num_events);
+int fmdriverif_manager_get_stats(unsigned long manager, struct fmdriver_manager_stats *stats);
+
 #endif
 
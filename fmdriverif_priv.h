@@ -0,0 +1,504 @@
+// File: fmdriverif_priv.h -- FM tuner driver userland interface internals
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#ifndef FMDRIVERIF_PRIV_H
+#define FMDRIVERIF_PRIV_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include "fmdriverif.h"
+#include "videodev.h"
+#include "eventring.h"
+#include "rdsdecoder.h"
+#include "fmtelemetry.h"
+
+// Event slots beyond the FIFO capacity, so the producer can build an event while the
+// FIFO is full without running the pool dry
+#define EVENT_POOL_HEADROOM	4
+
+// Kinds of event a coalescing FIFO keeps apart -- one per event id, except that each
+// RDS field is a kind of its own
+#define EVENT_KINDS		(FM_EVENT_RDS + RDS_FIELD_RT + 1)
+#define IFSTATE_GOOD		0xDCBAABCD
+#define MANAGER_GOOD		0xDCBAABCE
+
+// Requests waiting for the I/O worker -- submitting beyond this returns EBUSY
+#define REQUEST_QUEUE_CAPACITY	16
+
+// Device requests, queued by an async open and by hot-plug
+#define DEVICE_OPEN		1		// First open -- reported whether it works or not
+#define DEVICE_REATTACH		2		// Node (re)appeared -- only reported if it works
+#define DEVICE_DETACH		3		// Node went away
+
+// Interface setup stages, so a partly opened interface can be torn down
+#define IFSTAGE_FIFO		0x01
+#define IFSTAGE_POOL		0x02
+#define IFSTAGE_WAIT		0x04
+#define IFSTAGE_REQUESTS	0x08
+#define IFSTAGE_IO		0x10
+
+// RDS is read from the tuner between requests while a station is playing. Just after a
+// tune it is read every RDS_POLL_FAST_MS so the station names itself quickly, then every
+// RDS_POLL_MS while blocks come in cleanly. With no RDS, or too many bad blocks to decode,
+// the interval doubles up to RDS_POLL_MAX_MS -- well inside the 100 blocks (2 s) the
+// Si470x buffers, so nothing is lost when the station comes good
+#define RDS_POLL_MS		40
+#define RDS_POLL_FAST_MS	20
+#define RDS_POLL_FAST_POLLS	25		// Fast polls after each tune
+#define RDS_POLL_MAX_MS		1280
+#define RDS_POLL_BAD_PCT	25		// Bad blocks in a poll that count as no RDS
+#define RDS_READ_RECORDS	64		// V4L2 records taken per read
+
+// Scan tuning
+#define SCAN_SETTLE_US		2000		// Let the RSSI settle after each retune
+#define SCAN_SIGNAL_THRESHOLD	0x4000		// Weakest signal reported as a station
+#define SCAN_MAX_INTERFACES	10		// Open interfaces a scan can recruit from
+
+// Seek tuning -- defaults until fmdriverif_set_seek_params
+#define SEEK_SETTLE_US		SCAN_SETTLE_US
+#define SEEK_SIGNAL_THRESHOLD	SCAN_SIGNAL_THRESHOLD
+
+// Alternative frequencies -- defaults until fmdriverif_set_af_params. While a station with
+// an AF list plays, its signal is read every AF_CHECK_MS, and the RDS poll never backs off
+// further than that
+#define AF_SIGNAL_THRESHOLD	0x2000
+#define AF_HOLD_MS		3000		// After a search that found nothing
+#define AF_CHECK_MS		200
+#define AF_SETTLE_US		SCAN_SETTLE_US
+#define AF_VERIFY_MAX		3		// Alternatives whose PI is checked, strongest first
+#define AF_PI_WAIT_MS		400		// Longest wait for an alternative's PI
+#define AF_PI_POLL_MS		10
+#define AF_TABLE_SIZE		16		// Programmes remembered
+
+// Hot-plug -- tuner N is the node HOTPLUG_DIR/HOTPLUG_PREFIX<N>
+#define HOTPLUG_DIR		"/dev"
+#define HOTPLUG_PREFIX		"radio"
+#define HOTPLUG_MAX_INTERFACES	10		// Open interfaces watched for re-plugs
+
+struct scan_job;
+struct seek_job;
+struct fmdriverif_state;
+struct fmdriver_manager;
+
+// Alternative frequencies for one programme, as the tuner can reach them
+struct af_entry
+{
+	unsigned short pi;
+	int num_freqs;
+	int freqs_khz[RDS_AF_MAX];
+	unsigned long used;			// When last used, 0 for an empty entry
+};
+
+// Latency histogram, updated without locks. Each one has a single writer
+struct latency_stats
+{
+	atomic_ulong count;
+	atomic_ulong total_us;
+	atomic_ulong max_us;
+	atomic_ulong hist[FMDRIVER_LATENCY_BUCKETS];
+};
+
+// Tuner backend -- the V4L radio driver, or a simulated tuner so everything above it can be
+// run without the dongle. Calls follow the system call convention of returning -1 and
+// setting errno on failure, and are only made from the interface's I/O worker once the
+// interface is open
+struct fmdriver_backend
+{
+	const char *name;
+	int (*open)(struct fmdriverif_state *driver_state);	// Sets device_path from tuner_id
+	void (*close)(struct fmdriverif_state *driver_state);
+	int (*ioctl)(struct fmdriverif_state *driver_state, unsigned long request, void *arg);
+	// Reads whole V4L2 RDS records. Never blocks -- fails with EAGAIN if there are none
+	ssize_t (*read_rds)(struct fmdriverif_state *driver_state, unsigned char *records, size_t len);
+	// Tunes to the next station up or down the band, as found by the tuner itself
+	int (*seek)(struct fmdriverif_state *driver_state, bool seek_up, unsigned long *freq_units);
+	bool hotplug;				// Tuners are /dev nodes that come and go
+};
+
+extern const struct fmdriver_backend v4l_backend;
+extern const struct fmdriver_backend sim_backend;
+
+// Open interfaces that can be recruited to scan or seek for another, see scan_register
+extern struct fmdriverif_state *scan_interfaces[SCAN_MAX_INTERFACES];
+extern pthread_mutex_t scan_interfaces_mutex;
+
+// Completion for a request made on an interface opened without a condition variable
+struct request_waiter
+{
+	bool done;
+	int status;
+};
+
+// Latest event of one kind on a coalescing FIFO. The FIFO itself only carries a marker
+// per kind; the client picks up whatever is here when it reads the marker. Written under
+// a sequence count, odd while the worker is part way through
+struct event_latest
+{
+	atomic_uint seq;
+	atomic_bool pending;			// A marker for this kind is in the FIFO
+	struct fmdriver_event evt;
+};
+
+// Driver request -- the completion event id doubles as the request type
+struct fmdriver_request
+{
+	enum fmdriver_event_id type;
+	int arg;
+	struct request_waiter *waiter;		// Synchronous requests only
+	int superseded;				// Async requests collapsed into this one
+	struct scan_job *job;			// Share of another interface's scan, if set
+	struct seek_job *prefetch;		// Prefetch for another interface's seek, if set
+	int device;				// DEVICE_* for a device request, 0 otherwise
+};
+
+// A band sweep shared between the interface that asked for it (the owner) and any idle
+// interfaces it recruits. Channels are claimed one at a time, so a tuner that joins late
+// or runs slowly just ends up measuring fewer of them
+struct scan_job
+{
+	atomic_int refs;			// Owner plus helper requests still queued
+	atomic_int next_channel;		// Next channel to be claimed
+	atomic_int channels_measured;
+	atomic_int tuners_used;
+	atomic_bool cancel;
+	struct fmdriverif_state *owner;		// Identity only -- helpers never touch it
+	int region;
+	int first_khz;
+	int spacing_khz;
+	int num_channels;
+
+	// Once the owner runs out of channels it waits for helpers that are still measuring.
+	// Helpers that haven't started by then stay out of it
+	pthread_mutex_t mutex;
+	pthread_cond_t idle_cond;
+	bool finished;
+	int active;
+
+	struct fmdriver_station results[];	// One per channel, in frequency order
+};
+
+// Channel grid and stopping rule for a seek that sweeps the band itself
+struct seek_sweep
+{
+	int region;
+	int low_khz;				// Region's channel map
+	int high_khz;
+	int spacing_khz;
+	int signal_threshold;			// Weakest signal taken as a station
+	int settle_us;				// Wait after each retune before reading the signal
+};
+
+// Where the next stations either side of a seek's landing are. The owner fills in the one
+// it came from, and an idle interface it recruits sweeps for the rest in the background.
+// Stale as soon as the owner tunes anywhere else, at which point the helper gives up
+struct seek_job
+{
+	atomic_int refs;			// Owner plus the helper request while it is queued
+	atomic_bool cancel;			// Owner has moved on
+	int from_khz;				// Station the owner landed on
+	struct seek_sweep sweep;
+	atomic_int next_khz[2];			// Indexed by seek_up, 0 until found
+};
+
+// One manager worker and its run queue. The worker takes the tuner it queued most
+// recently, which is the one most likely to still be in cache; thieves take the oldest.
+// A tuner is only ever queued once, so the queue can't overflow
+struct manager_worker
+{
+	struct fmdriver_manager *manager;
+	pthread_t thread;
+	pthread_mutex_t mutex;			// Guards the run queue
+	struct fmdriverif_state *run_queue[FMDRIVER_MAX_TUNERS];
+	int head;				// Oldest queued tuner
+	int count;
+	atomic_ulong turns;
+	atomic_ulong steals;
+};
+
+// Multi-tuner manager. Lock order is a tuner's request mutex, then a run queue mutex,
+// then the manager mutex
+struct fmdriver_manager
+{
+	int sig;				// Magic number indicating struct is good
+	int event_fd;				// Shared by every tuner for client wakeups
+	int num_workers;
+	struct manager_worker workers[FMDRIVER_MAX_TUNERS];
+	atomic_uint next_worker;		// Round robin for tuners queued from outside the pool
+	atomic_int queued;			// Tuners sitting in run queues
+
+	pthread_mutex_t mutex;			// Guards everything below
+	pthread_cond_t work_cond;		// Signalled when a tuner is queued
+	pthread_cond_t timer_cond;		// Wakes the timekeeper
+	int idle;				// Workers waiting on work_cond
+	bool timekeeper;			// An idle worker is waiting for the next RDS poll
+	uint64_t timer_ns;			// ... due then, 0 if none is
+	bool shutdown;
+	struct fmdriverif_state *tuners[FMDRIVER_MAX_TUNERS];
+	int num_tuners;
+	int next_read;				// Tuner the next read starts from, for fairness
+};
+
+// Driver state definition
+struct fmdriverif_state
+{	
+	// The event ring leads the struct so its cache-line alignment does not pad out
+	// the fields below. Producer is the driver side, consumer is the interface client
+	struct eventring event_fifo;
+	// Free event slots. Runs the opposite way to the event FIFO: the client recycles
+	// slots into it and the driver side takes them out
+	struct eventring event_pool_free;
+
+	int sig;				// Magic number indicating struct is good
+	unsigned int init_stages;		// IFSTAGE_* flags for the parts set up so far
+	pthread_cond_t *cond;			// Interface client condition callback
+	int notify_fd;				// eventfd for pollable interfaces, -1 otherwise
+	int tuner_id;
+	const struct fmdriver_backend *backend;
+	void *backend_data;			// Backend's own per-tuner state
+	int tuner_fd;				// File system handle to tuner driver, V4L only
+	char device_path[64];			// Identifies the tuner, e.g. /dev/radio0
+
+	enum fmdriver_overflow overflow;	// What to do when the FIFO is full
+	struct fmdriver_event *event_pool;	// Preallocated event slots
+	int pool_size;				// FIFO capacity plus EVENT_POOL_HEADROOM
+	struct fmdriver_event *spare_event;	// Slot the driver side took back from the FIFO
+	atomic_ulong pool_exhausted;		// Events dropped because the pool was empty
+	atomic_ulong events_dropped;		// Events dropped or coalesced on a full fifo
+	struct event_latest *latest;		// EVENT_KINDS long when coalescing, NULL otherwise
+	atomic_int fifo_high_water;		// Written by the producer only
+	struct latency_stats enqueue_wait;
+
+	// Consumer wakeup. The client arms the FIFO when it finds it empty, and the driver
+	// side only signals when it sees the FIFO armed, so a burst of events costs one wakeup
+	atomic_bool consumer_armed;
+	pthread_mutex_t wait_mutex;		// Guards wait_cond for fmdriverif_read_events
+	pthread_cond_t wait_cond;
+
+	// Batching statistics
+	atomic_ulong notifications;
+	atomic_ulong read_batches;
+	atomic_ulong events_read;
+	atomic_ulong batch_size_hist[FMDRIVER_BATCH_BUCKETS];
+
+	// Driver I/O. Every ioctl is issued from a worker thread dedicated to this handle, so
+	// a slow USB control transfer never blocks the thread that made the request
+	pthread_t io_thread;
+	pthread_mutex_t request_mutex;		// Guards the request queue and io_shutdown
+	pthread_cond_t request_cond;		// Signalled when a request is submitted
+	pthread_cond_t complete_cond;		// Signalled when a synchronous request completes
+	struct fmdriver_request request_queue[REQUEST_QUEUE_CAPACITY];
+	int request_head;			// Next request to run
+	int request_count;
+	bool io_shutdown;
+	bool async;				// Requests return before they complete
+	struct fmdriver_manager *manager;	// Manager whose pool runs this tuner, or NULL
+	atomic_bool io_scheduled;		// Queued or running on the manager's pool
+	atomic_ullong io_due_ns;		// Next RDS poll on the pool, 0 if none
+	atomic_ulong tunes_coalesced;		// Tune requests superseded before they ran
+	atomic_ulong volumes_coalesced;		// Volume requests superseded before they ran
+	struct latency_stats op_latency[FMDRIVER_OPS];
+
+	// Tuner state -- owned by the I/O worker once the interface is open
+	atomic_bool device_up;			// Device is open -- drops when it is unplugged
+	struct video_tuner tuner_info;
+	struct video_audio aud_info;
+	enum fmdriver_power_state power_state;
+	bool client_active;			// Client has tuned or powered on, and not powered off
+	int freq_khz;				// Last frequency tuned, 0 if none
+	int range_low_khz;			// Tuner range, set the first time the device is up
+	int range_high_khz;
+	struct fmdriver_channel_map channel_maps[FM_REGIONS];	// Built along with the range
+	atomic_bool range_known;		// Range and maps are set, for readers on other threads
+
+	// RDS, decoded on the I/O worker
+	struct rds_decoder rds;
+	struct timespec rds_next_poll;		// CLOCK_MONOTONIC
+	int rds_fast_polls;			// Left at RDS_POLL_FAST_MS since the tune
+	atomic_int rds_poll_ms;			// Current interval, see rds_schedule
+	atomic_ulong rds_polls;			// Reads of the driver's RDS buffer
+	atomic_ulong rds_polled_ms;		// Time those reads covered
+	atomic_ulong rds_blocks;		// Decoder statistics, copied out for readers
+	atomic_ulong rds_blocks_corrected;
+	atomic_ulong rds_blocks_bad;
+	atomic_ulong rds_groups;
+
+	// Station state for readers on other threads. The worker fills in the buffer that
+	// isn't current, then bumps the sequence to publish it. Readers copy the current
+	// buffer and only go round again if a publish lands while they are copying
+	struct fmdriver_snapshot snapshots[2];
+	_Alignas(EVENTRING_CACHE_LINE) atomic_uint snapshot_seq;
+
+	// Scanning. Switching region is a store here -- it picks the channel map scans, seeks
+	// and the station table go by
+	atomic_int region;			// enum fm_region
+	atomic_bool scan_cancel;		// Stop the scan in progress
+	atomic_bool lendable;			// Free to help another interface's scan -- see io_update_lendable
+	struct fmdriver_station stations[FM_REGIONS][FMDRIVER_MAX_STATIONS];	// Last scan in each region,
+	int num_stations[FM_REGIONS];		// guarded by request_mutex
+
+	// Seeking
+	atomic_int seek_threshold;		// See struct seek_sweep
+	atomic_int seek_settle_us;
+	atomic_bool seek_cancel;		// Stop the seek sweep in progress
+	struct seek_job *seek_cache;		// Last landing's neighbours, owned by the I/O worker
+	atomic_ulong seeks;
+	atomic_ulong seeks_cached;		// Answered with one tune, without a sweep
+
+	// Alternative frequencies, by PI. The table and the times belong to the I/O worker
+	struct af_entry af_table[AF_TABLE_SIZE];
+	unsigned long af_clock;			// Ticks with every use, for replacing entries
+	uint64_t af_next_check_ns;		// CLOCK_MONOTONIC
+	atomic_int af_threshold;		// 0 for off
+	atomic_int af_hold_ms;
+	atomic_ulong af_checks;
+	atomic_ulong af_switches;
+	struct latency_stats af_retune;
+
+	// Telemetry. The ring is mapped once, by fmdriverif_set_telemetry, and stays until the
+	// interface is closed. Samples are taken on the I/O worker
+	_Atomic(struct fmtelemetry_ring *) telemetry;
+	int telemetry_fd;			// Held open and locked while we are the writer
+	uint64_t telemetry_last_ns;		// CLOCK_MONOTONIC, owned by the worker
+	uint64_t rds_last_group_ns;		// Last RDS poll that decoded a group
+	atomic_ulong telemetry_samples;
+};
+
+
+// Event pool functions
+int pool_init(struct fmdriverif_state *driver_state);
+int pool_destroy(struct fmdriverif_state *driver_state);
+struct fmdriver_event *pool_alloc_event(struct fmdriverif_state *driver_state);
+
+// FIFO functions
+int fifo_enqueue(struct fmdriverif_state *driver_state, struct fmdriver_event *evt);
+int fifo_dequeue(struct fmdriverif_state *driver_state, struct fmdriver_event *evt);
+int fifo_dequeue_batch(struct fmdriverif_state *driver_state, struct fmdriver_event *events, int max_events);
+int fifo_clear(struct fmdriverif_state *driver_state);
+bool fifo_arm(struct fmdriverif_state *driver_state);
+int fifo_notify(struct fmdriverif_state *driver_state);
+int fifo_post_event(struct fmdriverif_state *driver_state, enum fmdriver_event_id event_id,
+		    int status_code, const void *data, int data_len);
+int fifo_event_kind(const struct fmdriver_event *evt);
+bool fifo_coalesce(struct fmdriverif_state *driver_state, struct fmdriver_event *evt);
+void fifo_read_latest(struct fmdriverif_state *driver_state, struct fmdriver_event *evt);
+
+// Statistics
+uint64_t stats_now_ns(void);
+void timespec_add_ms(struct timespec *ts, int ms);
+uint64_t timespec_ns(const struct timespec *ts);
+void timespec_from_ns(struct timespec *ts, uint64_t ns);
+void latency_init(struct latency_stats *stats);
+void latency_record(struct latency_stats *stats, uint64_t elapsed_ns);
+void latency_read(struct latency_stats *stats, struct fmdriver_latency *latency);
+
+// Driver I/O
+int driver_ioctl(struct fmdriverif_state *driver_state, unsigned long request, void *arg);
+ssize_t driver_read_rds(struct fmdriverif_state *driver_state, unsigned char *records, size_t len);
+int driver_seek(struct fmdriverif_state *driver_state, bool seek_up, unsigned long *freq_units);
+unsigned long khz_to_tuner_units(struct fmdriverif_state *driver_state, int freq_khz);
+int tuner_units_to_khz(struct fmdriverif_state *driver_state, unsigned long freq_units);
+int request_tune(struct fmdriverif_state *driver_state, int freq_khz, struct fmdriver_tune_data *tune_data);
+int request_volume(struct fmdriverif_state *driver_state, int vol_level);
+int request_power(struct fmdriverif_state *driver_state, enum fmdriver_power_state req_state);
+int request_seek(struct fmdriverif_state *driver_state, bool seek_up, struct fmdriver_tune_data *tune_data);
+int report_station(struct fmdriverif_state *driver_state, int freq_khz, struct fmdriver_tune_data *tune_data);
+void report_tune_data(struct fmdriverif_state *driver_state, int freq_khz, struct fmdriver_tune_data *tune_data);
+int execute_request(struct fmdriverif_state *driver_state, struct fmdriver_request *req,
+		    void *data, int *data_len);
+struct fmdriver_snapshot *snapshot_begin(struct fmdriverif_state *driver_state);
+void snapshot_publish(struct fmdriverif_state *driver_state);
+void snapshot_tuned(struct fmdriverif_state *driver_state, struct fmdriver_tune_data *tune_data);
+bool rds_active(struct fmdriverif_state *driver_state);
+void rds_emit_event(void *context, const struct rds_data *field);
+int rds_poll(struct fmdriverif_state *driver_state);
+int rds_discard(struct fmdriverif_state *driver_state);
+void rds_schedule_reset(struct fmdriverif_state *driver_state);
+void rds_schedule(struct fmdriverif_state *driver_state, unsigned long blocks, unsigned long blocks_bad);
+uint64_t io_timer_due(struct fmdriverif_state *driver_state);
+void io_timer_run(struct fmdriverif_state *driver_state);
+void *io_worker(void *arg);
+void io_run_request(struct fmdriverif_state *driver_state);
+void io_cancel_requests(struct fmdriverif_state *driver_state);
+void io_wake(struct fmdriverif_state *driver_state);
+void io_update_lendable(struct fmdriverif_state *driver_state);
+bool io_interrupted(struct fmdriverif_state *driver_state);
+int submit_device_request(struct fmdriverif_state *driver_state, int device);
+int device_attach(struct fmdriverif_state *driver_state, bool restore);
+void device_detach(struct fmdriverif_state *driver_state, int reason);
+void device_request(struct fmdriverif_state *driver_state, int device);
+void device_attached(struct fmdriverif_state *driver_state);
+struct fmdriver_request *find_coalescable(struct fmdriverif_state *driver_state, enum fmdriver_event_id type);
+int submit_request(unsigned long if_handle, enum fmdriver_event_id type, int arg);
+
+// Scan engine
+void scan_register(struct fmdriverif_state *driver_state);
+void scan_unregister(struct fmdriverif_state *driver_state);
+struct scan_job *scan_job_create(struct fmdriverif_state *driver_state, int *ret_ptr);
+void scan_job_release(struct scan_job *job);
+void region_maps_build(struct fmdriverif_state *driver_state);
+const struct fmdriver_channel_map *region_map(struct fmdriverif_state *driver_state, int *ret_ptr);
+int scan_measure(struct fmdriverif_state *driver_state, int freq_khz, int settle_us, struct fmdriver_station *result);
+void scan_channels(struct fmdriverif_state *driver_state, struct scan_job *job);
+int scan_restore(struct fmdriverif_state *driver_state);
+int scan_recruit_helpers(struct fmdriverif_state *driver_state, struct scan_job *job);
+void scan_helper(struct fmdriverif_state *driver_state, struct scan_job *job);
+int scan_build_table(struct scan_job *job, struct fmdriver_station *stations, int max_stations);
+int scan_band(struct fmdriverif_state *driver_state, struct fmdriver_scan_data *scan_data);
+
+// Seek engine
+int seek_station(struct fmdriverif_state *driver_state, bool seek_up, struct fmdriver_tune_data *tune_data);
+int seek_from_table(struct fmdriverif_state *driver_state, bool seek_up);
+int seek_from_cache(struct fmdriverif_state *driver_state, bool seek_up);
+int seek_sweep_init(struct fmdriverif_state *driver_state, struct seek_sweep *sweep);
+int seek_sweep(struct fmdriverif_state *driver_state, const struct seek_sweep *sweep, int from_khz, bool seek_up,
+	       atomic_bool *cancel, struct fmdriver_station *found);
+void seek_landed(struct fmdriverif_state *driver_state, int from_khz, bool from_station, bool seek_up);
+void seek_cache_drop(struct fmdriverif_state *driver_state);
+bool seek_recruit_helper(struct fmdriverif_state *driver_state, struct seek_job *job);
+void seek_helper(struct fmdriverif_state *driver_state, struct seek_job *job);
+void seek_job_release(struct seek_job *job);
+
+// Alternative frequencies
+void af_update(struct fmdriverif_state *driver_state, const struct rds_data *field);
+struct af_entry *af_lookup(struct fmdriverif_state *driver_state, unsigned short pi);
+struct af_entry *af_current(struct fmdriverif_state *driver_state);
+void af_monitor(struct fmdriverif_state *driver_state);
+int af_retune(struct fmdriverif_state *driver_state, const struct af_entry *entry, int signal);
+int af_check_pi(struct fmdriverif_state *driver_state, int freq_khz, unsigned short pi);
+
+// Telemetry
+int telemetry_start(struct fmdriverif_state *driver_state, int interval_ms);
+void telemetry_close(struct fmdriverif_state *driver_state);
+bool telemetry_active(struct fmdriverif_state *driver_state);
+uint64_t telemetry_due_ns(struct fmdriverif_state *driver_state);
+void telemetry_sample(struct fmdriverif_state *driver_state);
+
+// Multi-tuner manager
+void manager_schedule(struct fmdriver_manager *manager, struct fmdriverif_state *driver_state);
+void manager_notify(struct fmdriver_manager *manager);
+struct fmdriverif_state *manager_take(struct fmdriver_manager *manager, struct manager_worker *self);
+bool manager_idle(struct fmdriver_manager *manager);
+void manager_service(struct fmdriver_manager *manager, struct fmdriverif_state *driver_state);
+void manager_timer_update(struct fmdriver_manager *manager, uint64_t due_ns);
+void *manager_worker(void *arg);
+
+// Backends
+const struct fmdriver_backend *backend_select(void);
+
+// Hot-plug
+void hotplug_register(struct fmdriverif_state *driver_state);
+void hotplug_unregister(struct fmdriverif_state *driver_state);
+
+// Interface setup
+int init_interface(struct fmdriverif_state *driver_state, const struct fmdriver_open_params *params);
+int teardown_interface(struct fmdriverif_state *driver_state);
+int open_interface(int tuner_id, const struct fmdriver_open_params *params, struct fmdriver_manager *manager,
+		   unsigned long *if_handle_ptr);
+
+#endif
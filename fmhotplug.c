@@ -0,0 +1,236 @@
+// File: fmhotplug.c -- reconnects tuners that are unplugged and plugged back in
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include "fmdriverif_priv.h"
+
+// Room for a batch of node events in one read
+#define HOTPLUG_BUF_SIZE	(16 * (sizeof(struct inotify_event) + 32))
+
+// Private functions
+int hotplug_start(void);
+void hotplug_stop(void);
+void *hotplug_watcher(void *arg);
+void hotplug_dispatch(const struct inotify_event *node_event);
+
+// Interfaces that are open on a hot-pluggable backend
+struct fmdriverif_state *hotplug_interfaces[HOTPLUG_MAX_INTERFACES];
+int hotplug_count;
+pthread_mutex_t hotplug_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The watcher runs while anything is registered. Starting and stopping it is serialized
+// apart from the registry, so it can take hotplug_mutex while it is being joined
+pthread_mutex_t hotplug_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_t hotplug_thread;
+int hotplug_notify_fd = -1;
+int hotplug_stop_fd = -1;
+
+void hotplug_register(struct fmdriverif_state *driver_state)
+{
+	bool first = false, added = false;
+	int i;
+
+	pthread_mutex_lock(&hotplug_thread_mutex);
+
+	// A full registry only means this interface isn't reconnected after a re-plug
+	pthread_mutex_lock(&hotplug_mutex);
+	for (i = 0; i < HOTPLUG_MAX_INTERFACES; i++)
+	{
+		if (hotplug_interfaces[i] == NULL)
+		{
+			hotplug_interfaces[i] = driver_state;
+			first = (hotplug_count == 0);
+			hotplug_count++;
+			added = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	if (added && first && hotplug_start() != 0)
+	{
+		pthread_mutex_lock(&hotplug_mutex);
+		hotplug_interfaces[i] = NULL;
+		hotplug_count--;
+		pthread_mutex_unlock(&hotplug_mutex);
+	}
+
+	pthread_mutex_unlock(&hotplug_thread_mutex);
+}
+
+void hotplug_unregister(struct fmdriverif_state *driver_state)
+{
+	bool last = false;
+	int i;
+
+	pthread_mutex_lock(&hotplug_thread_mutex);
+
+	pthread_mutex_lock(&hotplug_mutex);
+	for (i = 0; i < HOTPLUG_MAX_INTERFACES; i++)
+	{
+		if (hotplug_interfaces[i] == driver_state)
+		{
+			hotplug_interfaces[i] = NULL;
+			hotplug_count--;
+			last = (hotplug_count == 0);
+		}
+	}
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	if (last)
+	{
+		hotplug_stop();
+	}
+
+	pthread_mutex_unlock(&hotplug_thread_mutex);
+}
+
+int hotplug_start(void)
+{
+	int ret;
+
+	hotplug_notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (hotplug_notify_fd < 0)
+	{
+		ret = errno;
+		perror("hotplug_start() -- failed to create inotify instance");
+		return ret;
+	}
+
+	if (inotify_add_watch(hotplug_notify_fd, HOTPLUG_DIR, IN_CREATE | IN_ATTRIB | IN_DELETE) < 0)
+	{
+		ret = errno;
+		perror("hotplug_start() -- failed to watch device directory");
+		close(hotplug_notify_fd);
+		hotplug_notify_fd = -1;
+		return ret;
+	}
+
+	hotplug_stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (hotplug_stop_fd < 0)
+	{
+		ret = errno;
+		perror("hotplug_start() -- failed to create stop eventfd");
+		close(hotplug_notify_fd);
+		hotplug_notify_fd = -1;
+		return ret;
+	}
+
+	ret = pthread_create(&hotplug_thread, NULL, hotplug_watcher, NULL);
+	if (ret != 0)
+	{
+		fprintf(stderr, "hotplug_start() -- failed to create watcher thread %d\n", ret);
+		close(hotplug_stop_fd);
+		close(hotplug_notify_fd);
+		hotplug_stop_fd = -1;
+		hotplug_notify_fd = -1;
+		return ret;
+	}
+
+	return 0;
+}
+
+void hotplug_stop(void)
+{
+	uint64_t one = 1;
+
+	if (hotplug_stop_fd < 0)
+		return;
+
+	if (write(hotplug_stop_fd, &one, sizeof(one)) != sizeof(one))
+	{
+		perror("hotplug_stop() -- failed to signal watcher thread");
+	}
+	pthread_join(hotplug_thread, NULL);
+
+	close(hotplug_stop_fd);
+	close(hotplug_notify_fd);
+	hotplug_stop_fd = -1;
+	hotplug_notify_fd = -1;
+}
+
+void *hotplug_watcher(void *arg)
+{
+	char buf[HOTPLUG_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *node_event;
+	struct pollfd poll_fds[2];
+	ssize_t len;
+	char *pos;
+
+	poll_fds[0].fd = hotplug_notify_fd;
+	poll_fds[0].events = POLLIN;
+	poll_fds[1].fd = hotplug_stop_fd;
+	poll_fds[1].events = POLLIN;
+
+	for (;;)
+	{
+		if (poll(poll_fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("hotplug_watcher() -- poll failed");
+			break;
+		}
+
+		if (poll_fds[1].revents & POLLIN)
+			break;
+
+		len = read(hotplug_notify_fd, buf, sizeof(buf));
+		if (len <= 0)
+			continue;
+
+		for (pos = buf; pos < buf + len; pos += sizeof(struct inotify_event) + node_event->len)
+		{
+			node_event = (const struct inotify_event *)pos;
+			hotplug_dispatch(node_event);
+		}
+	}
+
+	return NULL;
+}
+
+void hotplug_dispatch(const struct inotify_event *node_event)
+{
+	struct fmdriverif_state *driver_state;
+	const char *num;
+	char *end;
+	long tuner_id;
+	int device, i;
+
+	// Only radio<N> nodes are tuners
+	if (node_event->len == 0 || strncmp(node_event->name, HOTPLUG_PREFIX, strlen(HOTPLUG_PREFIX)) != 0)
+		return;
+	num = node_event->name + strlen(HOTPLUG_PREFIX);
+	tuner_id = strtol(num, &end, 10);
+	if (end == num || *end != '\0')
+		return;
+
+	// udev creates the node and then sets its permissions, so either can be the moment
+	// it can be opened
+	device = (node_event->mask & IN_DELETE) ? DEVICE_DETACH : DEVICE_REATTACH;
+
+	// The I/O workers do the reconnect. Interfaces are unregistered before they shut
+	// down, so none can go away while we hold the registry lock
+	pthread_mutex_lock(&hotplug_mutex);
+	for (i = 0; i < HOTPLUG_MAX_INTERFACES; i++)
+	{
+		driver_state = hotplug_interfaces[i];
+		if (driver_state != NULL && driver_state->tuner_id == tuner_id)
+		{
+			submit_device_request(driver_state, device);
+		}
+	}
+	pthread_mutex_unlock(&hotplug_mutex);
+}
+
+// end of file
@@ -0,0 +1,612 @@
+// File: fmmanager.c -- multi-tuner manager, many tuners served by one worker pool
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "fmdriverif_priv.h"
+
+// Private functions
+uint64_t manager_timespec_ns(const struct timespec *ts);
+int manager_stop(struct fmdriver_manager *manager);
+
+// Worker the calling thread belongs to, NULL off the pool
+_Thread_local struct manager_worker *manager_current;
+
+uint64_t manager_timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+void manager_schedule(struct fmdriver_manager *manager, struct fmdriverif_state *driver_state)
+{
+	struct manager_worker *worker;
+	int ret;
+
+	// Already queued or running. A running tuner looks at its queue again before it
+	// gives up its turn, so whatever was just submitted won't be missed
+	if (atomic_exchange_explicit(&(driver_state->io_scheduled), true, memory_order_acq_rel))
+		return;
+
+	// Work scheduled from the pool stays on the worker that scheduled it, where it can
+	// be stolen if that worker is busy. Anything else is dealt out round robin
+	worker = manager_current;
+	if (worker == NULL || worker->manager != manager)
+	{
+		worker = &(manager->workers[atomic_fetch_add_explicit(&(manager->next_worker), 1, memory_order_relaxed) %
+					    manager->num_workers]);
+	}
+
+	pthread_mutex_lock(&(worker->mutex));
+	worker->run_queue[(worker->head + worker->count) % FMDRIVER_MAX_TUNERS] = driver_state;
+	worker->count++;
+	pthread_mutex_unlock(&(worker->mutex));
+	atomic_fetch_add_explicit(&(manager->queued), 1, memory_order_release);
+
+	// Idle workers check the queued count under the manager mutex before they wait, so
+	// taking it here means the wakeup can't fall between the check and the wait
+	ret = pthread_mutex_lock(&(manager->mutex));
+	if (ret != 0)
+	{
+		fprintf(stderr, "manager_schedule() -- failed on pthread_mutex_lock %d\n", ret);
+		return;
+	}
+	if (manager->idle > 0)
+	{
+		pthread_cond_signal(&(manager->work_cond));
+	}
+	else if (manager->timekeeper)
+	{
+		pthread_cond_signal(&(manager->timer_cond));
+	}
+	pthread_mutex_unlock(&(manager->mutex));
+}
+
+void manager_notify(struct fmdriver_manager *manager)
+{
+	uint64_t count = 1;
+
+	if (write(manager->event_fd, &count, sizeof(count)) < 0)
+	{
+		perror("manager_notify() -- failed to write event fd");
+	}
+}
+
+struct fmdriverif_state *manager_take(struct fmdriver_manager *manager, struct manager_worker *self)
+{
+	struct fmdriverif_state *driver_state = NULL;
+	struct manager_worker *victim;
+	int i;
+
+	if (atomic_load_explicit(&(manager->queued), memory_order_acquire) == 0)
+		return NULL;
+
+	// Newest of our own first
+	pthread_mutex_lock(&(self->mutex));
+	if (self->count > 0)
+	{
+		self->count--;
+		driver_state = self->run_queue[(self->head + self->count) % FMDRIVER_MAX_TUNERS];
+	}
+	pthread_mutex_unlock(&(self->mutex));
+
+	// Then the oldest of anyone else's, starting with our neighbour so thieves spread out
+	for (i = 1; driver_state == NULL && i < manager->num_workers; i++)
+	{
+		victim = &(manager->workers[(self - manager->workers + i) % manager->num_workers]);
+		pthread_mutex_lock(&(victim->mutex));
+		if (victim->count > 0)
+		{
+			driver_state = victim->run_queue[victim->head];
+			victim->head = (victim->head + 1) % FMDRIVER_MAX_TUNERS;
+			victim->count--;
+			atomic_fetch_add_explicit(&(self->steals), 1, memory_order_relaxed);
+		}
+		pthread_mutex_unlock(&(victim->mutex));
+	}
+
+	if (driver_state != NULL)
+	{
+		atomic_fetch_sub_explicit(&(manager->queued), 1, memory_order_relaxed);
+	}
+
+	return driver_state;
+}
+
+bool manager_idle(struct fmdriver_manager *manager)
+{
+	struct fmdriverif_state *due[FMDRIVER_MAX_TUNERS];
+	struct timespec deadline;
+	uint64_t now, due_ns, next_ns = 0;
+	int num_due = 0, i;
+
+	pthread_mutex_lock(&(manager->mutex));
+	if (manager->shutdown)
+	{
+		pthread_mutex_unlock(&(manager->mutex));
+		return false;
+	}
+	if (atomic_load_explicit(&(manager->queued), memory_order_acquire) > 0)
+	{
+		pthread_mutex_unlock(&(manager->mutex));
+		return true;
+	}
+
+	// Someone is already keeping time, so wait for work
+	if (manager->timekeeper)
+	{
+		manager->idle++;
+		pthread_cond_wait(&(manager->work_cond), &(manager->mutex));
+		manager->idle--;
+		pthread_mutex_unlock(&(manager->mutex));
+		return true;
+	}
+
+	// We keep time. Queue any tuner whose RDS poll is due, and find the next one. A tuner
+	// that is already queued or running sets its next poll time when its turn ends
+	now = stats_now_ns();
+	for (i = 0; i < manager->num_tuners; i++)
+	{
+		due_ns = atomic_load_explicit(&(manager->tuners[i]->io_due_ns), memory_order_relaxed);
+		if (due_ns == 0 || atomic_load_explicit(&(manager->tuners[i]->io_scheduled), memory_order_acquire))
+			continue;
+		if (due_ns <= now)
+		{
+			due[num_due++] = manager->tuners[i];
+		}
+		else if (next_ns == 0 || due_ns < next_ns)
+		{
+			next_ns = due_ns;
+		}
+	}
+
+	if (num_due > 0)
+	{
+		pthread_mutex_unlock(&(manager->mutex));
+		for (i = 0; i < num_due; i++)
+		{
+			manager_schedule(manager, due[i]);
+		}
+		return true;
+	}
+
+	manager->timekeeper = true;
+	manager->timer_ns = next_ns;
+	if (next_ns == 0)
+	{
+		pthread_cond_wait(&(manager->timer_cond), &(manager->mutex));
+	}
+	else
+	{
+		deadline.tv_sec = next_ns / 1000000000ULL;
+		deadline.tv_nsec = next_ns % 1000000000ULL;
+		pthread_cond_timedwait(&(manager->timer_cond), &(manager->mutex), &deadline);
+	}
+	manager->timekeeper = false;
+
+	// If we go off to run something, another idle worker takes over the clock
+	if (manager->idle > 0)
+	{
+		pthread_cond_signal(&(manager->work_cond));
+	}
+	pthread_mutex_unlock(&(manager->mutex));
+
+	return true;
+}
+
+void manager_service(struct fmdriver_manager *manager, struct fmdriverif_state *driver_state)
+{
+	struct timespec now;
+	uint64_t due_ns;
+
+	pthread_mutex_lock(&(driver_state->request_mutex));
+	for (;;)
+	{
+		// Run everything queued, then read RDS or sample telemetry if due. Whatever gets submitted
+		// while the lock is dropped is picked up on the next time round
+		while (!driver_state->io_shutdown && driver_state->request_count > 0)
+		{
+			io_run_request(driver_state);
+			io_update_lendable(driver_state);
+		}
+
+		due_ns = driver_state->io_shutdown ? 0 : io_timer_due(driver_state);
+		if (due_ns != 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (manager_timespec_ns(&now) >= due_ns)
+			{
+				pthread_mutex_unlock(&(driver_state->request_mutex));
+				io_timer_run(driver_state);
+				pthread_mutex_lock(&(driver_state->request_mutex));
+				continue;
+			}
+		}
+		break;
+	}
+
+	// Give up the turn with the queue empty and the lock held, so a submit either lands
+	// before this and was run, or after it and schedules the tuner again
+	atomic_store_explicit(&(driver_state->io_due_ns), due_ns, memory_order_relaxed);
+	atomic_store_explicit(&(driver_state->io_scheduled), false, memory_order_release);
+	pthread_mutex_unlock(&(driver_state->request_mutex));
+
+	atomic_fetch_add_explicit(&(manager_current->turns), 1, memory_order_relaxed);
+	manager_timer_update(manager, due_ns);
+}
+
+void manager_timer_update(struct fmdriver_manager *manager, uint64_t due_ns)
+{
+	if (due_ns == 0)
+		return;
+
+	// Only the timekeeper needs to know, and only if the poll is sooner than its wait
+	pthread_mutex_lock(&(manager->mutex));
+	if (manager->timekeeper && (manager->timer_ns == 0 || due_ns < manager->timer_ns))
+	{
+		manager->timer_ns = due_ns;
+		pthread_cond_signal(&(manager->timer_cond));
+	}
+	pthread_mutex_unlock(&(manager->mutex));
+}
+
+void *manager_worker(void *arg)
+{
+	struct manager_worker *self = (struct manager_worker *)arg;
+	struct fmdriver_manager *manager = self->manager;
+	struct fmdriverif_state *driver_state;
+
+	manager_current = self;
+
+	for (;;)
+	{
+		driver_state = manager_take(manager, self);
+		if (driver_state != NULL)
+		{
+			manager_service(manager, driver_state);
+		}
+		else if (!manager_idle(manager))
+		{
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+int manager_stop(struct fmdriver_manager *manager)
+{
+	struct fmdriverif_state *driver_state;
+	int i;
+
+	// Stop the tuners first. Clearing a fifo releases a worker blocked posting to it
+	for (i = 0; i < manager->num_tuners; i++)
+	{
+		driver_state = manager->tuners[i];
+		scan_unregister(driver_state);
+		hotplug_unregister(driver_state);
+		atomic_store_explicit(&(driver_state->scan_cancel), true, memory_order_relaxed);
+		pthread_mutex_lock(&(driver_state->request_mutex));
+		driver_state->io_shutdown = true;
+		pthread_mutex_unlock(&(driver_state->request_mutex));
+		fifo_clear(driver_state);
+	}
+
+	// Then the pool. Workers finish the turn they are on
+	pthread_mutex_lock(&(manager->mutex));
+	manager->shutdown = true;
+	pthread_cond_broadcast(&(manager->work_cond));
+	pthread_cond_broadcast(&(manager->timer_cond));
+	pthread_mutex_unlock(&(manager->mutex));
+
+	for (i = 0; i < manager->num_workers; i++)
+	{
+		pthread_join(manager->workers[i].thread, NULL);
+	}
+
+	// Nothing runs the tuners now, so fail whatever they still have queued and close them
+	for (i = 0; i < manager->num_tuners; i++)
+	{
+		driver_state = manager->tuners[i];
+		pthread_mutex_lock(&(driver_state->request_mutex));
+		io_cancel_requests(driver_state);
+		pthread_mutex_unlock(&(driver_state->request_mutex));
+		teardown_interface(driver_state);
+	}
+	manager->num_tuners = 0;
+
+	return 0;
+}
+
+int fmdriverif_manager_create(int num_workers, unsigned long *manager_ptr, int *event_fd_ptr)
+{
+	struct fmdriver_manager *manager;
+	long cores;
+	int ret, i;
+
+	if (manager_ptr == NULL || num_workers < 0 || num_workers > FMDRIVER_MAX_TUNERS)
+		return EINVAL;
+
+	*manager_ptr = 0;
+	if (event_fd_ptr != NULL)
+	{
+		*event_fd_ptr = -1;
+	}
+
+	// A worker per core by default. More than one per tuner would never have anything to do
+	if (num_workers == 0)
+	{
+		cores = sysconf(_SC_NPROCESSORS_ONLN);
+		num_workers = (cores < 1) ? 1 : (cores > FMDRIVER_MAX_TUNERS) ? FMDRIVER_MAX_TUNERS : (int)cores;
+	}
+
+	manager = (struct fmdriver_manager *)calloc(1, sizeof(struct fmdriver_manager));
+	if (manager == NULL)
+	{
+		perror("fmdriverif_manager_create() -- failed to allocate manager");
+		return ENOMEM;
+	}
+
+	manager->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (manager->event_fd < 0)
+	{
+		ret = errno;
+		perror("fmdriverif_manager_create() -- failed to create event fd");
+		free(manager);
+		return ret;
+	}
+
+	atomic_init(&(manager->next_worker), 0);
+	atomic_init(&(manager->queued), 0);
+	pthread_mutex_init(&(manager->mutex), NULL);
+	pthread_cond_init(&(manager->work_cond), NULL);
+
+	// The timekeeper waits for absolute RDS poll times on the monotonic clock
+	{
+		pthread_condattr_t cond_attr;
+
+		pthread_condattr_init(&cond_attr);
+		pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&(manager->timer_cond), &cond_attr);
+		pthread_condattr_destroy(&cond_attr);
+	}
+
+	for (i = 0; i < FMDRIVER_MAX_TUNERS; i++)
+	{
+		manager->workers[i].manager = manager;
+		pthread_mutex_init(&(manager->workers[i].mutex), NULL);
+		atomic_init(&(manager->workers[i].turns), 0);
+		atomic_init(&(manager->workers[i].steals), 0);
+	}
+
+	// Start the pool
+	for (i = 0; i < num_workers; i++)
+	{
+		ret = pthread_create(&(manager->workers[i].thread), NULL, manager_worker, &(manager->workers[i]));
+		if (ret != 0)
+		{
+			fprintf(stderr, "fmdriverif_manager_create() -- failed to start worker %d\n", ret);
+			break;
+		}
+		manager->num_workers++;
+	}
+	if (manager->num_workers == 0)
+	{
+		pthread_cond_destroy(&(manager->timer_cond));
+		pthread_cond_destroy(&(manager->work_cond));
+		pthread_mutex_destroy(&(manager->mutex));
+		close(manager->event_fd);
+		free(manager);
+		return ret;
+	}
+
+	manager->sig = MANAGER_GOOD;
+
+	*manager_ptr = (unsigned long)manager;
+	if (event_fd_ptr != NULL)
+	{
+		*event_fd_ptr = manager->event_fd;
+	}
+
+	return 0;
+}
+
+int fmdriverif_manager_destroy(unsigned long manager_handle)
+{
+	struct fmdriver_manager *manager = (struct fmdriver_manager *)manager_handle;
+	int i;
+
+	if (manager == NULL || manager->sig != MANAGER_GOOD)
+		return EINVAL;
+
+	manager_stop(manager);
+
+	for (i = 0; i < FMDRIVER_MAX_TUNERS; i++)
+	{
+		pthread_mutex_destroy(&(manager->workers[i].mutex));
+	}
+	pthread_cond_destroy(&(manager->timer_cond));
+	pthread_cond_destroy(&(manager->work_cond));
+	pthread_mutex_destroy(&(manager->mutex));
+	close(manager->event_fd);
+
+	// Invalidate the sig so a stale handle is rejected
+	manager->sig = 0;
+	free(manager);
+
+	return 0;
+}
+
+int fmdriverif_manager_add(unsigned long manager_handle, int tuner_id, const struct fmdriver_open_params *params,
+			   unsigned long *if_handle_ptr)
+{
+	struct fmdriver_manager *manager = (struct fmdriver_manager *)manager_handle;
+	struct fmdriver_open_params tuner_params;
+	unsigned long if_handle;
+	int ret = 0, i;
+
+	if (manager == NULL || manager->sig != MANAGER_GOOD || if_handle_ptr == NULL)
+		return EINVAL;
+
+	*if_handle_ptr = 0;
+
+	// Wakeups go through the manager, never to a client of the tuner's own
+	memset(&tuner_params, 0, sizeof(tuner_params));
+	if (params != NULL)
+	{
+		tuner_params = *params;
+		tuner_params.callback_cond = NULL;
+		tuner_params.pollable = false;
+	}
+
+	// Opening can take a while on real hardware, so it happens outside the manager lock
+	// and the tuner list is checked again afterwards
+	pthread_mutex_lock(&(manager->mutex));
+	for (i = 0; i < manager->num_tuners; i++)
+	{
+		if (manager->tuners[i]->tuner_id == tuner_id)
+			ret = EEXIST;
+	}
+	pthread_mutex_unlock(&(manager->mutex));
+	if (ret != 0)
+		return ret;
+
+	ret = open_interface(tuner_id, &tuner_params, manager, &if_handle);
+	if (ret != 0)
+		return ret;
+
+	pthread_mutex_lock(&(manager->mutex));
+	for (i = 0; i < manager->num_tuners; i++)
+	{
+		if (manager->tuners[i]->tuner_id == tuner_id)
+			ret = EEXIST;
+	}
+	if (ret == 0)
+	{
+		manager->tuners[manager->num_tuners++] = (struct fmdriverif_state *)if_handle;
+	}
+	pthread_mutex_unlock(&(manager->mutex));
+
+	if (ret != 0)
+	{
+		teardown_interface((struct fmdriverif_state *)if_handle);
+		return ret;
+	}
+
+	*if_handle_ptr = if_handle;
+	return 0;
+}
+
+int fmdriverif_manager_read_events(unsigned long manager_handle, struct fmdriver_tuner_event *events, int max_events,
+				   int timeout_ms, int *num_events)
+{
+	struct fmdriver_manager *manager = (struct fmdriver_manager *)manager_handle;
+	struct fmdriverif_state *tuners[FMDRIVER_MAX_TUNERS];
+	struct fmdriverif_state *driver_state;
+	struct pollfd pfd;
+	uint64_t deadline = 0, now, count;
+	int num_tuners, first, taken, wait_ms, ret, i;
+
+	if (manager == NULL || manager->sig != MANAGER_GOOD || events == NULL || max_events <= 0 || num_events == NULL)
+		return EINVAL;
+
+	*num_events = 0;
+	if (timeout_ms > 0)
+	{
+		deadline = stats_now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+	}
+
+	for (;;)
+	{
+		// Reset the eventfd before any tuner is armed, so a tuner that posts once we have
+		// drained it always leaves the fd readable
+		if (read(manager->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		{
+			perror("fmdriverif_manager_read_events() -- failed to reset event fd");
+		}
+
+		pthread_mutex_lock(&(manager->mutex));
+		num_tuners = manager->num_tuners;
+		memcpy(tuners, manager->tuners, num_tuners * sizeof(struct fmdriverif_state *));
+		first = manager->next_read;
+		manager->next_read = (num_tuners > 0) ? (first + 1) % num_tuners : 0;
+		pthread_mutex_unlock(&(manager->mutex));
+
+		// Drain the tuners in turn, starting one further along each time so a busy tuner
+		// can't keep the others out of a small buffer
+		for (i = 0; i < num_tuners && *num_events < max_events; i++)
+		{
+			driver_state = tuners[(first + i) % num_tuners];
+			taken = 0;
+			while (*num_events < max_events &&
+			       fifo_dequeue(driver_state, &(events[*num_events].event)) == 0)
+			{
+				events[*num_events].tuner_id = driver_state->tuner_id;
+				(*num_events)++;
+				taken++;
+			}
+			if (taken > 0)
+			{
+				atomic_fetch_add_explicit(&(driver_state->events_read), taken, memory_order_relaxed);
+			}
+		}
+
+		if (*num_events > 0)
+			return 0;
+		if (timeout_ms == 0)
+			return EAGAIN;
+
+		// Every tuner is drained and armed, so wait for one of them to post
+		wait_ms = -1;
+		if (timeout_ms > 0)
+		{
+			now = stats_now_ns();
+			if (now >= deadline)
+				return ETIMEDOUT;
+			wait_ms = (int)((deadline - now + 999999) / 1000000);
+		}
+		pfd.fd = manager->event_fd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, wait_ms);
+		if (ret < 0 && errno != EINTR)
+		{
+			ret = errno;
+			perror("fmdriverif_manager_read_events() -- failed to poll event fd");
+			return ret;
+		}
+	}
+}
+
+int fmdriverif_manager_get_stats(unsigned long manager_handle, struct fmdriver_manager_stats *stats)
+{
+	struct fmdriver_manager *manager = (struct fmdriver_manager *)manager_handle;
+	int i;
+
+	if (manager == NULL || manager->sig != MANAGER_GOOD || stats == NULL)
+		return EINVAL;
+
+	memset(stats, 0, sizeof(struct fmdriver_manager_stats));
+	stats->workers = manager->num_workers;
+
+	pthread_mutex_lock(&(manager->mutex));
+	stats->tuners = manager->num_tuners;
+	pthread_mutex_unlock(&(manager->mutex));
+
+	for (i = 0; i < manager->num_workers; i++)
+	{
+		stats->turns += atomic_load_explicit(&(manager->workers[i].turns), memory_order_relaxed);
+		stats->steals += atomic_load_explicit(&(manager->workers[i].steals), memory_order_relaxed);
+	}
+
+	return 0;
+}
+
+// end of file
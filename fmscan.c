@@ -0,0 +1,425 @@
+// File: fmscan.c -- full-band station scan for the FM driver interface
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fmdriverif_priv.h"
+
+// Band table, built from FM_REGION_LIST. A band whose top isn't on its channel grid
+// won't compile
+#define REGION_BAND(region, low_khz, high_khz, spacing_khz) \
+	[region] = { low_khz, high_khz, spacing_khz, ((high_khz) - (low_khz)) / (spacing_khz) + 1 },
+#define REGION_CHECK(region, low_khz, high_khz, spacing_khz) \
+	_Static_assert(((high_khz) - (low_khz)) % (spacing_khz) == 0, #region " band is off its channel grid");
+
+const struct fm_region_band fm_region_bands[FM_REGIONS] =
+{
+	FM_REGION_LIST(REGION_BAND)
+};
+FM_REGION_LIST(REGION_CHECK)
+
+// Interfaces that are open, so a scan or seek can farm work out to the idle ones
+struct fmdriverif_state *scan_interfaces[SCAN_MAX_INTERFACES];
+pthread_mutex_t scan_interfaces_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void scan_register(struct fmdriverif_state *driver_state)
+{
+	int i;
+
+	// A full registry only means this interface can't be recruited into other scans
+	pthread_mutex_lock(&scan_interfaces_mutex);
+	for (i = 0; i < SCAN_MAX_INTERFACES; i++)
+	{
+		if (scan_interfaces[i] == NULL)
+		{
+			scan_interfaces[i] = driver_state;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&scan_interfaces_mutex);
+}
+
+void scan_unregister(struct fmdriverif_state *driver_state)
+{
+	int i;
+
+	pthread_mutex_lock(&scan_interfaces_mutex);
+	for (i = 0; i < SCAN_MAX_INTERFACES; i++)
+	{
+		if (scan_interfaces[i] == driver_state)
+		{
+			scan_interfaces[i] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&scan_interfaces_mutex);
+}
+
+void region_maps_build(struct fmdriverif_state *driver_state)
+{
+	const struct fm_region_band *band;
+	struct fmdriver_channel_map *map;
+	int region, low_khz, high_khz;
+
+	// Each region's band cut down to the part the tuner can reach, staying on the channel grid
+	for (region = FM_REGION_AMERICAS; region < FM_REGIONS; region++)
+	{
+		band = &(fm_region_bands[region]);
+		map = &(driver_state->channel_maps[region]);
+		memset(map, 0, sizeof(struct fmdriver_channel_map));
+		map->region = region;
+		map->spacing_khz = band->spacing_khz;
+
+		low_khz = band->low_khz;
+		high_khz = tuner_units_to_khz(driver_state, driver_state->tuner_info.rangehigh);
+		if (high_khz > band->high_khz)
+			high_khz = band->high_khz;
+		while (low_khz <= high_khz && khz_to_tuner_units(driver_state, low_khz) < driver_state->tuner_info.rangelow)
+			low_khz += band->spacing_khz;
+		if (low_khz > high_khz)
+			continue;
+
+		map->first_channel = (low_khz - band->low_khz) / band->spacing_khz;
+		map->num_channels = (high_khz - low_khz) / band->spacing_khz + 1;
+		map->low_khz = low_khz;
+		map->high_khz = low_khz + (map->num_channels - 1) * band->spacing_khz;
+	}
+}
+
+const struct fmdriver_channel_map *region_map(struct fmdriverif_state *driver_state, int *ret_ptr)
+{
+	const struct fmdriver_channel_map *map;
+	int region;
+
+	region = atomic_load_explicit(&(driver_state->region), memory_order_relaxed);
+	if (region < FM_REGION_AMERICAS || region > FM_REGION_OTHER)
+	{
+		*ret_ptr = EINVAL;
+		return NULL;
+	}
+
+	map = &(driver_state->channel_maps[region]);
+	if (map->num_channels == 0)
+	{
+		// Not built until the device comes up, and empty if the tuner can't reach the band
+		*ret_ptr = (driver_state->range_high_khz == 0) ? EAGAIN : ERANGE;
+		return NULL;
+	}
+
+	*ret_ptr = 0;
+	return map;
+}
+
+struct scan_job *scan_job_create(struct fmdriverif_state *driver_state, int *ret_ptr)
+{
+	const struct fmdriver_channel_map *map;
+	struct scan_job *job;
+
+	// Sweep everything the tuner can reach
+	map = region_map(driver_state, ret_ptr);
+	if (map == NULL)
+		return NULL;
+
+	job = (struct scan_job *)calloc(1, sizeof(struct scan_job) + map->num_channels * sizeof(struct fmdriver_station));
+	if (job == NULL)
+	{
+		fprintf(stderr, "scan_job_create() -- failed to allocate scan job\n");
+		*ret_ptr = ENOMEM;
+		return NULL;
+	}
+
+	*ret_ptr = pthread_mutex_init(&(job->mutex), NULL);
+	if (*ret_ptr == 0)
+	{
+		*ret_ptr = pthread_cond_init(&(job->idle_cond), NULL);
+		if (*ret_ptr != 0)
+		{
+			pthread_mutex_destroy(&(job->mutex));
+		}
+	}
+	if (*ret_ptr != 0)
+	{
+		fprintf(stderr, "scan_job_create() -- failed to initialize scan job %d\n", *ret_ptr);
+		free(job);
+		return NULL;
+	}
+
+	atomic_init(&(job->refs), 1);
+	atomic_init(&(job->next_channel), 0);
+	atomic_init(&(job->channels_measured), 0);
+	atomic_init(&(job->tuners_used), 0);
+	atomic_init(&(job->cancel), false);
+	job->owner = driver_state;
+	job->region = map->region;
+	job->first_khz = map->low_khz;
+	job->spacing_khz = map->spacing_khz;
+	job->num_channels = map->num_channels;
+
+	return job;
+}
+
+void scan_job_release(struct scan_job *job)
+{
+	// The last of the owner and its queued helper requests frees the job
+	if (atomic_fetch_sub_explicit(&(job->refs), 1, memory_order_acq_rel) == 1)
+	{
+		pthread_cond_destroy(&(job->idle_cond));
+		pthread_mutex_destroy(&(job->mutex));
+		free(job);
+	}
+}
+
+int scan_measure(struct fmdriverif_state *driver_state, int freq_khz, int settle_us, struct fmdriver_station *result)
+{
+	struct video_tuner tuner;
+	unsigned long freq_units;
+
+	result->freq = freq_khz;
+	result->signal = 0;
+	result->flags = 0;
+
+	// Helpers can have a narrower range than the owner
+	freq_units = khz_to_tuner_units(driver_state, freq_khz);
+	if (freq_units < driver_state->tuner_info.rangelow || freq_units > driver_state->tuner_info.rangehigh)
+		return ERANGE;
+
+	// Errors aren't reported per channel -- a failed channel just reads as no signal
+	if (driver_ioctl(driver_state, VIDIOCSFREQ, &freq_units) < 0)
+		return errno;
+
+	if (settle_us > 0)
+		usleep(settle_us);
+
+	// Query into a scratch struct so the tuner range we keep stays as it was at open
+	memset(&tuner, 0, sizeof(tuner));
+	tuner.tuner = driver_state->tuner_info.tuner;
+	if (driver_ioctl(driver_state, VIDIOCGTUNER, &tuner) < 0)
+		return errno;
+
+	result->signal = (unsigned short)tuner.signal;
+	if (tuner.flags & VIDEO_TUNER_STEREO_ON)
+		result->flags |= FMDRIVER_TUNER_STEREO;
+	if (tuner.flags & VIDEO_TUNER_RDS_ON)
+		result->flags |= FMDRIVER_TUNER_RDS;
+
+	return 0;
+}
+
+void scan_channels(struct fmdriverif_state *driver_state, struct scan_job *job)
+{
+	bool claimed = false;
+	int channel;
+
+	for (;;)
+	{
+		// Stopping or closing the owner stops everyone. A helper drops out when it is closed
+		// or its own client wants it back -- the channels it hasn't claimed go to the others
+		if (driver_state == job->owner)
+		{
+			if (atomic_load_explicit(&(driver_state->scan_cancel), memory_order_relaxed))
+				atomic_store_explicit(&(job->cancel), true, memory_order_relaxed);
+		}
+		else if (io_interrupted(driver_state))
+			break;
+		if (atomic_load_explicit(&(job->cancel), memory_order_relaxed))
+			break;
+
+		channel = atomic_fetch_add_explicit(&(job->next_channel), 1, memory_order_relaxed);
+		if (channel >= job->num_channels)
+			break;
+
+		if (!claimed)
+		{
+			atomic_fetch_add_explicit(&(job->tuners_used), 1, memory_order_relaxed);
+			claimed = true;
+		}
+
+		if (scan_measure(driver_state, job->first_khz + channel * job->spacing_khz, SCAN_SETTLE_US,
+				 &(job->results[channel])) == 0)
+			atomic_fetch_add_explicit(&(job->channels_measured), 1, memory_order_relaxed);
+	}
+}
+
+int scan_restore(struct fmdriverif_state *driver_state)
+{
+	unsigned long freq_units;
+	int ret;
+
+	// Put the tuner back on the station it was playing before the scan
+	if (driver_state->freq_khz <= 0)
+		return 0;
+
+	freq_units = khz_to_tuner_units(driver_state, driver_state->freq_khz);
+	if (driver_ioctl(driver_state, VIDIOCSFREQ, &freq_units) < 0)
+	{
+		ret = errno;
+		perror("scan_restore() -- ioctl VIDIOCSFREQ failed");
+		return ret;
+	}
+
+	// Any RDS the decoder picked up while we were away was from other stations, and so is
+	// whatever the driver still has buffered
+	rdsdecoder_reset(&(driver_state->rds));
+	ret = rds_discard(driver_state);
+	if (ret != 0)
+		return ret;
+
+	return 0;
+}
+
+int scan_recruit_helpers(struct fmdriverif_state *driver_state, struct scan_job *job)
+{
+	struct fmdriverif_state *helper;
+	struct fmdriver_request *req;
+	int recruited = 0, i;
+
+	pthread_mutex_lock(&scan_interfaces_mutex);
+	for (i = 0; i < SCAN_MAX_INTERFACES; i++)
+	{
+		helper = scan_interfaces[i];
+
+		// Skip ourselves, any other interface on the same device and tuners that are
+		// unplugged or still opening
+		if (helper == NULL || helper == driver_state ||
+		    strcmp(helper->device_path, driver_state->device_path) == 0 ||
+		    !atomic_load_explicit(&(helper->device_up), memory_order_acquire))
+			continue;
+
+		// Only take tuners with nothing queued that aren't playing for their own client, or
+		// already lent. Interfaces are unregistered before they shut down, so the helper
+		// can't go away while we hold the registry lock
+		pthread_mutex_lock(&(helper->request_mutex));
+		if (!helper->io_shutdown && helper->request_count == 0 &&
+		    atomic_load_explicit(&(helper->lendable), memory_order_relaxed))
+		{
+			atomic_store_explicit(&(helper->lendable), false, memory_order_relaxed);
+			req = &(helper->request_queue[helper->request_head]);
+			memset(req, 0, sizeof(struct fmdriver_request));
+			req->type = FM_EVENT_SCAN;
+			req->job = job;
+			helper->request_count++;
+			atomic_fetch_add_explicit(&(job->refs), 1, memory_order_relaxed);
+			io_wake(helper);
+			recruited++;
+		}
+		pthread_mutex_unlock(&(helper->request_mutex));
+	}
+	pthread_mutex_unlock(&scan_interfaces_mutex);
+
+	return recruited;
+}
+
+void scan_helper(struct fmdriverif_state *driver_state, struct scan_job *job)
+{
+	// Runs on the helper's I/O worker. If the owner has already finished, there's nothing left
+	pthread_mutex_lock(&(job->mutex));
+	if (job->finished)
+	{
+		pthread_mutex_unlock(&(job->mutex));
+		scan_job_release(job);
+		return;
+	}
+	job->active++;
+	pthread_mutex_unlock(&(job->mutex));
+
+	scan_channels(driver_state, job);
+
+	pthread_mutex_lock(&(job->mutex));
+	if (--job->active == 0)
+	{
+		pthread_cond_broadcast(&(job->idle_cond));
+	}
+	pthread_mutex_unlock(&(job->mutex));
+	scan_job_release(job);
+
+	scan_restore(driver_state);
+}
+
+int scan_build_table(struct scan_job *job, struct fmdriver_station *stations, int max_stations)
+{
+	unsigned short signal, left, right;
+	int num_stations = 0, i;
+
+	// A strong station bleeds into the channels either side of it, so only report the
+	// channel at the top of each peak. Channels are in frequency order, so the table is too
+	for (i = 0; i < job->num_channels && num_stations < max_stations; i++)
+	{
+		signal = job->results[i].signal;
+		if (signal < SCAN_SIGNAL_THRESHOLD)
+			continue;
+
+		left = (i > 0) ? job->results[i - 1].signal : 0;
+		right = (i < job->num_channels - 1) ? job->results[i + 1].signal : 0;
+		if (signal >= left && signal > right)
+		{
+			stations[num_stations++] = job->results[i];
+		}
+	}
+
+	return num_stations;
+}
+
+int scan_band(struct fmdriverif_state *driver_state, struct fmdriver_scan_data *scan_data)
+{
+	struct fmdriver_station stations[FMDRIVER_MAX_STATIONS];
+	struct timespec start, end;
+	struct scan_job *job;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	job = scan_job_create(driver_state, &ret);
+	if (job == NULL)
+		return ret;
+
+	scan_recruit_helpers(driver_state, job);
+	scan_channels(driver_state, job);
+
+	// Every channel has been claimed -- wait for the helpers still measuring theirs
+	pthread_mutex_lock(&(job->mutex));
+	job->finished = true;
+	while (job->active > 0)
+	{
+		pthread_cond_wait(&(job->idle_cond), &(job->mutex));
+	}
+	pthread_mutex_unlock(&(job->mutex));
+
+	scan_restore(driver_state);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (atomic_load_explicit(&(job->cancel), memory_order_relaxed))
+	{
+		ret = ECANCELED;
+	}
+	else if (atomic_load_explicit(&(job->channels_measured), memory_order_relaxed) == 0)
+	{
+		// The driver failed on every channel
+		ret = EIO;
+	}
+	else
+	{
+		scan_data->num_stations = scan_build_table(job, stations, FMDRIVER_MAX_STATIONS);
+		scan_data->channels_scanned = atomic_load_explicit(&(job->channels_measured), memory_order_relaxed);
+		scan_data->tuners_used = atomic_load_explicit(&(job->tuners_used), memory_order_relaxed);
+		scan_data->scan_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+		// Publish the new table for fmdriverif_get_stations. It belongs to the region the
+		// scan was made in, even if the client has switched since
+		pthread_mutex_lock(&(driver_state->request_mutex));
+		memcpy(driver_state->stations[job->region], stations, scan_data->num_stations * sizeof(struct fmdriver_station));
+		driver_state->num_stations[job->region] = scan_data->num_stations;
+		pthread_mutex_unlock(&(driver_state->request_mutex));
+	}
+
+	scan_job_release(job);
+
+	return ret;
+}
+
+// end of file
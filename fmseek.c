@@ -0,0 +1,333 @@
+// File: fmseek.c -- station seek for the FM driver interface
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fmdriverif_priv.h"
+
+int seek_station(struct fmdriverif_state *driver_state, bool seek_up, struct fmdriver_tune_data *tune_data)
+{
+	struct fmdriver_station found;
+	struct seek_sweep sweep;
+	unsigned long freq_units;
+	int from_khz = driver_state->freq_khz, to_khz, threshold, ret;
+	bool from_station;
+
+	atomic_fetch_add_explicit(&(driver_state->seeks), 1, memory_order_relaxed);
+	threshold = atomic_load_explicit(&(driver_state->seek_threshold), memory_order_relaxed);
+	from_station = (from_khz > 0 && driver_state->tuner_info.signal >= threshold);
+
+	// A scan or the last seek may already know where the next station is, so this is one tune
+	to_khz = seek_from_table(driver_state, seek_up);
+	if (to_khz == 0)
+		to_khz = seek_from_cache(driver_state, seek_up);
+	if (to_khz > 0)
+	{
+		ret = request_tune(driver_state, to_khz, tune_data);
+		if (ret == 0 && tune_data->signal >= threshold)
+		{
+			atomic_fetch_add_explicit(&(driver_state->seeks_cached), 1, memory_order_relaxed);
+			seek_landed(driver_state, from_khz, from_station, seek_up);
+			return 0;
+		}
+		if (ret != 0 && ret != ERANGE)
+			return ret;
+
+		// Gone off the air, or out of this tuner's range -- look on from wherever we are
+	}
+
+	// Let the tuner find it if it can. The V4L radio interface has no seek, so on real
+	// hardware this fails with ENOSYS
+	if (driver_seek(driver_state, seek_up, &freq_units) == 0)
+	{
+		ret = report_station(driver_state, tuner_units_to_khz(driver_state, freq_units), tune_data);
+		if (ret == 0)
+			seek_landed(driver_state, from_khz, from_station, seek_up);
+		return ret;
+	}
+	ret = errno;
+	if (ret != ENOSYS)
+	{
+		if (ret != ENOENT)
+			perror("seek_station() -- seek failed");
+		return ret;
+	}
+
+	// Sweep the channels ourselves, stopping at the first station
+	ret = seek_sweep_init(driver_state, &sweep);
+	if (ret != 0)
+		return ret;
+	ret = seek_sweep(driver_state, &sweep, driver_state->freq_khz, seek_up, NULL, &found);
+	if (ret != 0)
+	{
+		// Nothing found or stopped -- back to the station we were on
+		if (ret != ENODEV)
+			scan_restore(driver_state);
+		return ret;
+	}
+
+	ret = request_tune(driver_state, found.freq, tune_data);
+	if (ret == 0)
+		seek_landed(driver_state, from_khz, from_station, seek_up);
+
+	return ret;
+}
+
+int seek_from_table(struct fmdriverif_state *driver_state, bool seek_up)
+{
+	const struct fmdriver_station *stations;
+	int region, num_stations, from_khz = driver_state->freq_khz, i;
+
+	// Only this worker writes the tables, so they can be read without the request lock.
+	// They are in frequency order; going off either end wraps round to the other, as a
+	// sweep does
+	region = atomic_load_explicit(&(driver_state->region), memory_order_relaxed);
+	if (region < FM_REGION_AMERICAS || region > FM_REGION_OTHER)
+		return 0;
+	stations = driver_state->stations[region];
+	num_stations = driver_state->num_stations[region];
+	if (num_stations == 0)
+		return 0;
+
+	if (seek_up)
+	{
+		for (i = 0; i < num_stations; i++)
+		{
+			if (stations[i].freq > from_khz)
+				return stations[i].freq;
+		}
+		i = 0;
+	}
+	else
+	{
+		for (i = num_stations - 1; i >= 0; i--)
+		{
+			if (stations[i].freq < from_khz)
+				return stations[i].freq;
+		}
+		i = num_stations - 1;
+	}
+
+	// The only station in the table is the one we're on -- leave it to a sweep
+	return (stations[i].freq != from_khz) ? stations[i].freq : 0;
+}
+
+int seek_from_cache(struct fmdriverif_state *driver_state, bool seek_up)
+{
+	struct seek_job *job = driver_state->seek_cache;
+
+	// Only good while we're still on the station the neighbours were found from
+	if (job == NULL || job->from_khz != driver_state->freq_khz ||
+	    job->sweep.region != atomic_load_explicit(&(driver_state->region), memory_order_relaxed))
+		return 0;
+
+	return atomic_load_explicit(&(job->next_khz[seek_up]), memory_order_acquire);
+}
+
+int seek_sweep_init(struct fmdriverif_state *driver_state, struct seek_sweep *sweep)
+{
+	const struct fmdriver_channel_map *map;
+	int ret;
+
+	map = region_map(driver_state, &ret);
+	if (map == NULL)
+		return ret;
+
+	sweep->region = map->region;
+	sweep->low_khz = map->low_khz;
+	sweep->high_khz = map->high_khz;
+	sweep->spacing_khz = map->spacing_khz;
+
+	sweep->signal_threshold = atomic_load_explicit(&(driver_state->seek_threshold), memory_order_relaxed);
+	sweep->settle_us = atomic_load_explicit(&(driver_state->seek_settle_us), memory_order_relaxed);
+
+	return 0;
+}
+
+int seek_sweep(struct fmdriverif_state *driver_state, const struct seek_sweep *sweep, int from_khz, bool seek_up,
+	       atomic_bool *cancel, struct fmdriver_station *found)
+{
+	struct fmdriver_station station, next;
+	int num_channels, channel, step, freq_khz, ret, i;
+
+	num_channels = (sweep->high_khz - sweep->low_khz) / sweep->spacing_khz + 1;
+	step = seek_up ? 1 : num_channels - 1;
+
+	// First channel past where we are. Off the grid or outside the band, that is the nearest
+	// channel in the direction of the seek
+	if (seek_up)
+		channel = (from_khz < sweep->low_khz) ? 0 : (from_khz - sweep->low_khz) / sweep->spacing_khz + 1;
+	else
+		channel = (from_khz <= sweep->low_khz) ? num_channels - 1 : (from_khz - sweep->low_khz - 1) / sweep->spacing_khz;
+	if (channel >= num_channels)
+		channel = seek_up ? 0 : num_channels - 1;
+
+	// Going all the way round finds nothing but where we started
+	for (i = 0; i < num_channels; i++, channel = (channel + step) % num_channels)
+	{
+		// Our own sweep stops when our client says so. One for another interface stops when
+		// that one moves on, or our client wants the tuner back or closes it
+		if ((cancel == NULL) ? atomic_load_explicit(&(driver_state->seek_cancel), memory_order_relaxed) :
+		    (atomic_load_explicit(cancel, memory_order_relaxed) || io_interrupted(driver_state)))
+			return ECANCELED;
+
+		freq_khz = sweep->low_khz + channel * sweep->spacing_khz;
+		if (freq_khz == from_khz)
+			continue;
+
+		// As in a scan, a channel the driver fails on reads as no signal -- unless the
+		// tuner has gone
+		ret = scan_measure(driver_state, freq_khz, sweep->settle_us, &station);
+		if (ret == ENODEV)
+			return ret;
+		if (ret != 0 || station.signal < sweep->signal_threshold)
+			continue;
+
+		// A strong station bleeds into the channels beside it, so we may be on its
+		// shoulder. Carry on while the next channel is stronger
+		for (i++; i < num_channels; i++)
+		{
+			channel = (channel + step) % num_channels;
+			freq_khz = sweep->low_khz + channel * sweep->spacing_khz;
+			if (freq_khz == from_khz ||
+			    scan_measure(driver_state, freq_khz, sweep->settle_us, &next) != 0 || next.signal <= station.signal)
+				break;
+			station = next;
+		}
+
+		*found = station;
+		return 0;
+	}
+
+	return ENOENT;
+}
+
+void seek_landed(struct fmdriverif_state *driver_state, int from_khz, bool from_station, bool seek_up)
+{
+	struct seek_job *job;
+
+	// The old neighbours were for somewhere else
+	seek_cache_drop(driver_state);
+
+	job = (struct seek_job *)calloc(1, sizeof(struct seek_job));
+	if (job == NULL)
+	{
+		fprintf(stderr, "seek_landed() -- failed to allocate seek job\n");
+		return;
+	}
+
+	// With a station table, the next seek is answered from that
+	if (seek_sweep_init(driver_state, &(job->sweep)) != 0 || driver_state->num_stations[job->sweep.region] > 0)
+	{
+		free(job);
+		return;
+	}
+
+	atomic_init(&(job->refs), 1);
+	atomic_init(&(job->cancel), false);
+	job->from_khz = driver_state->freq_khz;
+
+	// Seeking passed nothing on the way here, so if we came from a station it is the next
+	// one back. The helper only has to look the other way
+	atomic_init(&(job->next_khz[!seek_up]), from_station ? from_khz : 0);
+	atomic_init(&(job->next_khz[seek_up]), 0);
+
+	driver_state->seek_cache = job;
+	seek_recruit_helper(driver_state, job);
+}
+
+void seek_cache_drop(struct fmdriverif_state *driver_state)
+{
+	struct seek_job *job = driver_state->seek_cache;
+
+	if (job == NULL)
+		return;
+
+	// Call off the helper if it is still looking
+	atomic_store_explicit(&(job->cancel), true, memory_order_relaxed);
+	seek_job_release(job);
+	driver_state->seek_cache = NULL;
+}
+
+bool seek_recruit_helper(struct fmdriverif_state *driver_state, struct seek_job *job)
+{
+	struct fmdriverif_state *helper;
+	struct fmdriver_request *req;
+	bool recruited = false;
+	int i;
+
+	// One idle tuner does the looking, so the one playing stays on its station. Same rules
+	// as recruiting for a scan
+	pthread_mutex_lock(&scan_interfaces_mutex);
+	for (i = 0; i < SCAN_MAX_INTERFACES && !recruited; i++)
+	{
+		helper = scan_interfaces[i];
+		if (helper == NULL || helper == driver_state ||
+		    strcmp(helper->device_path, driver_state->device_path) == 0 ||
+		    !atomic_load_explicit(&(helper->device_up), memory_order_acquire))
+			continue;
+
+		pthread_mutex_lock(&(helper->request_mutex));
+		if (!helper->io_shutdown && helper->request_count == 0 &&
+		    atomic_load_explicit(&(helper->lendable), memory_order_relaxed))
+		{
+			atomic_store_explicit(&(helper->lendable), false, memory_order_relaxed);
+			req = &(helper->request_queue[helper->request_head]);
+			memset(req, 0, sizeof(struct fmdriver_request));
+			req->type = FM_EVENT_SEEK;
+			req->prefetch = job;
+			helper->request_count++;
+			atomic_fetch_add_explicit(&(job->refs), 1, memory_order_relaxed);
+			io_wake(helper);
+			recruited = true;
+		}
+		pthread_mutex_unlock(&(helper->request_mutex));
+	}
+	pthread_mutex_unlock(&scan_interfaces_mutex);
+
+	return recruited;
+}
+
+void seek_helper(struct fmdriverif_state *driver_state, struct seek_job *job)
+{
+	struct fmdriver_station found;
+	bool swept = false;
+	int seek_up, ret;
+
+	// Runs on the helper's I/O worker. Up first -- it is the way Seek is pressed most
+	for (seek_up = 1; seek_up >= 0; seek_up--)
+	{
+		if (atomic_load_explicit(&(job->cancel), memory_order_relaxed))
+			break;
+		if (atomic_load_explicit(&(job->next_khz[seek_up]), memory_order_relaxed) != 0)
+			continue;
+
+		// Called off, or our own client wants the tuner -- the other way isn't worth starting
+		swept = true;
+		ret = seek_sweep(driver_state, &(job->sweep), job->from_khz, seek_up, &(job->cancel), &found);
+		if (ret == 0)
+			atomic_store_explicit(&(job->next_khz[seek_up]), found.freq, memory_order_release);
+		else if (ret == ECANCELED || ret == ENODEV)
+			break;
+	}
+	seek_job_release(job);
+
+	if (swept)
+		scan_restore(driver_state);
+}
+
+void seek_job_release(struct seek_job *job)
+{
+	// The last of the owner and the helper request frees the job
+	if (atomic_fetch_sub_explicit(&(job->refs), 1, memory_order_acq_rel) == 1)
+	{
+		free(job);
+	}
+}
+
+// end of file
@@ -0,0 +1,433 @@
+// File: fmsim.c -- simulated FM tuner backend implementation
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fmdriverif_priv.h"
+#include "fmsim.h"
+
+// Signal off a station -- adjacent channels pick up some of it
+#define SIM_NOISE_FLOOR		0x0800
+#define SIM_ADJACENT_KHZ	100
+#define SIM_ALTERNATE_KHZ	200
+
+// Block C of a 0A group with no alternative frequencies. Otherwise the list goes out two
+// codes at a time, led by the count
+#define SIM_NO_AF		0xE0CD
+#define SIM_AF_COUNT_BASE	224
+#define SIM_AF_FILLER		205
+
+// One virtual tuner, owned by the I/O worker of the interface that opened it
+struct fmsim_tuner
+{
+	struct fmsim_config config;
+	unsigned long freq_units;		// 1/16 kHz
+	const struct fmsim_station *station;	// Station tuned dead on, NULL if none
+	struct video_audio audio;
+
+	long long opened_ns;			// Fading stations fade from here
+
+	// RDS stream -- groups become due at a fixed rate from when the station was tuned
+	long long rds_start_ns;
+	long long rds_group_ns;
+	unsigned long groups_sent;
+	unsigned int rand_seed;
+};
+
+// Backend functions
+int sim_open(struct fmdriverif_state *driver_state);
+void sim_close(struct fmdriverif_state *driver_state);
+int sim_ioctl(struct fmdriverif_state *driver_state, unsigned long request, void *arg);
+ssize_t sim_read_rds(struct fmdriverif_state *driver_state, unsigned char *records, size_t len);
+int sim_seek(struct fmdriverif_state *driver_state, bool seek_up, unsigned long *freq_units);
+
+// Private functions
+long long sim_now_ns(void);
+int sim_signal(struct fmsim_tuner *tuner, int freq_khz);
+void sim_set_freq(struct fmsim_tuner *tuner, unsigned long freq_units);
+void sim_get_tuner(struct fmsim_tuner *tuner, struct video_tuner *tuner_info);
+void sim_build_group(struct fmsim_tuner *tuner, unsigned long index, unsigned short *group);
+unsigned short sim_af_pair(const struct fmsim_station *station, unsigned long index);
+
+const struct fmdriver_backend sim_backend =
+{
+	"sim", sim_open, sim_close, sim_ioctl, sim_read_rds, sim_seek, false
+};
+
+// Configuration new tuners are opened with
+struct fmsim_config sim_config;
+bool sim_configured;
+pthread_mutex_t sim_config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+const struct fmsim_station sim_default_stations[] =
+{
+	{ 88100, 0x9000, true, 0x1A31, 14, "JAZZ 88 ", "Late night jazz with the JAZZ 88 crew" },
+	{ 91500, 0x6000, true, 0x2A15, 3, "NPR 91.5", "Morning Edition" },
+	{ 94900, 0xC000, true, 0x4C21, 2, "HITS 949", "Now playing: the hits, all day" },
+	{ 97300, 0x3000, false, 0, 0, "", "" },
+	{ 101500, 0xE000, true, 0x5B11, 14, "KISS FM ", "Wynton Marsalis Live on Bourbon Street" },
+	{ 104300, 0x5000, true, 0x6A02, 3, "TALK 104", "Call in now" },
+	{ 106700, 0x8800, true, 0x7D33, 5, "ROCK1067", "Classic rock, no talk" }
+};
+
+long long sim_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int sim_signal(struct fmsim_tuner *tuner, int freq_khz)
+{
+	int signal = SIM_NOISE_FLOOR, station_signal, offset, faded_ms, i;
+
+	// The strongest of the stations in reach
+	for (i = 0; i < tuner->config.num_stations; i++)
+	{
+		offset = abs(tuner->config.stations[i].freq - freq_khz);
+		if (offset > SIM_ALTERNATE_KHZ)
+			continue;
+
+		station_signal = tuner->config.stations[i].signal;
+		if (tuner->config.stations[i].fade_ms > 0)
+		{
+			faded_ms = (int)((sim_now_ns() - tuner->opened_ns) / 1000000LL);
+			station_signal = (faded_ms >= tuner->config.stations[i].fade_ms) ? 0 :
+				(int)((long long)station_signal * (tuner->config.stations[i].fade_ms - faded_ms) /
+				      tuner->config.stations[i].fade_ms);
+		}
+		if (offset > SIM_ADJACENT_KHZ)
+			station_signal /= 16;
+		else if (offset > 0)
+			station_signal /= 4;
+
+		if (station_signal > signal)
+			signal = station_signal;
+	}
+
+	return signal;
+}
+
+void sim_set_freq(struct fmsim_tuner *tuner, unsigned long freq_units)
+{
+	int freq_khz = (int)(freq_units / 16), i;
+
+	tuner->freq_units = freq_units;
+	tuner->station = NULL;
+	for (i = 0; i < tuner->config.num_stations; i++)
+	{
+		if (tuner->config.stations[i].freq == freq_khz)
+		{
+			tuner->station = &(tuner->config.stations[i]);
+			break;
+		}
+	}
+
+	// The new station's RDS starts from the top once the decoder has had time to sync
+	tuner->rds_start_ns = sim_now_ns() + tuner->config.rds_sync_ms * 1000000LL;
+	tuner->groups_sent = 0;
+}
+
+void sim_get_tuner(struct fmsim_tuner *tuner, struct video_tuner *tuner_info)
+{
+	const struct fmsim_station *station = tuner->station;
+
+	strcpy(tuner_info->name, "FM Simulator");
+	tuner_info->rangelow = (unsigned long)tuner->config.low_khz * 16;
+	tuner_info->rangehigh = (unsigned long)tuner->config.high_khz * 16;
+	tuner_info->flags = VIDEO_TUNER_LOW;
+	if (station != NULL && station->stereo)
+		tuner_info->flags |= VIDEO_TUNER_STEREO_ON;
+	if (station != NULL && (station->ps[0] != '\0' || station->num_groups > 0))
+		tuner_info->flags |= VIDEO_TUNER_RDS_ON;
+	tuner_info->mode = VIDEO_MODE_AUTO;
+	tuner_info->signal = (unsigned short)sim_signal(tuner, (int)(tuner->freq_units / 16));
+}
+
+void sim_build_group(struct fmsim_tuner *tuner, unsigned long index, unsigned short *group)
+{
+	const struct fmsim_station *station = tuner->station;
+	char rt[RDS_DATA_MAX];
+	int rt_len, rt_segments, seg;
+
+	if (station->num_groups > 0)
+	{
+		memcpy(group, station->groups[index % station->num_groups], 4 * sizeof(unsigned short));
+		return;
+	}
+
+	// Radio text is sent up to a carriage return, padded out to whole segments
+	rt_len = strlen(station->rt);
+	memset(rt, ' ', sizeof(rt));
+	memcpy(rt, station->rt, rt_len);
+	if (rt_len < RDS_DATA_MAX)
+		rt[rt_len++] = '\r';
+	rt_segments = (rt_len + 3) / 4;
+
+	// PS and radio text groups take turns
+	group[0] = station->pi;
+	if (index % 2 == 0 || station->rt[0] == '\0')
+	{
+		seg = (index / 2) % 4;
+		group[1] = (0 << 12) | (station->pty << 5) | seg;
+		group[2] = sim_af_pair(station, index / 2);
+		group[3] = ((unsigned char)station->ps[seg * 2] << 8) | (unsigned char)station->ps[seg * 2 + 1];
+	}
+	else
+	{
+		seg = (index / 2) % rt_segments;
+		group[1] = (2 << 12) | (station->pty << 5) | seg;
+		group[2] = ((unsigned char)rt[seg * 4] << 8) | (unsigned char)rt[seg * 4 + 1];
+		group[3] = ((unsigned char)rt[seg * 4 + 2] << 8) | (unsigned char)rt[seg * 4 + 3];
+	}
+}
+
+unsigned short sim_af_pair(const struct fmsim_station *station, unsigned long index)
+{
+	unsigned char codes[FMSIM_MAX_AF + 2];
+	int num_codes, pair, i;
+
+	if (station->num_af <= 0)
+		return SIM_NO_AF;
+
+	// Method A -- the count, the frequencies, then filler to make up the last pair
+	num_codes = (station->num_af < FMSIM_MAX_AF) ? station->num_af : FMSIM_MAX_AF;
+	codes[0] = SIM_AF_COUNT_BASE + num_codes;
+	for (i = 0; i < num_codes; i++)
+	{
+		codes[i + 1] = (station->af_khz[i] - RDS_AF_KHZ(0)) / 100;
+	}
+	codes[++num_codes] = SIM_AF_FILLER;
+	pair = index % ((num_codes + 1) / 2);
+
+	return (codes[pair * 2] << 8) | codes[pair * 2 + 1];
+}
+
+int sim_open(struct fmdriverif_state *driver_state)
+{
+	struct fmsim_tuner *tuner;
+
+	tuner = (struct fmsim_tuner *)calloc(1, sizeof(struct fmsim_tuner));
+	if (tuner == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pthread_mutex_lock(&sim_config_mutex);
+	if (!sim_configured)
+	{
+		fmsim_default_config(&sim_config);
+		sim_configured = true;
+	}
+	tuner->config = sim_config;
+	pthread_mutex_unlock(&sim_config_mutex);
+
+	if (tuner->config.rds_speedup < 1)
+		tuner->config.rds_speedup = 1;
+	tuner->rds_group_ns = FMSIM_RDS_GROUP_NS / tuner->config.rds_speedup;
+	tuner->rand_seed = driver_state->tuner_id + 1;
+	tuner->opened_ns = sim_now_ns();
+
+	// Powered up, unmuted and on the first station, as if another program left it there
+	tuner->audio.volume = 0xC000;
+	tuner->audio.flags = VIDEO_AUDIO_MUTABLE | VIDEO_AUDIO_VOLUME;
+	strcpy(tuner->audio.name, "Radio");
+	sim_set_freq(tuner, (unsigned long)((tuner->config.num_stations > 0) ?
+			    tuner->config.stations[0].freq : tuner->config.low_khz) * 16);
+
+	snprintf(driver_state->device_path, sizeof(driver_state->device_path), "sim:%d", driver_state->tuner_id);
+	driver_state->backend_data = tuner;
+
+	return 0;
+}
+
+void sim_close(struct fmdriverif_state *driver_state)
+{
+	free(driver_state->backend_data);
+	driver_state->backend_data = NULL;
+}
+
+int sim_ioctl(struct fmdriverif_state *driver_state, unsigned long request, void *arg)
+{
+	struct fmsim_tuner *tuner = (struct fmsim_tuner *)driver_state->backend_data;
+	unsigned long freq_units;
+
+	switch (request)
+	{
+	case VIDIOCGTUNER:
+		sim_get_tuner(tuner, (struct video_tuner *)arg);
+		break;
+
+	case VIDIOCSFREQ:
+		freq_units = *(unsigned long *)arg;
+		if (freq_units < (unsigned long)tuner->config.low_khz * 16 ||
+		    freq_units > (unsigned long)tuner->config.high_khz * 16)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		if (tuner->config.tune_latency_us > 0)
+			usleep(tuner->config.tune_latency_us);
+		sim_set_freq(tuner, freq_units);
+		break;
+
+	case VIDIOCGFREQ:
+		*(unsigned long *)arg = tuner->freq_units;
+		break;
+
+	case VIDIOCGAUDIO:
+		*(struct video_audio *)arg = tuner->audio;
+		break;
+
+	case VIDIOCSAUDIO:
+		tuner->audio = *(struct video_audio *)arg;
+		break;
+
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+
+	return 0;
+}
+
+ssize_t sim_read_rds(struct fmdriverif_state *driver_state, unsigned char *records, size_t len)
+{
+	struct fmsim_tuner *tuner = (struct fmsim_tuner *)driver_state->backend_data;
+	unsigned short group[4];
+	unsigned char *record = records;
+	long long now = sim_now_ns();
+	unsigned long due, max_groups, num_groups, i;
+	int block;
+
+	if (tuner->station == NULL || (tuner->station->ps[0] == '\0' && tuner->station->num_groups == 0) ||
+	    now < tuner->rds_start_ns)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	// Groups the station has sent since the tune. Like the driver, only the latest few
+	// are kept if nobody reads them
+	due = (unsigned long)((now - tuner->rds_start_ns) / tuner->rds_group_ns) + 1;
+	if (due - tuner->groups_sent > FMSIM_RDS_BUFFER)
+		tuner->groups_sent = due - FMSIM_RDS_BUFFER;
+
+	max_groups = len / (4 * RDS_RECORD_SIZE);
+	num_groups = due - tuner->groups_sent;
+	if (num_groups > max_groups)
+		num_groups = max_groups;
+	if (num_groups == 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	for (i = 0; i < num_groups; i++, tuner->groups_sent++)
+	{
+		sim_build_group(tuner, tuner->groups_sent, group);
+		for (block = 0; block < 4; block++, record += RDS_RECORD_SIZE)
+		{
+			record[0] = group[block] & 0xFF;
+			record[1] = group[block] >> 8;
+			// V4L2 numbers the blocks A, B, C, D, C'
+			record[2] = (block == 2 && (group[1] & 0x0800)) ? 4 : block;
+			if (tuner->config.rds_error_rate > 0 && rand_r(&(tuner->rand_seed)) % tuner->config.rds_error_rate == 0)
+			{
+				record[0] = record[1] = 0;
+				record[2] |= RDS_RECORD_ERROR;
+			}
+		}
+	}
+
+	return record - records;
+}
+
+int sim_seek(struct fmdriverif_state *driver_state, bool seek_up, unsigned long *freq_units)
+{
+	struct fmsim_tuner *tuner = (struct fmsim_tuner *)driver_state->backend_data;
+	int start_khz = (int)(tuner->freq_units / 16), freq_khz = start_khz;
+	int spacing = tuner->config.seek_spacing_khz;
+
+	// No seek spacing is a tuner without a seek of its own, like the V4L radio interface
+	if (spacing <= 0)
+	{
+		errno = ENOSYS;
+		return -1;
+	}
+
+	// Step along the band, wrapping at the ends, until a channel is strong enough. Going
+	// all the way round leaves the tuner where it started
+	for (;;)
+	{
+		freq_khz += seek_up ? spacing : -spacing;
+		if (freq_khz > tuner->config.high_khz)
+			freq_khz = tuner->config.low_khz;
+		else if (freq_khz < tuner->config.low_khz)
+			freq_khz = tuner->config.high_khz;
+		if (freq_khz == start_khz)
+		{
+			sim_set_freq(tuner, tuner->freq_units);
+			errno = ENOENT;
+			return -1;
+		}
+
+		if (tuner->config.seek_step_us > 0)
+			usleep(tuner->config.seek_step_us);
+		if (sim_signal(tuner, freq_khz) >= tuner->config.seek_threshold)
+			break;
+	}
+
+	sim_set_freq(tuner, (unsigned long)freq_khz * 16);
+	*freq_units = tuner->freq_units;
+
+	return 0;
+}
+
+void fmsim_default_config(struct fmsim_config *config)
+{
+	int i;
+
+	memset(config, 0, sizeof(struct fmsim_config));
+
+	config->num_stations = sizeof(sim_default_stations) / sizeof(sim_default_stations[0]);
+	for (i = 0; i < config->num_stations; i++)
+	{
+		config->stations[i] = sim_default_stations[i];
+	}
+
+	config->low_khz = 87500;
+	config->high_khz = 108000;
+	config->tune_latency_us = 60000;
+	config->seek_step_us = 40000;
+	config->seek_spacing_khz = 200;
+	config->seek_threshold = 0x4000;
+	config->rds_speedup = 1;
+	config->rds_sync_ms = 200;
+	config->rds_error_rate = 0;
+}
+
+int fmsim_configure(const struct fmsim_config *config)
+{
+	if (config == NULL || config->num_stations < 0 || config->num_stations > FMSIM_MAX_STATIONS ||
+	    config->low_khz <= 0 || config->high_khz < config->low_khz)
+		return EINVAL;
+
+	pthread_mutex_lock(&sim_config_mutex);
+	sim_config = *config;
+	sim_configured = true;
+	pthread_mutex_unlock(&sim_config_mutex);
+
+	return 0;
+}
+
+// end of file
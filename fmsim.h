@@ -0,0 +1,78 @@
+// File: fmsim.h -- simulated FM tuner backend
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#ifndef FMSIM_H
+#define FMSIM_H
+
+#include <stdbool.h>
+
+#include "fmdriverif.h"
+
+// The simulator stands in for the radio driver when the "sim" backend is picked with
+// fmdriverif_set_backend or FMTUNER_BACKEND=sim. Each interface gets its own virtual tuner
+// on a shared band of stations, so several can be open at once. Tunes and seeks take as
+// long as configured, and the station the tuner is on sends RDS as V4L2 records, the same
+// as the real driver
+#define FMSIM_MAX_STATIONS	64
+#define FMSIM_MAX_AF		RDS_AF_MAX
+
+// RDS runs at 1187.5 bits/s and a group is 104 bits, about 11.4 groups a second
+#define FMSIM_RDS_GROUP_NS	87578947L
+
+// Groups the driver buffers before it starts dropping the oldest
+#define FMSIM_RDS_BUFFER	25
+
+struct fmsim_station
+{
+	int freq;				// kHz
+	unsigned short signal;			// Signal strength tuned dead on, 0-65535
+	bool stereo;
+
+	// RDS, sent if ps is set. The group stream cycles through PS (0A) and radio text
+	// (2A) groups built from these fields. The AF list goes out in the 0A groups
+	unsigned short pi;
+	unsigned char pty;
+	char ps[9];
+	char rt[RDS_DATA_MAX + 1];
+
+	// Scripted stream instead -- blocks A-D of each group, replayed in a loop. Must stay
+	// valid while any simulated tuner is open
+	const unsigned short (*groups)[4];
+	int num_groups;
+
+	int af_khz[FMSIM_MAX_AF];		// Alternative frequencies, on the 100 kHz grid
+	int num_af;
+
+	// Fades out over this long from when the tuner is opened, as if driving out of range.
+	// 0 for a steady signal
+	int fade_ms;
+};
+
+struct fmsim_config
+{
+	struct fmsim_station stations[FMSIM_MAX_STATIONS];
+	int num_stations;
+
+	int low_khz;				// Tuner range
+	int high_khz;
+	int tune_latency_us;			// Each retune
+	int seek_step_us;			// Each channel a seek passes over
+	int seek_spacing_khz;			// 0 for a tuner that can't seek
+	unsigned short seek_threshold;		// Weakest signal a seek stops on
+
+	int rds_speedup;			// RDS group rate, 1 for real time
+	int rds_sync_ms;			// Silence after a retune before RDS arrives
+	int rds_error_rate;			// One block in this many arrives bad, 0 for none
+};
+
+// Fills in the built-in band -- a handful of stations on the Americas grid, real time
+// RDS and tune and seek times close to the Si470x
+void fmsim_default_config(struct fmsim_config *config);
+
+// Sets up the virtual tuners opened from now on. Tuners already open keep the
+// configuration they were opened with
+int fmsim_configure(const struct fmsim_config *config);
+
+#endif
@@ -0,0 +1,288 @@
+// File: fmtelemetry.c -- shared-memory signal telemetry implementation
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fmdriverif_priv.h"
+#include "fmtelemetry.h"
+
+// The ring is shared with other processes, where only the atomics themselves keep order
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+	       "telemetry ring needs lock-free atomics to be shared between processes");
+_Static_assert((FMTELEMETRY_SAMPLES & (FMTELEMETRY_SAMPLES - 1)) == 0, "telemetry ring must be a power of two");
+
+int telemetry_start(struct fmdriverif_state *driver_state, int interval_ms)
+{
+	struct fmtelemetry_ring *ring = atomic_load_explicit(&(driver_state->telemetry), memory_order_acquire);
+	struct stat info;
+	char name[64];
+	int fd, ret;
+
+	// Called with the request lock held, so only one caller maps the ring
+	if (ring == NULL)
+	{
+		if (interval_ms == 0)
+			return 0;
+
+		// Readers on other accounts can watch, but only the tuner writes. There is one
+		// writer per tuner, and it holds a lock on the ring for as long as it has it: another
+		// handle or process on the same tuner gets EBUSY, while the lock on a ring left
+		// behind by a process that died went with it. A ring the writer unlinked while we
+		// were opening it is gone from under the name, so go round again for a new one
+		snprintf(name, sizeof(name), FMTELEMETRY_NAME, driver_state->tuner_id);
+		for (;;)
+		{
+			fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+			if (fd < 0)
+			{
+				ret = errno;
+				perror("telemetry_start() -- shm_open failed");
+				return ret;
+			}
+			if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+			{
+				ret = (errno == EWOULDBLOCK) ? EBUSY : errno;
+				close(fd);
+				return ret;
+			}
+			if (fstat(fd, &info) < 0)
+			{
+				ret = errno;
+				perror("telemetry_start() -- fstat failed");
+				close(fd);
+				return ret;
+			}
+			if (info.st_nlink > 0)
+				break;
+			close(fd);
+		}
+
+		// A ring left behind starts over
+		if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(struct fmtelemetry_ring)) < 0)
+		{
+			ret = errno;
+			perror("telemetry_start() -- ftruncate failed");
+			close(fd);
+			shm_unlink(name);
+			return ret;
+		}
+		ring = (struct fmtelemetry_ring *)mmap(NULL, sizeof(struct fmtelemetry_ring), PROT_READ | PROT_WRITE,
+						       MAP_SHARED, fd, 0);
+		if (ring == MAP_FAILED)
+		{
+			ret = errno;
+			perror("telemetry_start() -- mmap failed");
+			shm_unlink(name);
+			close(fd);
+			return ret;
+		}
+
+		// Kept open, and so locked, until telemetry_close
+		driver_state->telemetry_fd = fd;
+
+		// The slots come zeroed. The magic goes in last, so a reader that opens the ring
+		// early doesn't take it for ready
+		ring->version = FMTELEMETRY_VERSION;
+		ring->capacity = FMTELEMETRY_SAMPLES;
+		ring->tuner_id = driver_state->tuner_id;
+		atomic_init(&(ring->interval_ms), 0);
+		atomic_init(&(ring->head), 0);
+		atomic_thread_fence(memory_order_release);
+		ring->magic = FMTELEMETRY_MAGIC;
+
+		atomic_store_explicit(&(driver_state->telemetry), ring, memory_order_release);
+	}
+
+	// Picked up by the worker when it next works out how long to wait
+	atomic_store_explicit(&(ring->interval_ms), interval_ms, memory_order_relaxed);
+
+	return 0;
+}
+
+void telemetry_close(struct fmdriverif_state *driver_state)
+{
+	struct fmtelemetry_ring *ring = atomic_load_explicit(&(driver_state->telemetry), memory_order_acquire);
+	char name[64];
+
+	if (ring == NULL)
+		return;
+
+	// Readers still mapped keep what was written, and can see sampling has stopped
+	atomic_store_explicit(&(ring->interval_ms), 0, memory_order_relaxed);
+	munmap(ring, sizeof(struct fmtelemetry_ring));
+	atomic_store_explicit(&(driver_state->telemetry), NULL, memory_order_relaxed);
+
+	// Unlinked while we still hold the lock, so nobody takes over the ring we are removing
+	snprintf(name, sizeof(name), FMTELEMETRY_NAME, driver_state->tuner_id);
+	shm_unlink(name);
+	close(driver_state->telemetry_fd);
+	driver_state->telemetry_fd = -1;
+}
+
+bool telemetry_active(struct fmdriverif_state *driver_state)
+{
+	struct fmtelemetry_ring *ring = atomic_load_explicit(&(driver_state->telemetry), memory_order_acquire);
+
+	// As with RDS, only while a station is playing. A synchronous client gets it too --
+	// nothing is posted to it
+	return ring != NULL && atomic_load_explicit(&(ring->interval_ms), memory_order_relaxed) > 0 &&
+	       driver_state->freq_khz > 0 && atomic_load_explicit(&(driver_state->device_up), memory_order_relaxed) &&
+	       (driver_state->power_state == FM_POWER_ON || driver_state->power_state == FM_POWER_WAKE);
+}
+
+uint64_t telemetry_due_ns(struct fmdriverif_state *driver_state)
+{
+	struct fmtelemetry_ring *ring = atomic_load_explicit(&(driver_state->telemetry), memory_order_acquire);
+
+	// From the last sample, so a new interval takes effect straight away
+	return driver_state->telemetry_last_ns +
+	       (uint64_t)atomic_load_explicit(&(ring->interval_ms), memory_order_relaxed) * 1000000ULL;
+}
+
+void telemetry_sample(struct fmdriverif_state *driver_state)
+{
+	struct fmtelemetry_ring *ring = atomic_load_explicit(&(driver_state->telemetry), memory_order_acquire);
+	const struct fmdriver_snapshot *snapshot;
+	struct fmtelemetry_sample sample;
+	struct fmtelemetry_slot *slot;
+	struct video_tuner tuner;
+	unsigned long long head;
+	unsigned int seq;
+	int ret;
+
+	// Runs on the I/O worker, so it never competes with a request for the tuner
+	driver_state->telemetry_last_ns = stats_now_ns();
+
+	// Query into a scratch struct, as a scan does, so the tuner range we keep stays put
+	memset(&tuner, 0, sizeof(tuner));
+	tuner.tuner = driver_state->tuner_info.tuner;
+	if (driver_ioctl(driver_state, VIDIOCGTUNER, &tuner) < 0)
+	{
+		ret = errno;
+		if (ret == ENODEV)
+		{
+			device_detach(driver_state, ret);
+		}
+		return;
+	}
+
+	memset(&sample, 0, sizeof(sample));
+	sample.time_ns = driver_state->telemetry_last_ns;
+	sample.freq_khz = driver_state->freq_khz;
+	sample.signal = (unsigned short)tuner.signal;
+	if (tuner.flags & VIDEO_TUNER_STEREO_ON)
+		sample.flags |= FMTELEMETRY_STEREO;
+	if (tuner.flags & VIDEO_TUNER_RDS_ON)
+		sample.flags |= FMTELEMETRY_RDS;
+	if (driver_state->rds_last_group_ns != 0 &&
+	    sample.time_ns - driver_state->rds_last_group_ns < FMTELEMETRY_LOCK_MS * 1000000ULL)
+		sample.flags |= FMTELEMETRY_RDS_LOCK;
+
+	// Only the worker writes snapshots, so it can read the current one as it stands
+	snapshot = &(driver_state->snapshots[atomic_load_explicit(&(driver_state->snapshot_seq), memory_order_relaxed) & 1]);
+	if (snapshot->rds_valid & FMDRIVER_RDS_PI)
+		sample.pi = snapshot->pi;
+	sample.rds_groups = (unsigned int)driver_state->rds.groups;
+
+	// Odd while the slot is being written. The fence keeps the sample behind the odd count,
+	// so a reader that copies it mid-write sees the count move and throws the copy away
+	head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+	slot = &(ring->slots[head & (FMTELEMETRY_SAMPLES - 1)]);
+	seq = atomic_load_explicit(&(slot->seq), memory_order_relaxed);
+	atomic_store_explicit(&(slot->seq), seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	slot->sample = sample;
+	atomic_store_explicit(&(slot->seq), seq + 2, memory_order_release);
+	atomic_store_explicit(&(ring->head), head + 1, memory_order_release);
+
+	atomic_fetch_add_explicit(&(driver_state->telemetry_samples), 1, memory_order_relaxed);
+}
+
+int fmtelemetry_open(int tuner_id, const struct fmtelemetry_ring **ring_ptr)
+{
+	struct fmtelemetry_ring *ring;
+	struct stat info;
+	char name[64];
+	int fd, ret;
+
+	if (ring_ptr == NULL)
+		return EINVAL;
+
+	snprintf(name, sizeof(name), FMTELEMETRY_NAME, tuner_id);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return errno;
+
+	if (fstat(fd, &info) < 0)
+	{
+		ret = errno;
+		close(fd);
+		return ret;
+	}
+	if (info.st_size < sizeof(struct fmtelemetry_ring))
+	{
+		close(fd);
+		return EPROTO;
+	}
+
+	ring = (struct fmtelemetry_ring *)mmap(NULL, sizeof(struct fmtelemetry_ring), PROT_READ, MAP_SHARED, fd, 0);
+	ret = errno;
+	close(fd);
+	if (ring == MAP_FAILED)
+		return ret;
+
+	if (ring->magic != FMTELEMETRY_MAGIC || ring->version != FMTELEMETRY_VERSION ||
+	    ring->capacity != FMTELEMETRY_SAMPLES)
+	{
+		munmap(ring, sizeof(struct fmtelemetry_ring));
+		return EPROTO;
+	}
+	atomic_thread_fence(memory_order_acquire);
+
+	*ring_ptr = ring;
+	return 0;
+}
+
+void fmtelemetry_close(const struct fmtelemetry_ring *ring)
+{
+	if (ring != NULL)
+	{
+		munmap((void *)ring, sizeof(struct fmtelemetry_ring));
+	}
+}
+
+uint64_t fmtelemetry_head(const struct fmtelemetry_ring *ring)
+{
+	return atomic_load_explicit(&(ring->head), memory_order_acquire);
+}
+
+int fmtelemetry_read(const struct fmtelemetry_ring *ring, uint64_t index, struct fmtelemetry_sample *sample)
+{
+	const struct fmtelemetry_slot *slot = &(ring->slots[index & (FMTELEMETRY_SAMPLES - 1)]);
+	unsigned int expected = (unsigned int)(index / FMTELEMETRY_SAMPLES + 1) * 2;
+
+	if (index >= atomic_load_explicit(&(ring->head), memory_order_acquire))
+		return EAGAIN;
+
+	// Each write to a slot moves its count on by two, so the count says which lap of the
+	// ring the slot holds. Anything else and the sample we want has been written over
+	if (atomic_load_explicit(&(slot->seq), memory_order_acquire) != expected)
+		return EOVERFLOW;
+	*sample = slot->sample;
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&(slot->seq), memory_order_relaxed) != expected)
+		return EOVERFLOW;
+
+	return 0;
+}
+
+// end of file
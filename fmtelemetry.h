@@ -0,0 +1,76 @@
+// File: fmtelemetry.h -- shared-memory signal telemetry from the FM driver interface
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#ifndef FMTELEMETRY_H
+#define FMTELEMETRY_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// A tuner with telemetry on (see fmdriverif_set_telemetry) writes a sample of its signal and
+// flags every interval into a ring in POSIX shared memory, named by tuner id. Any process can
+// map the ring read-only and follow it without system calls or locks, and without ever
+// holding up the tuner. There is one writer, and readers don't consume: each slot carries a
+// sequence count, odd while it is being written, so a reader can tell a sample it copied
+// cleanly from one that was overwritten under it. The writer holds an flock on the ring
+// while it has it, so a second handle on the same tuner, in any process, is turned away
+// with EBUSY rather than sharing the name
+#define FMTELEMETRY_NAME		"/fmtuner-telemetry-%d"
+#define FMTELEMETRY_MAGIC		0x4D544D46	// "FMTM"
+#define FMTELEMETRY_VERSION		1
+#define FMTELEMETRY_SAMPLES		4096		// Ring capacity, a power of two
+#define FMTELEMETRY_CACHE_LINE		64
+
+// Sample flags. Stereo and RDS are as the tuner reports them; RDS lock means groups have
+// been decoded within the last FMTELEMETRY_LOCK_MS
+#define FMTELEMETRY_STEREO		0x01
+#define FMTELEMETRY_RDS			0x02
+#define FMTELEMETRY_RDS_LOCK		0x04
+#define FMTELEMETRY_LOCK_MS		500
+
+struct fmtelemetry_sample
+{
+	uint64_t time_ns;			// CLOCK_MONOTONIC
+	int freq_khz;
+	unsigned short signal;			// 0-65535
+	unsigned short flags;			// FMTELEMETRY_*
+	unsigned short pi;			// 0 until the station has sent one
+	unsigned short reserved;
+	unsigned int rds_groups;		// Decoded since the tuner was opened
+};
+
+struct fmtelemetry_slot
+{
+	atomic_uint seq;
+	struct fmtelemetry_sample sample;
+};
+
+struct fmtelemetry_ring
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int capacity;
+	int tuner_id;
+	atomic_int interval_ms;			// 0 while sampling is off
+
+	// Samples written so far. Sample n is in slot n % capacity until n + capacity is written
+	_Alignas(FMTELEMETRY_CACHE_LINE) atomic_ullong head;
+
+	_Alignas(FMTELEMETRY_CACHE_LINE) struct fmtelemetry_slot slots[FMTELEMETRY_SAMPLES];
+};
+
+// Reader side. Maps tuner_id's ring read-only -- ENOENT if the tuner has never had telemetry
+// turned on, EPROTO if the ring is a layout we don't know
+int fmtelemetry_open(int tuner_id, const struct fmtelemetry_ring **ring_ptr);
+void fmtelemetry_close(const struct fmtelemetry_ring *ring);
+
+// Samples written so far -- the newest is head - 1
+uint64_t fmtelemetry_head(const struct fmtelemetry_ring *ring);
+
+// Copies out sample index. EAGAIN if it hasn't been written yet, EOVERFLOW if the ring has
+// already gone round past it. Neither takes a system call
+int fmtelemetry_read(const struct fmtelemetry_ring *ring, uint64_t index, struct fmtelemetry_sample *sample);
+
+#endif
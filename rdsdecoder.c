@@ -0,0 +1,502 @@
+// File: rdsdecoder.c -- incremental RDS group decoder implementation
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include <pthread.h>
+#include <string.h>
+
+#include "rdsdecoder.h"
+
+// Generator polynomial x^10 + x^8 + x^7 + x^5 + x^4 + x^3 + 1
+#define RDS_POLY		0x5B9
+#define RDS_BLOCK_BITS		26
+#define RDS_CHECK_BITS		10
+
+// RDS group types we decode
+#define RDS_GROUP_PS		0
+#define RDS_GROUP_RT		2
+#define RDS_GROUP_PTYN		10
+
+// AF codes -- 1-204 are frequencies, 205 is filler, 224-249 give the number of codes in the
+// list and 250 says the next code is an LF/MF frequency
+#define RDS_AF_FIRST		1
+#define RDS_AF_LAST		204
+#define RDS_AF_COUNT_BASE	224
+#define RDS_AF_LFMF		250
+
+// Offset words, indexed by enum rds_block. Since the checkword is the remainder of the data
+// plus the offset word, an intact block's remainder is the offset word itself
+const unsigned short rds_offsets[RDS_BLOCK_NONE] = { 0x0FC, 0x198, 0x168, 0x350, 0x1B4 };
+
+// Group position of each block
+const int rds_block_pos[RDS_BLOCK_NONE] = { 0, 1, 2, 2, 3 };
+
+// Lookup tables shared by every decoder. The syndrome is linear in the block bits, so it is
+// the XOR of the remainders of the top 10 bits and the middle byte (the low byte is its own
+// remainder). The correction table maps a syndrome error to the burst that causes it
+unsigned short rds_syndrome_hi[1 << 10];
+unsigned short rds_syndrome_mid[1 << 8];
+unsigned int rds_corrections[1 << RDS_CHECK_BITS];
+pthread_once_t rds_tables_once = PTHREAD_ONCE_INIT;
+
+// Private functions
+unsigned int rds_remainder(unsigned int value);
+void rds_build_tables(void);
+void rds_emit(struct rds_decoder *decoder, enum rds_field field, const void *data, int data_len);
+void rds_push_block(struct rds_decoder *decoder, enum rds_block block, unsigned short data, bool valid);
+void rds_decode_group(struct rds_decoder *decoder);
+void rds_update_text(struct rds_decoder *decoder, enum rds_field field, char *text, char *last, int len,
+		     unsigned int *mask, unsigned int full_mask, bool *sent);
+void rds_update_rt(struct rds_decoder *decoder, bool version_b);
+void rds_update_af(struct rds_decoder *decoder, unsigned char code);
+
+unsigned int rds_remainder(unsigned int value)
+{
+	int bit;
+
+	// Long division -- only used to build the tables
+	for (bit = RDS_BLOCK_BITS - 1; bit >= RDS_CHECK_BITS; bit--)
+	{
+		if (value & (1U << bit))
+			value ^= RDS_POLY << (bit - RDS_CHECK_BITS);
+	}
+
+	return value;
+}
+
+void rds_build_tables(void)
+{
+	unsigned int burst, pattern, syndrome;
+	int len, shift;
+
+	for (pattern = 0; pattern < (1 << 10); pattern++)
+	{
+		rds_syndrome_hi[pattern] = rds_remainder(pattern << 16);
+	}
+	for (pattern = 0; pattern < (1 << 8); pattern++)
+	{
+		rds_syndrome_mid[pattern] = rds_remainder(pattern << 8);
+	}
+
+	// Every burst of up to RDS_MAX_BURST bits starts and ends with an error bit. Shorter
+	// bursts go in first, so they win if two bursts ever share a syndrome
+	memset(rds_corrections, 0, sizeof(rds_corrections));
+	for (len = 1; len <= RDS_MAX_BURST; len++)
+	{
+		for (burst = 0; burst < (1U << len); burst++)
+		{
+			if (!(burst & 1) || !(burst & (1U << (len - 1))))
+				continue;
+
+			for (shift = 0; shift + len <= RDS_BLOCK_BITS; shift++)
+			{
+				pattern = burst << shift;
+				syndrome = rds_remainder(pattern);
+				if (rds_corrections[syndrome] == 0)
+					rds_corrections[syndrome] = pattern;
+			}
+		}
+	}
+}
+
+unsigned int rdsdecoder_syndrome(unsigned int block)
+{
+	return rds_syndrome_hi[(block >> 16) & 0x3FF] ^ rds_syndrome_mid[(block >> 8) & 0xFF] ^ (block & 0xFF);
+}
+
+unsigned int rdsdecoder_encode(unsigned short data, enum rds_block block)
+{
+	unsigned int message = (unsigned int)data << RDS_CHECK_BITS;
+
+	pthread_once(&rds_tables_once, rds_build_tables);
+
+	return message | (rdsdecoder_syndrome(message) ^ rds_offsets[block]);
+}
+
+void rdsdecoder_init(struct rds_decoder *decoder, rds_field_callback emit, void *context)
+{
+	pthread_once(&rds_tables_once, rds_build_tables);
+
+	memset(decoder, 0, sizeof(struct rds_decoder));
+	decoder->emit = emit;
+	decoder->context = context;
+	rdsdecoder_reset(decoder);
+}
+
+void rdsdecoder_reset(struct rds_decoder *decoder)
+{
+	unsigned long blocks = decoder->blocks, corrected = decoder->blocks_corrected;
+	unsigned long bad = decoder->blocks_bad, groups = decoder->groups;
+	rds_field_callback emit = decoder->emit;
+	void *context = decoder->context;
+
+	memset(decoder, 0, sizeof(struct rds_decoder));
+	decoder->emit = emit;
+	decoder->context = context;
+	decoder->last_block = RDS_BLOCK_NONE;
+	decoder->rt_ab = -1;
+	decoder->ptyn_ab = -1;
+	decoder->blocks = blocks;
+	decoder->blocks_corrected = corrected;
+	decoder->blocks_bad = bad;
+	decoder->groups = groups;
+}
+
+void rds_emit(struct rds_decoder *decoder, enum rds_field field, const void *data, int data_len)
+{
+	struct rds_data rds;
+
+	if (decoder->emit == NULL)
+		return;
+
+	rds.field = field;
+	rds.data_length = data_len;
+	memcpy(rds.data, data, data_len);
+	decoder->emit(decoder->context, &rds);
+}
+
+void rdsdecoder_push_raw(struct rds_decoder *decoder, unsigned int block)
+{
+	unsigned int syndrome = rdsdecoder_syndrome(block), error;
+	enum rds_block expected, found;
+	int pos;
+
+	decoder->blocks++;
+
+	if (!decoder->synced)
+	{
+		// Hunt for two blocks in a row whose offsets follow on from each other
+		for (found = RDS_BLOCK_A; found < RDS_BLOCK_NONE; found++)
+		{
+			if (syndrome == rds_offsets[found])
+				break;
+		}
+		if (found != RDS_BLOCK_NONE && decoder->last_block != RDS_BLOCK_NONE &&
+		    rds_block_pos[found] == ((rds_block_pos[decoder->last_block] + 1) & 3))
+		{
+			decoder->synced = true;
+			decoder->bad_blocks = 0;
+			decoder->next_pos = rds_block_pos[found];
+			rds_push_block(decoder, found, block >> RDS_CHECK_BITS, true);
+		}
+		decoder->last_block = found;
+		return;
+	}
+
+	// In sync, so we know where we are in the group. Position 2 can be C or C'
+	pos = decoder->next_pos;
+	expected = (pos == 0) ? RDS_BLOCK_A : (pos == 1) ? RDS_BLOCK_B : (pos == 2) ? RDS_BLOCK_C : RDS_BLOCK_D;
+	if (pos == 2 && syndrome == rds_offsets[RDS_BLOCK_CP])
+		expected = RDS_BLOCK_CP;
+
+	if (syndrome != rds_offsets[expected])
+	{
+		error = rds_corrections[syndrome ^ rds_offsets[expected]];
+		if (pos == 2 && error == 0)
+		{
+			expected = RDS_BLOCK_CP;
+			error = rds_corrections[syndrome ^ rds_offsets[RDS_BLOCK_CP]];
+		}
+		if (error == 0)
+		{
+			decoder->blocks_bad++;
+			rds_push_block(decoder, expected, 0, false);
+			if (++decoder->bad_blocks >= RDS_SYNC_LOSS)
+			{
+				decoder->synced = false;
+				decoder->last_block = RDS_BLOCK_NONE;
+			}
+			return;
+		}
+		block ^= error;
+		decoder->blocks_corrected++;
+	}
+
+	decoder->bad_blocks = 0;
+	rds_push_block(decoder, expected, block >> RDS_CHECK_BITS, true);
+}
+
+void rdsdecoder_push_records(struct rds_decoder *decoder, const unsigned char *records, int num_records)
+{
+	const unsigned char *record;
+	unsigned int block;
+	int i;
+
+	for (i = 0; i < num_records; i++)
+	{
+		record = &(records[i * RDS_RECORD_SIZE]);
+		decoder->blocks++;
+
+		// V4L2 numbers the blocks A, B, C, D, C' -- put C' in its place
+		block = record[2] & RDS_RECORD_BLOCK_MSK;
+		if (block > 4)
+		{
+			decoder->blocks_bad++;
+			continue;
+		}
+		block = (block == 4) ? RDS_BLOCK_CP : (block == 3) ? RDS_BLOCK_D : block;
+
+		if (record[2] & RDS_RECORD_ERROR)
+		{
+			decoder->blocks_bad++;
+			rds_push_block(decoder, block, 0, false);
+			continue;
+		}
+		if (record[2] & RDS_RECORD_CORRECTED)
+			decoder->blocks_corrected++;
+
+		rds_push_block(decoder, block, record[0] | (record[1] << 8), true);
+	}
+}
+
+void rds_push_block(struct rds_decoder *decoder, enum rds_block block, unsigned short data, bool valid)
+{
+	int pos = rds_block_pos[block];
+
+	// A block out of turn means we lost some -- what we have of the group is no use
+	if (pos == 0 || pos != decoder->next_pos)
+	{
+		decoder->group_valid = 0;
+		decoder->version_b = false;
+	}
+	decoder->next_pos = (pos + 1) & 3;
+
+	if (valid)
+	{
+		decoder->group[pos] = data;
+		decoder->group_valid |= 1 << pos;
+		if (block == RDS_BLOCK_CP)
+			decoder->version_b = true;
+	}
+
+	if (pos == 3)
+	{
+		rds_decode_group(decoder);
+		decoder->group_valid = 0;
+		decoder->version_b = false;
+	}
+}
+
+void rds_decode_group(struct rds_decoder *decoder)
+{
+	unsigned short b = decoder->group[1], c = decoder->group[2], d = decoder->group[3];
+	unsigned int valid = decoder->group_valid;
+	unsigned char pi_bytes[2], pty;
+	int type, version_b, ab, seg;
+
+	decoder->groups++;
+
+	// PI is in block A, and repeated in block C' of version B groups
+	if ((valid & 0x1) || ((valid & 0x4) && decoder->version_b))
+	{
+		unsigned short pi = (valid & 0x1) ? decoder->group[0] : c;
+
+		if (pi == decoder->pi_candidate && (!decoder->pi_valid || pi != decoder->pi))
+		{
+			decoder->pi = pi;
+			decoder->pi_valid = true;
+			pi_bytes[0] = pi >> 8;
+			pi_bytes[1] = pi & 0xFF;
+			rds_emit(decoder, RDS_FIELD_PI, pi_bytes, 2);
+		}
+		decoder->pi_candidate = pi;
+	}
+
+	// Everything else hangs off block B
+	if (!(valid & 0x2))
+		return;
+
+	type = b >> 12;
+	version_b = (b >> 11) & 1;
+	pty = (b >> 5) & 0x1F;
+	if (pty == decoder->pty_candidate && (!decoder->pty_valid || pty != decoder->pty))
+	{
+		decoder->pty = pty;
+		decoder->pty_valid = true;
+		rds_emit(decoder, RDS_FIELD_PTY, &pty, 1);
+	}
+	decoder->pty_candidate = pty;
+
+	switch (type)
+	{
+	case RDS_GROUP_PS:
+		// 0A has two AF codes in block C
+		if (!version_b && (valid & 0x4))
+		{
+			rds_update_af(decoder, c >> 8);
+			rds_update_af(decoder, c & 0xFF);
+		}
+
+		// 0A and 0B both carry two PS characters in block D
+		if (!(valid & 0x8))
+			break;
+		seg = b & 0x3;
+		decoder->ps[seg * 2] = d >> 8;
+		decoder->ps[seg * 2 + 1] = d & 0xFF;
+		decoder->ps_mask |= 1 << seg;
+		rds_update_text(decoder, RDS_FIELD_PS, decoder->ps, decoder->ps_last, sizeof(decoder->ps),
+				&(decoder->ps_mask), 0xF, &(decoder->ps_sent));
+		break;
+
+	case RDS_GROUP_RT:
+		// A change of the A/B flag means the station has started new text
+		ab = (b >> 4) & 1;
+		if (ab != decoder->rt_ab)
+		{
+			memset(decoder->rt, ' ', sizeof(decoder->rt));
+			decoder->rt_mask = 0;
+			decoder->rt_ab = ab;
+		}
+		seg = b & 0xF;
+		if (!version_b)
+		{
+			// 2A -- four characters in blocks C and D
+			if ((valid & 0xC) != 0xC)
+				break;
+			decoder->rt[seg * 4] = c >> 8;
+			decoder->rt[seg * 4 + 1] = c & 0xFF;
+			decoder->rt[seg * 4 + 2] = d >> 8;
+			decoder->rt[seg * 4 + 3] = d & 0xFF;
+		}
+		else
+		{
+			// 2B -- two characters in block D, 32 characters at most
+			if (!(valid & 0x8))
+				break;
+			decoder->rt[seg * 2] = d >> 8;
+			decoder->rt[seg * 2 + 1] = d & 0xFF;
+		}
+		decoder->rt_mask |= 1 << seg;
+		rds_update_rt(decoder, version_b);
+		break;
+
+	case RDS_GROUP_PTYN:
+		// 10A only -- four characters in blocks C and D
+		if (version_b || (valid & 0xC) != 0xC)
+			break;
+		ab = (b >> 4) & 1;
+		if (ab != decoder->ptyn_ab)
+		{
+			memset(decoder->ptyn, ' ', sizeof(decoder->ptyn));
+			decoder->ptyn_mask = 0;
+			decoder->ptyn_ab = ab;
+		}
+		seg = b & 0x1;
+		decoder->ptyn[seg * 4] = c >> 8;
+		decoder->ptyn[seg * 4 + 1] = c & 0xFF;
+		decoder->ptyn[seg * 4 + 2] = d >> 8;
+		decoder->ptyn[seg * 4 + 3] = d & 0xFF;
+		decoder->ptyn_mask |= 1 << seg;
+		rds_update_text(decoder, RDS_FIELD_PTYN, decoder->ptyn, decoder->ptyn_last, sizeof(decoder->ptyn),
+				&(decoder->ptyn_mask), 0x3, &(decoder->ptyn_sent));
+		break;
+
+	default:
+		break;
+	}
+}
+
+void rds_update_text(struct rds_decoder *decoder, enum rds_field field, char *text, char *last, int len,
+		     unsigned int *mask, unsigned int full_mask, bool *sent)
+{
+	// Wait until every segment has been received, then report the text if it's new.
+	// Stations repeat their text constantly, so start collecting afresh each time
+	if (*mask != full_mask)
+		return;
+	*mask = 0;
+
+	if (*sent && memcmp(text, last, len) == 0)
+		return;
+
+	memcpy(last, text, len);
+	*sent = true;
+	rds_emit(decoder, field, text, len);
+}
+
+void rds_update_rt(struct rds_decoder *decoder, bool version_b)
+{
+	int seg_chars = (version_b) ? 2 : 4;
+	int max_len = 16 * seg_chars, len, last_seg, seg;
+	char *end;
+
+	// The text runs to a carriage return, or fills every segment if there isn't one
+	end = memchr(decoder->rt, '\r', max_len);
+	len = (end != NULL) ? (int)(end - decoder->rt) : max_len;
+	last_seg = (end != NULL) ? len / seg_chars : 15;
+
+	// All the segments up to the end of the text have to be in
+	for (seg = 0; seg <= last_seg; seg++)
+	{
+		if (!(decoder->rt_mask & (1U << seg)))
+			return;
+	}
+	decoder->rt_mask = 0;
+
+	// Trailing spaces are padding
+	while (len > 0 && decoder->rt[len - 1] == ' ')
+		len--;
+
+	if (len == decoder->rt_last_len && memcmp(decoder->rt, decoder->rt_last, len) == 0)
+		return;
+
+	memcpy(decoder->rt_last, decoder->rt, len);
+	decoder->rt_last_len = len;
+	rds_emit(decoder, RDS_FIELD_RT, decoder->rt, len);
+}
+
+void rds_update_af(struct rds_decoder *decoder, unsigned char code)
+{
+	unsigned char data[2 + RDS_AF_MAX];
+	int i;
+
+	if (decoder->af_skip)
+	{
+		// No use to an FM tuner
+		decoder->af_skip = false;
+		return;
+	}
+	if (code == RDS_AF_LFMF)
+	{
+		decoder->af_skip = true;
+		return;
+	}
+
+	// A count starts the list over. Stations repeat it constantly, as with the text fields
+	if (code >= RDS_AF_COUNT_BASE && code <= RDS_AF_COUNT_BASE + RDS_AF_MAX)
+	{
+		decoder->af_expected = code - RDS_AF_COUNT_BASE;
+		decoder->af_received = 0;
+		decoder->af_count = 0;
+		return;
+	}
+	if (code < RDS_AF_FIRST || code > RDS_AF_LAST || decoder->af_received >= decoder->af_expected)
+		return;
+	decoder->af_received++;
+
+	// Method B lists pair every alternative with the tuned frequency, so it comes round
+	// again and again -- only keep it once
+	for (i = decoder->af_count; i > 0 && decoder->af[i - 1] > code; i--)
+		;
+	if (i == 0 || decoder->af[i - 1] != code)
+	{
+		memmove(&(decoder->af[i + 1]), &(decoder->af[i]), decoder->af_count - i);
+		decoder->af[i] = code;
+		decoder->af_count++;
+	}
+
+	// A list is only any use with the PI it belongs to
+	if (decoder->af_received < decoder->af_expected || !decoder->pi_valid)
+		return;
+	if (decoder->af_count == decoder->af_last_count && memcmp(decoder->af, decoder->af_last, decoder->af_count) == 0)
+		return;
+
+	memcpy(decoder->af_last, decoder->af, decoder->af_count);
+	decoder->af_last_count = decoder->af_count;
+	data[0] = decoder->pi >> 8;
+	data[1] = decoder->pi & 0xFF;
+	memcpy(&(data[2]), decoder->af, decoder->af_count);
+	rds_emit(decoder, RDS_FIELD_AF, data, 2 + decoder->af_count);
+}
+
+// end of file
@@ -0,0 +1,109 @@
+// File: rdsdecoder.h -- incremental RDS group decoder
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#ifndef RDSDECODER_H
+#define RDSDECODER_H
+
+#include <stdbool.h>
+
+#include "fmdriverif.h"
+
+// An RDS block is 26 bits -- 16 data bits followed by a 10 bit checkword that has an offset
+// word added, so the receiver can tell which block of the group it is looking at
+enum rds_block
+{
+	RDS_BLOCK_A,
+	RDS_BLOCK_B,
+	RDS_BLOCK_C,
+	RDS_BLOCK_CP,		// C', block 3 of a version B group
+	RDS_BLOCK_D,
+	RDS_BLOCK_NONE
+};
+
+// Longest error burst corrected in a block. Correction is only tried once the decoder is
+// in sync, so it knows which offset word to expect
+#define RDS_MAX_BURST		5
+
+// Consecutive bad blocks before the decoder drops sync and hunts for block boundaries again
+#define RDS_SYNC_LOSS		8
+
+// V4L2 RDS records, as read from the radio fd -- data LSB, data MSB, then block info
+#define RDS_RECORD_SIZE		3
+#define RDS_RECORD_BLOCK_MSK	0x07
+#define RDS_RECORD_CORRECTED	0x40
+#define RDS_RECORD_ERROR	0x80
+
+// Called with each field that is complete and differs from what was last reported
+typedef void (*rds_field_callback)(void *context, const struct rds_data *field);
+
+struct rds_decoder
+{
+	rds_field_callback emit;
+	void *context;
+
+	// Block sync, raw block input only
+	bool synced;
+	enum rds_block last_block;		// Previous block while hunting for sync
+	int bad_blocks;				// Consecutive uncorrectable blocks
+
+	// Group being assembled
+	int next_pos;				// Group position the next block should take
+	unsigned short group[4];
+	unsigned int group_valid;		// Bit per group position
+	bool version_b;				// Block 3 arrived as C'
+
+	// PI and PTY only count once they have been received twice running
+	unsigned short pi, pi_candidate;
+	bool pi_valid;
+	unsigned char pty, pty_candidate;
+	bool pty_valid;
+
+	// Text fields are built up segment by segment. Each has a mask of the segments
+	// received and a copy of the last version reported
+	char ps[8], ps_last[8];
+	unsigned int ps_mask;
+	char rt[RDS_DATA_MAX], rt_last[RDS_DATA_MAX];
+	unsigned int rt_mask;
+	int rt_last_len;
+	int rt_ab;				// Text A/B flag, a change means new text
+	char ptyn[8], ptyn_last[8];
+	unsigned int ptyn_mask;
+	int ptyn_ab;
+	bool ps_sent, ptyn_sent;
+
+	// Alternative frequencies from 0A groups -- a count, then the codes. They are kept in
+	// order so a repeat of the same list is recognised
+	unsigned char af[RDS_AF_MAX], af_last[RDS_AF_MAX];
+	int af_count, af_last_count;
+	int af_expected, af_received;		// Codes in the list, and those seen so far
+	bool af_skip;				// Next code is an LF/MF frequency
+
+	// Statistics
+	unsigned long blocks;
+	unsigned long blocks_corrected;
+	unsigned long blocks_bad;
+	unsigned long groups;
+};
+
+// Decoder setup. The callback runs on the thread that pushes blocks
+void rdsdecoder_init(struct rds_decoder *decoder, rds_field_callback emit, void *context);
+
+// Forgets everything about the current station, e.g. after a retune. Statistics are kept
+void rdsdecoder_reset(struct rds_decoder *decoder);
+
+// Raw input -- one 26 bit block per call, checkword in the low 10 bits. The decoder finds
+// block boundaries from the syndromes and corrects burst errors
+void rdsdecoder_push_raw(struct rds_decoder *decoder, unsigned int block);
+
+// Driver input -- V4L2 records, where the tuner has already checked each block
+void rdsdecoder_push_records(struct rds_decoder *decoder, const unsigned char *records, int num_records);
+
+// Builds a raw block with its checkword, for generating test streams
+unsigned int rdsdecoder_encode(unsigned short data, enum rds_block block);
+
+// Syndrome of a raw block -- equal to the block's offset word if it was received intact
+unsigned int rdsdecoder_syndrome(unsigned int block);
+
+#endif
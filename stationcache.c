@@ -0,0 +1,293 @@
+// File: stationcache.c -- persistent memory-mapped station cache implementation
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stationcache.h"
+
+// Every region's channels have to fit in its records
+#define STATIONCACHE_CHECK(region, low_khz, high_khz, spacing_khz) \
+	_Static_assert(((high_khz) - (low_khz)) / (spacing_khz) < STATIONCACHE_CHANNELS, #region " has too many channels");
+FM_REGION_LIST(STATIONCACHE_CHECK)
+_Static_assert(sizeof(struct station_cache_header) <= STATIONCACHE_HEADER_SIZE, "station cache header too big");
+
+// Private functions
+void stationcache_reset(struct station_cache *cache);
+struct station_record *stationcache_record(struct station_cache *cache, enum fm_region region, int freq_khz);
+
+void stationcache_reset(struct station_cache *cache)
+{
+	memset(cache->header, 0, cache->map_len);
+	cache->header->magic = STATIONCACHE_MAGIC;
+	cache->header->version = STATIONCACHE_VERSION;
+	cache->header->record_size = sizeof(struct station_record);
+	cache->header->regions = STATIONCACHE_REGIONS;
+	cache->header->channels = STATIONCACHE_CHANNELS;
+}
+
+struct station_record *stationcache_record(struct station_cache *cache, enum fm_region region, int freq_khz)
+{
+	int channel;
+
+	// Off the region's grid is -1, as is a region we don't know
+	channel = fmdriverif_region_channel(region, freq_khz);
+	if (channel < 0)
+		return NULL;
+
+	return &(cache->records[region * STATIONCACHE_CHANNELS + channel]);
+}
+
+int stationcache_open(const char *path, struct station_cache **cache_ptr)
+{
+	struct station_cache *cache;
+	struct stat file_stat;
+	void *map;
+	int ret;
+
+	*cache_ptr = NULL;
+
+	cache = (struct station_cache *)calloc(1, sizeof(struct station_cache));
+	if (cache == NULL)
+	{
+		fprintf(stderr, "stationcache_open() -- failed to allocate cache\n");
+		return ENOMEM;
+	}
+
+	cache->map_len = STATIONCACHE_HEADER_SIZE + (size_t)STATIONCACHE_REGIONS * STATIONCACHE_CHANNELS * sizeof(struct station_record);
+
+	cache->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (cache->fd < 0)
+	{
+		ret = errno;
+		perror("stationcache_open() -- failed to open cache file");
+		free(cache);
+		return ret;
+	}
+
+	// A new file, or one from a different layout, is sized up and reset after mapping
+	if (fstat(cache->fd, &file_stat) != 0 || (size_t)file_stat.st_size != cache->map_len)
+	{
+		if (ftruncate(cache->fd, 0) != 0 || ftruncate(cache->fd, cache->map_len) != 0)
+		{
+			ret = errno;
+			perror("stationcache_open() -- failed to size cache file");
+			close(cache->fd);
+			free(cache);
+			return ret;
+		}
+	}
+
+	map = mmap(NULL, cache->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+	if (map == MAP_FAILED)
+	{
+		ret = errno;
+		perror("stationcache_open() -- failed to map cache file");
+		close(cache->fd);
+		free(cache);
+		return ret;
+	}
+	cache->header = (struct station_cache_header *)map;
+	cache->records = (struct station_record *)((char *)map + STATIONCACHE_HEADER_SIZE);
+
+	if (cache->header->magic != STATIONCACHE_MAGIC ||
+	    cache->header->version != STATIONCACHE_VERSION ||
+	    cache->header->record_size != sizeof(struct station_record) ||
+	    cache->header->regions != STATIONCACHE_REGIONS ||
+	    cache->header->channels != STATIONCACHE_CHANNELS)
+	{
+		stationcache_reset(cache);
+	}
+
+	*cache_ptr = cache;
+
+	return 0;
+}
+
+int stationcache_close(struct station_cache *cache)
+{
+	int ret = 0;
+
+	if (cache == NULL)
+		return EINVAL;
+
+	// Updates are already in the page cache -- just start them on their way to disk
+	msync(cache->header, cache->map_len, MS_ASYNC);
+	if (munmap(cache->header, cache->map_len) != 0)
+	{
+		ret = errno;
+		perror("stationcache_close() -- failed on munmap");
+	}
+	close(cache->fd);
+	free(cache);
+
+	return ret;
+}
+
+const struct station_record *stationcache_lookup(struct station_cache *cache, enum fm_region region, int freq_khz)
+{
+	struct station_record *record = stationcache_record(cache, region, freq_khz);
+
+	if (record == NULL || record->freq == 0)
+		return NULL;
+
+	return record;
+}
+
+int stationcache_get_stations(struct station_cache *cache, enum fm_region region,
+			      struct fmdriver_station *stations, int max_stations, int *num_stations)
+{
+	struct station_record *record;
+	int i;
+
+	*num_stations = 0;
+	if (region < FM_REGION_AMERICAS || region > FM_REGION_OTHER)
+		return EINVAL;
+
+	// Records are in frequency order, so the list comes out sorted
+	record = &(cache->records[region * STATIONCACHE_CHANNELS]);
+	for (i = 0; i < fm_region_bands[region].num_channels && *num_stations < max_stations; i++, record++)
+	{
+		if (record->valid & STATIONCACHE_HAS_SIGNAL)
+		{
+			stations[*num_stations].freq = record->freq;
+			stations[*num_stations].signal = record->signal;
+			stations[*num_stations].flags = record->flags;
+			(*num_stations)++;
+		}
+	}
+
+	return 0;
+}
+
+int stationcache_update_rds(struct station_cache *cache, enum fm_region region, int freq_khz,
+			    const struct rds_data *rds)
+{
+	struct station_record *record = stationcache_record(cache, region, freq_khz);
+	int len;
+
+	if (record == NULL || rds->data_length < 0)
+		return EINVAL;
+
+	switch (rds->field)
+	{
+	case RDS_FIELD_PI:
+		if (rds->data_length < 2)
+			return EINVAL;
+		record->pi = (rds->data[0] << 8) | rds->data[1];
+		record->valid |= STATIONCACHE_HAS_PI;
+		break;
+
+	case RDS_FIELD_PTY:
+		if (rds->data_length < 1)
+			return EINVAL;
+		record->pty = rds->data[0];
+		record->valid |= STATIONCACHE_HAS_PTY;
+		break;
+
+	case RDS_FIELD_PS:
+		len = (rds->data_length < sizeof(record->ps)) ? rds->data_length : sizeof(record->ps);
+		memset(record->ps, 0, sizeof(record->ps));
+		memcpy(record->ps, rds->data, len);
+		record->valid |= STATIONCACHE_HAS_PS;
+		break;
+
+	case RDS_FIELD_PTYN:
+		len = (rds->data_length < sizeof(record->ptyn)) ? rds->data_length : sizeof(record->ptyn);
+		memset(record->ptyn, 0, sizeof(record->ptyn));
+		memcpy(record->ptyn, rds->data, len);
+		record->valid |= STATIONCACHE_HAS_PTYN;
+		break;
+
+	default:
+		// Radio text changes too often to be worth keeping
+		return 0;
+	}
+
+	record->freq = freq_khz;
+	record->last_seen = (unsigned int)time(NULL);
+
+	return 0;
+}
+
+int stationcache_update_scan(struct station_cache *cache, enum fm_region region,
+			     const struct fmdriver_station *stations, int num_stations)
+{
+	struct station_record *record;
+	unsigned int now = (unsigned int)time(NULL);
+	int i;
+
+	if (region < FM_REGION_AMERICAS || region > FM_REGION_OTHER)
+		return EINVAL;
+
+	// The new scan replaces the old station list, but what we know about each station's
+	// RDS stays put in case it comes back
+	record = &(cache->records[region * STATIONCACHE_CHANNELS]);
+	for (i = 0; i < fm_region_bands[region].num_channels; i++, record++)
+	{
+		record->valid &= ~STATIONCACHE_HAS_SIGNAL;
+	}
+
+	for (i = 0; i < num_stations; i++)
+	{
+		record = stationcache_record(cache, region, stations[i].freq);
+		if (record == NULL)
+			continue;
+
+		record->freq = stations[i].freq;
+		record->signal = stations[i].signal;
+		record->flags = stations[i].flags;
+		record->valid |= STATIONCACHE_HAS_SIGNAL;
+		record->last_seen = now;
+	}
+
+	return 0;
+}
+
+int stationcache_set_last_freq(struct station_cache *cache, enum fm_region region, int freq_khz)
+{
+	if (region < FM_REGION_AMERICAS || region > FM_REGION_OTHER)
+		return EINVAL;
+
+	cache->header->last_freq[region] = freq_khz;
+
+	return 0;
+}
+
+int stationcache_get_last_freq(struct station_cache *cache, enum fm_region region)
+{
+	if (region < FM_REGION_AMERICAS || region > FM_REGION_OTHER)
+		return 0;
+
+	return cache->header->last_freq[region];
+}
+
+int stationcache_set_region(struct station_cache *cache, enum fm_region region)
+{
+	if (region < FM_REGION_AMERICAS || region > FM_REGION_OTHER)
+		return EINVAL;
+
+	cache->header->region = region;
+
+	return 0;
+}
+
+enum fm_region stationcache_get_region(struct station_cache *cache)
+{
+	// A new cache starts out in the Americas
+	if (cache->header->region < FM_REGION_AMERICAS || cache->header->region > FM_REGION_OTHER)
+		return FM_REGION_AMERICAS;
+
+	return cache->header->region;
+}
+
+// end of file
@@ -0,0 +1,89 @@
+// File: stationcache.h -- persistent memory-mapped station cache
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#ifndef STATIONCACHE_H
+#define STATIONCACHE_H
+
+#include <stddef.h>
+
+#include "fmdriverif.h"
+
+// The cache file is a header followed by one fixed-size record for every channel of every
+// region, so a station is found by indexing rather than searching. Each region's records
+// are its channels, numbered as by fmdriverif_region_channel, with room for the 50kHz grid
+// of FM_REGION_OTHER
+#define STATIONCACHE_MAGIC		0x43534D46	// "FMSC"
+#define STATIONCACHE_VERSION		2
+#define STATIONCACHE_REGIONS		FM_REGIONS
+#define STATIONCACHE_CHANNELS		416
+// The header is padded out so the records start on a cache line
+#define STATIONCACHE_HEADER_SIZE	64
+
+// Fields held in a station record
+#define STATIONCACHE_HAS_PI		0x01
+#define STATIONCACHE_HAS_PS		0x02
+#define STATIONCACHE_HAS_PTY		0x04
+#define STATIONCACHE_HAS_PTYN		0x08
+#define STATIONCACHE_HAS_SIGNAL		0x10	// Found by the last scan
+
+// On-disk layout -- one cache line per record. Strings are not terminated
+struct station_record
+{
+	int freq;			// kHz, 0 if nothing is known about the channel
+	unsigned short valid;		// STATIONCACHE_HAS_* flags
+	unsigned short pi;
+	unsigned short signal;		// Signal strength at the last scan
+	unsigned char pty;
+	unsigned char flags;		// FMDRIVER_TUNER_* flags at the last scan
+	unsigned int last_seen;		// Seconds since the epoch of the last update
+	char ps[8];
+	char ptyn[8];
+	unsigned char reserved[32];
+};
+
+struct station_cache_header
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int record_size;
+	unsigned int regions;
+	unsigned int channels;
+	int last_freq[STATIONCACHE_REGIONS];	// Last station tuned in each region, kHz
+	int region;				// Region last used
+};
+
+// An open cache. The header and records point straight into the mapping
+struct station_cache
+{
+	int fd;
+	size_t map_len;
+	struct station_cache_header *header;
+	struct station_record *records;
+};
+
+// Opens the cache at path, creating it if it doesn't exist. A file with the wrong layout
+// is reset rather than rejected -- it only holds data that can be found again
+int stationcache_open(const char *path, struct station_cache **cache_ptr);
+int stationcache_close(struct station_cache *cache);
+
+// Returns the record for a station, or NULL if the frequency is off the grid or nothing
+// is known about it. The record stays valid until the cache is closed
+const struct station_record *stationcache_lookup(struct station_cache *cache, enum fm_region region, int freq_khz);
+
+// Lists the stations found by the last scan in a region, in frequency order
+int stationcache_get_stations(struct station_cache *cache, enum fm_region region,
+			      struct fmdriver_station *stations, int max_stations, int *num_stations);
+
+// Incremental updates, written straight through to the mapping
+int stationcache_update_rds(struct station_cache *cache, enum fm_region region, int freq_khz,
+			    const struct rds_data *rds);
+int stationcache_update_scan(struct station_cache *cache, enum fm_region region,
+			     const struct fmdriver_station *stations, int num_stations);
+int stationcache_set_last_freq(struct station_cache *cache, enum fm_region region, int freq_khz);
+int stationcache_get_last_freq(struct station_cache *cache, enum fm_region region);
+int stationcache_set_region(struct station_cache *cache, enum fm_region region);
+enum fm_region stationcache_get_region(struct station_cache *cache);
+
+#endif
@@ -0,0 +1,64 @@
+// File: tunerprops.c -- property names of the Javascript FMTuner object
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#include "tunerprops.h"
+
+const char *tunerprops_names[TUNER_PROPS] =
+{
+	"PICode", "PS", "PTY", "PTYN", "RT", "Frequency", "Volume", "Region", "Stats"
+};
+
+enum tuner_prop tunerprops_lookup(const unsigned short *chars, size_t len)
+{
+	enum tuner_prop prop;
+	const char *name;
+	size_t i;
+
+	if (chars == NULL)
+		return TUNER_PROP_NONE;
+
+	// Only the two-character and six-character names share a length, and those differ
+	// in their first character
+	switch (len)
+	{
+	case 2:
+		prop = (chars[0] == 'P') ? TUNER_PROP_PS : TUNER_PROP_RT;
+		break;
+	case 3:
+		prop = TUNER_PROP_PTY;
+		break;
+	case 4:
+		prop = TUNER_PROP_PTYN;
+		break;
+	case 5:
+		prop = TUNER_PROP_STATS;
+		break;
+	case 6:
+		if (chars[0] == 'P')
+			prop = TUNER_PROP_PICODE;
+		else if (chars[0] == 'V')
+			prop = TUNER_PROP_VOLUME;
+		else
+			prop = TUNER_PROP_REGION;
+		break;
+	case 9:
+		prop = TUNER_PROP_FREQUENCY;
+		break;
+	default:
+		return TUNER_PROP_NONE;
+	}
+
+	// The one candidate has the right length -- check it is really the name
+	name = tunerprops_names[prop];
+	for (i = 0; i < len; i++)
+	{
+		if (chars[i] != (unsigned char)name[i])
+			return TUNER_PROP_NONE;
+	}
+
+	return prop;
+}
+
+// end of file
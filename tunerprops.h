@@ -0,0 +1,38 @@
+// File: tunerprops.h -- property names of the Javascript FMTuner object
+// Author: David Switzer
+// Project: FmTuner, WebKit-based FM tuner UI
+// (c) 2012, David Switzer
+
+#ifndef TUNERPROPS_H
+#define TUNERPROPS_H
+
+#include <stddef.h>
+
+// FMTuner's properties. The string-valued station fields come first, so they can be
+// walked as a range
+enum tuner_prop
+{
+	TUNER_PROP_NONE = -1,
+	TUNER_PROP_PICODE,
+	TUNER_PROP_PS,
+	TUNER_PROP_PTY,
+	TUNER_PROP_PTYN,
+	TUNER_PROP_RT,
+	TUNER_PROP_FREQUENCY,
+	TUNER_PROP_VOLUME,
+	TUNER_PROP_REGION,
+	TUNER_PROP_STATS,
+	TUNER_PROPS
+};
+
+#define TUNER_PROP_STRINGS	(TUNER_PROP_RT + 1)
+
+// Names as the page sees them, indexed by enum tuner_prop
+extern const char *tunerprops_names[TUNER_PROPS];
+
+// Finds the property with a name given as UTF-16, the way JavaScriptCore holds it, so a
+// lookup needs no conversion. The length and first character are a perfect hash over the
+// names, so at most one name is compared. TUNER_PROP_NONE if it isn't one of ours
+enum tuner_prop tunerprops_lookup(const unsigned short *chars, size_t len);
+
+#endif